@@ -0,0 +1,66 @@
+/// animation.hpp: Rendering sequences of frames.
+
+#ifndef RAY_ANIMATION_HPP
+#define RAY_ANIMATION_HPP
+
+#include "bitmap.hpp"
+#include "scene-generators.hpp"
+#include "thread-pool.hpp"
+
+#include <functional>
+#include <ostream>
+#include <vector>
+
+namespace ray {
+
+/// Statistics about a call to \c render_animation.
+struct AnimationStats {
+  /// The time from the start of the first frame's build to the end of the
+  /// last frame's write.
+  double total_seconds = 0.0;
+
+  /// Per frame: the time spent in each stage of the pipeline.
+  std::vector<double> build_seconds;
+  std::vector<double> render_seconds;
+  std::vector<double> write_seconds;
+
+  void print(std::ostream &out) const {
+    auto sum = [](const std::vector<double> &seconds) {
+      double total = 0.0;
+      for (double s : seconds)
+        total += s;
+      return total * 1000.0;
+    };
+    out << "[Animation: " << build_seconds.size()
+        << " frames Total: " << total_seconds * 1000.0
+        << "ms Build: " << sum(build_seconds)
+        << "ms Render: " << sum(render_seconds)
+        << "ms Write: " << sum(write_seconds) << "ms]";
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const AnimationStats &s) {
+  s.print(out);
+  return out;
+}
+
+/// Called with the index and the image of each frame of an animation.
+typedef std::function<void(unsigned, const Bitmap &)> FrameWriterTy;
+
+/// Render frames 0 to \p frame_count - 1 of the animation built by \p setup,
+/// where frame i is at time i / \p frames_per_second, and hand them to
+/// \p write_frame in order.
+///
+/// Frames go through three stages: \p setup builds the scene (and its
+/// bounding volume hierarchy, if \p setup doesn't), \c Camera::snap renders it
+/// with the threads in \p pool, and \p write_frame writes it out.  The stages
+/// run as a pipeline, so frame i + 1 is built and frame i - 1 is written
+/// while frame i renders, and the render threads don't wait for scene setup
+/// or I/O between frames.  Frames are rendered and written one at a time.
+void render_animation(const SceneGeneratorTy &setup, unsigned frame_count,
+                      double frames_per_second, ThreadPool &pool,
+                      const FrameWriterTy &write_frame,
+                      AnimationStats *stats = nullptr);
+}
+
+#endif
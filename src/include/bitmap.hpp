@@ -6,6 +6,7 @@
 #define RAY_BITMAP_HPP
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <ostream>
@@ -13,16 +14,19 @@
 namespace ray {
 
 /// Represents a color in RGB.
+///
+/// The channels are laid out in the order BMP files store them, so that a
+/// Bitmap can live in the pixel array of a mapped BMP file.
 class Color {
-  uint8_t _red = 0;
-  uint8_t _green = 0;
   uint8_t _blue = 0;
+  uint8_t _green = 0;
+  uint8_t _red = 0;
 
 public:
   Color() {}
 
   explicit Color(uint8_t red, uint8_t green, uint8_t blue)
-      : _red(red), _green(green), _blue(blue) {}
+      : _blue(blue), _green(green), _red(red) {}
 
   uint8_t red() const { return _red; }
   uint8_t green() const { return _green; }
@@ -59,25 +63,207 @@ inline Color operator+(const Color &c0, const Color &c1) {
                clamp(uint16_t(c0.blue()) + uint16_t(c1.blue())));
 }
 
-/// An in-memory representation of a bitmap.
+static_assert(sizeof(Color) == 3, "Expected packed colors!");
+
+/// Represents a color in linear RGB with floating point channels, where 1 is
+/// the full intensity of a channel of a Color.
+///
+/// Shading works with these instead of Colors, which clamp and truncate to 8
+/// bits every time they are scaled or added, so that light that bounces
+/// between mirrors or is averaged over many samples keeps its precision.
+class HdrColor {
+  float _red = 0.0f;
+  float _green = 0.0f;
+  float _blue = 0.0f;
+
+public:
+  HdrColor() {}
+
+  explicit HdrColor(float red, float green, float blue)
+      : _red(red), _green(green), _blue(blue) {}
+
+  explicit HdrColor(const Color &c)
+      : _red(c.red() / 255.0f), _green(c.green() / 255.0f),
+        _blue(c.blue() / 255.0f) {}
+
+  float red() const { return _red; }
+  float green() const { return _green; }
+  float blue() const { return _blue; }
+
+  HdrColor operator*(float f) const {
+    assert(f >= 0.0 && "Can't scale to negative!");
+    return HdrColor(red() * f, green() * f, blue() * f);
+  }
+
+  HdrColor &operator+=(const HdrColor &other) {
+    _red += other.red();
+    _green += other.green();
+    _blue += other.blue();
+    return *this;
+  }
+
+  /// Tone map to a Color, clamping each channel to [0, 1] and rounding it to
+  /// the nearest of the 256 levels.
+  Color to_color() const {
+    auto quantize = [](float x) {
+      if (!(x > 0.0f))
+        return uint8_t(0);
+      if (x >= 1.0f)
+        return uint8_t(255);
+      return uint8_t(x * 255.0f + 0.5f);
+    };
+    return Color(quantize(red()), quantize(green()), quantize(blue()));
+  }
+
+  static HdrColor create_white() { return HdrColor(1.0f, 1.0f, 1.0f); }
+  static HdrColor create_black() { return HdrColor(0.0f, 0.0f, 0.0f); }
+  static HdrColor create_blue() { return HdrColor(0.0f, 0.0f, 1.0f); }
+};
+
+inline HdrColor operator+(const HdrColor &c0, const HdrColor &c1) {
+  HdrColor sum = c0;
+  sum += c1;
+  return sum;
+}
+
+/// Unmaps the \c size bytes mapped at the pointer it is given.
+struct Unmapper {
+  size_t size = 0;
+  void operator()(uint8_t *mapping) const;
+};
+
+/// A two dimensional array of pixels, either in memory or in a BMP file that
+/// is mapped into memory.
 class Bitmap {
   unsigned _height;
   unsigned _width;
+
+  /// The address of pixel (0, 0), and the distances in bytes from a pixel to
+  /// the one to its right and to the one below it.  These are negative for
+  /// mapped files, whose rows go from the bottom up and from right to left.
+  uint8_t *_origin;
+  ptrdiff_t _pixel_stride;
+  ptrdiff_t _row_stride;
+
+  /// The memory the pixels live in: one of these is set.
   std::unique_ptr<Color[]> _image;
+  std::unique_ptr<uint8_t, Unmapper> _mapping;
+
+  uint8_t *address(unsigned x, unsigned y) const {
+    assert(x < width() && y < height() && "Out of bounds!");
+    return _origin + ptrdiff_t(y) * _row_stride + ptrdiff_t(x) * _pixel_stride;
+  }
 
 public:
   Bitmap(unsigned height, unsigned width, Color background);
 
+  /// Create (or truncate) the file at \p path as a BMP file of \p width x
+  /// \p height pixels, and return a bitmap whose pixels are those of the
+  /// file, mapped into memory.  Pixels written to the bitmap go to the file
+  /// through the page cache, so the file is complete once the bitmap is
+  /// destroyed, without a copy of the image in memory or a call to \c write.
+  /// The pixels start out black.  Returns null if the file can't be created
+  /// or mapped.
+  static std::unique_ptr<Bitmap>
+  create_mapped_file(const char *path, unsigned height, unsigned width);
+
   Color &at(unsigned x, unsigned y) {
-    assert(x < width() && y < height() && "Out of bounds!");
-    return _image[y * width() + x];
+    return *reinterpret_cast<Color *>(address(x, y));
+  }
+
+  const Color &at(unsigned x, unsigned y) const {
+    return *reinterpret_cast<const Color *>(address(x, y));
   }
 
   unsigned height() const { return _height; }
   unsigned width() const { return _width; }
   unsigned pixel_count() const { return height() * width(); }
+  bool is_mapped() const { return _mapping != nullptr; }
+
+  void write(std::ostream &out) const;
+
+  /// Write the headers of a BMP file of \p width x \p height pixels whose
+  /// rows go from the top down, unlike those of the files \c write writes,
+  /// so that rows can be written out as soon as they are rendered.
+  static void write_top_down_header(std::ostream &out, unsigned width,
+                                    unsigned height);
+};
+
+/// Receives an image a band of rows at a time, from the top row down, e.g.
+/// as \c Camera::snap_streaming renders them.  The functions return false if
+/// the sink failed, in which case no more rows should be sent.
+class ImageSink {
+public:
+  virtual ~ImageSink() {}
+
+  /// Called once, before any rows, with the size of the image.
+  virtual bool begin(unsigned width, unsigned height) = 0;
+
+  /// Called with the next rows of the image, which start at row
+  /// \p first_row of the image and are as wide as the image.
+  virtual bool write_rows(const Bitmap &band, unsigned first_row) = 0;
+
+  /// Called once after the last row.
+  virtual bool end() = 0;
+};
+
+/// An ImageSink that copies the image into a Bitmap of the same size.
+class BitmapSink : public ImageSink {
+  Bitmap &_bmp;
+
+public:
+  explicit BitmapSink(Bitmap &bmp) : _bmp(bmp) {}
+
+  bool begin(unsigned width, unsigned height) override {
+    return width == _bmp.width() && height == _bmp.height();
+  }
+
+  bool write_rows(const Bitmap &band, unsigned first_row) override {
+    assert(band.width() == _bmp.width() &&
+           first_row + band.height() <= _bmp.height() && "Out of bounds!");
+    for (unsigned y = 0; y < band.height(); y++)
+      for (unsigned x = 0; x < band.width(); x++)
+        _bmp.at(x, first_row + y) = band.at(x, y);
+    return true;
+  }
+
+  bool end() override { return true; }
+};
+
+/// A two dimensional array of HdrColors: an image before tone mapping, as
+/// \c Camera::snap_hdr renders it.
+class HdrBitmap {
+  unsigned _height;
+  unsigned _width;
+  std::unique_ptr<HdrColor[]> _image;
+
+public:
+  HdrBitmap(unsigned height, unsigned width, HdrColor background);
+
+  HdrColor &at(unsigned x, unsigned y) {
+    assert(x < width() && y < height() && "Out of bounds!");
+    return _image[uint64_t(y) * width() + x];
+  }
+
+  const HdrColor &at(unsigned x, unsigned y) const {
+    assert(x < width() && y < height() && "Out of bounds!");
+    return _image[uint64_t(y) * width() + x];
+  }
+
+  unsigned height() const { return _height; }
+  unsigned width() const { return _width; }
+  uint64_t pixel_count() const { return uint64_t(height()) * width(); }
+
+  /// Tone map rows [\p first_row, \p end_row) into the same rows of \p out,
+  /// which must be the same size as this bitmap.
+  void tone_map(Bitmap &out, unsigned first_row, unsigned end_row) const;
+
+  /// Return the tone mapped image.
+  Bitmap tone_map() const;
 
-  void write(std::ostream &out);
+  /// Write the image to \p out as a PFM file, i.e. as raw little endian
+  /// floats, oriented as \c Bitmap::write orients it.
+  void write_pfm(std::ostream &out) const;
 };
 }
 
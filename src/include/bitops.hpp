@@ -3,17 +3,21 @@
 
 /// bitops.hpp: bit manipulation helpers.
 
+#include <cassert>
 #include <cstdint>
+#include <utility>
 
 namespace ray {
 
 struct Bitops {
-#ifdef __BIG_ENDIAN__
+#if defined(__BIG_ENDIAN__) ||                                                \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
   static const bool IS_LITTLE_ENDIAN = false;
   static const bool IS_BIG_ENDIAN = true;
 #endif
 
-#ifdef __LITTLE_ENDIAN__
+#if defined(__LITTLE_ENDIAN__) ||                                             \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
   static const bool IS_LITTLE_ENDIAN = true;
   static const bool IS_BIG_ENDIAN = false;
 #endif
@@ -22,6 +26,58 @@ struct Bitops {
     static_assert(IS_LITTLE_ENDIAN, "big endian unimplemented!");
     *reinterpret_cast<uint32_t *>(out) = val;
   }
+
+  static void encode_be(uint32_t val, uint8_t *out) {
+    out[0] = val >> 24;
+    out[1] = val >> 16;
+    out[2] = val >> 8;
+    out[3] = val;
+  }
+
+  static uint32_t decode_le(const uint8_t *in) {
+    static_assert(IS_LITTLE_ENDIAN, "big endian unimplemented!");
+    return *reinterpret_cast<const uint32_t *>(in);
+  }
+
+  /// Interleave the bits of \p x and \p y, with the bits of \p x in the even
+  /// positions.  Sorting cells of a grid by this key orders them along a
+  /// Morton (or Z-order) curve.
+  static uint64_t morton_key(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+      v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+      v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+      v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+      v = (v | (v << 2)) & 0x3333333333333333ull;
+      v = (v | (v << 1)) & 0x5555555555555555ull;
+      return v;
+    };
+    return spread(x) | (spread(y) << 1);
+  }
+
+  /// Return the position of cell (\p x, \p y) along a Hilbert curve through
+  /// a 2^order x 2^order grid.  Unlike a Morton curve, a Hilbert curve only
+  /// ever steps to an adjacent cell.
+  static uint64_t hilbert_key(unsigned order, uint32_t x, uint32_t y) {
+    assert(order < 32 && (x >> order) == 0 && (y >> order) == 0 &&
+           "Out of bounds!");
+    uint32_t n = uint32_t(1) << order;
+    uint64_t key = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+      uint32_t rx = (x & s) != 0, ry = (y & s) != 0;
+      key += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+      // Rotate the quadrant so that the curve through it starts and ends
+      // where the curve through the whole grid does.
+      if (ry == 0) {
+        if (rx == 1) {
+          x = n - 1 - x;
+          y = n - 1 - y;
+        }
+        std::swap(x, y);
+      }
+    }
+    return key;
+  }
 };
 }
 
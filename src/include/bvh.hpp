@@ -0,0 +1,284 @@
+/// bvh.hpp: A bounding volume hierarchy over axis aligned boxes.
+///
+
+#ifndef RAY_BVH_HPP
+#define RAY_BVH_HPP
+
+#include "euclid.hpp"
+#include "ray-packet.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace ray {
+
+/// How a BoundingVolumeHierarchy decides where to split a node.
+enum class BVHSplitTy {
+  /// Split at the median centroid along the longest axis.  Cheap to build, and
+  /// mostly useful as a baseline.
+  median,
+
+  /// Pick the split that minimizes the surface area heuristic, evaluated over
+  /// a fixed number of bins along each axis.
+  sah
+};
+
+/// Knobs controlling how a BoundingVolumeHierarchy is built.
+struct BVHBuildOptions {
+  BVHSplitTy split = BVHSplitTy::sah;
+
+  /// The number of threads the build is allowed to use.
+  unsigned thread_count = 1;
+
+  /// The largest number of primitives the build puts in a single leaf.
+  /// Clients that intersect whole leaves at once (e.g. with SIMD) match this
+  /// to the number of primitives they can intersect at once.
+  unsigned max_leaf_size = 4;
+};
+
+/// Statistics describing a built BoundingVolumeHierarchy.
+struct BVHStats {
+  double build_seconds = 0.0;
+  unsigned node_count = 0;
+  unsigned leaf_count = 0;
+  unsigned max_depth = 0;
+
+  /// The expected cost of tracing a ray through the hierarchy as estimated by
+  /// the surface area heuristic, in units of one primitive intersection.  Lower
+  /// is better.
+  Ruler::Real sah_cost = 0.0;
+
+  /// Fold the statistics of another hierarchy into these, for clients that
+  /// use more than one hierarchy per scene.
+  void accumulate(const BVHStats &other) {
+    build_seconds += other.build_seconds;
+    node_count += other.node_count;
+    leaf_count += other.leaf_count;
+    max_depth = std::max(max_depth, other.max_depth);
+    sah_cost += other.sah_cost;
+  }
+
+  void print(std::ostream &out) const {
+    out << "[Build: " << build_seconds * 1000.0 << "ms Nodes: " << node_count
+        << " Leaves: " << leaf_count << " Depth: " << max_depth
+        << " SAH cost: " << sah_cost << "]";
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const BVHStats &s) {
+  s.print(out);
+  return out;
+}
+
+/// A bounding volume hierarchy over a set of "primitives".
+///
+/// The hierarchy only knows the bounds of each primitive, and refers to
+/// primitives by their index into the vector of bounds it was built from.  What
+/// a primitive is, and how a ray intersects one, is left to the client.
+class BoundingVolumeHierarchy {
+  /// A node in the hierarchy.
+  ///
+  /// Nodes are stored in depth first order, so the left child of an interior
+  /// node immediately follows it.  For leaves, \c _offset is the index of the
+  /// first primitive in \c _primitives and \c _count is the number of
+  /// primitives in the leaf.  For interior nodes \c _offset is the index of the
+  /// right child and \c _count is zero.
+  struct Node {
+    AxisAlignedBox _bounds;
+    unsigned _offset = 0;
+    unsigned _count = 0;
+    unsigned _split_axis = 0;
+
+    bool is_leaf() const { return _count != 0; }
+  };
+
+  std::vector<Node> _nodes;
+  std::vector<unsigned> _primitives;
+  BVHStats _stats;
+
+  /// The pointer based tree the build produces before it is flattened into
+  /// \c _nodes.  Subtrees are built independently (and possibly concurrently),
+  /// which a single depth first vector of nodes can't accommodate.
+  struct BuildNode;
+  struct BuildInput;
+
+  std::unique_ptr<BuildNode> build_recursive(const BuildInput &input,
+                                             unsigned begin, unsigned end,
+                                             unsigned depth,
+                                             unsigned thread_count);
+
+  unsigned flatten(const BuildNode &node, unsigned depth,
+                   Ruler::Real root_area);
+
+public:
+  /// The default for BVHBuildOptions::max_leaf_size.
+  static constexpr unsigned kMaxLeafSize = 4;
+
+  /// The deepest hierarchy we can traverse.
+  static constexpr unsigned kMaxDepth = 64;
+
+  /// (Re)build the hierarchy over primitives with bounds \p bounds.
+  void build(const std::vector<AxisAlignedBox> &bounds,
+             const BVHBuildOptions &options = BVHBuildOptions());
+
+  /// Return the number of primitives this hierarchy was built over.
+  unsigned primitive_count() const { return _primitives.size(); }
+
+  /// Return statistics about the last build.
+  const BVHStats &stats() const { return _stats; }
+
+  /// Renumber the primitives so that the primitives in every leaf, and the
+  /// leaves themselves, are numbered consecutively in the order the hierarchy
+  /// stores them.
+  ///
+  /// Returns the old index of every primitive, indexed by its new index.
+  /// Clients use this to lay out per-primitive data in the same order as the
+  /// hierarchy, so that a leaf's primitives are adjacent in memory.
+  std::vector<unsigned> renumber_primitives();
+
+  /// Call \p visit_fn for every primitive whose bounds \p r passes through at
+  /// an offset in [0, \p max_k].
+  ///
+  /// \p visit_fn is called as visit_fn(primitive_index, max_k), and may lower
+  /// \p max_k (e.g. when it finds a hit) to prune the rest of the traversal.
+  /// Children are visited front to back along \p r so that \p max_k shrinks as
+  /// early as possible.
+  template <typename VisitFnTy>
+  void traverse(const Ray &r, Ruler::Real &max_k,
+                const VisitFnTy &visit_fn) const {
+    traverse_until(r, max_k, [&](unsigned idx, Ruler::Real &k) {
+      visit_fn(idx, k);
+      return false;
+    });
+  }
+
+  /// Like \c traverse, except that the traversal stops as soon as \p visit_fn
+  /// returns true.  Returns true if it stopped early.
+  ///
+  /// This is what "any hit" queries (e.g. occlusion tests) use, since for them
+  /// the first hit found is as good as the closest one.
+  template <typename VisitFnTy>
+  bool traverse_until(const Ray &r, Ruler::Real &max_k,
+                      const VisitFnTy &visit_fn) const {
+    return traverse_leaves_until(
+        r, max_k, [&](unsigned first, unsigned count, Ruler::Real &k) {
+          for (unsigned i = first, e = first + count; i != e; ++i)
+            if (visit_fn(_primitives[i], k))
+              return true;
+          return false;
+        });
+  }
+
+  /// Like \c traverse, but calls \p leaf_fn once per leaf as
+  /// leaf_fn(first, count, max_k) instead of once per primitive.
+  ///
+  /// The leaf contains the primitives at positions [first, first + count) in
+  /// the hierarchy's primitive order, which are simply the primitives numbered
+  /// first to first + count - 1 after a call to \c renumber_primitives.  This
+  /// lets clients intersect all of a leaf's primitives at once, e.g. with SIMD.
+  template <typename LeafFnTy>
+  void traverse_leaves(const Ray &r, Ruler::Real &max_k,
+                       const LeafFnTy &leaf_fn) const {
+    traverse_leaves_until(
+        r, max_k, [&](unsigned first, unsigned count, Ruler::Real &k) {
+          leaf_fn(first, count, k);
+          return false;
+        });
+  }
+
+  /// Like \c traverse_leaves, except that the traversal stops as soon as
+  /// \p leaf_fn returns true.  Returns true if it stopped early.
+  template <typename LeafFnTy>
+  bool traverse_leaves_until(const Ray &r, Ruler::Real &max_k,
+                             const LeafFnTy &leaf_fn) const {
+    if (_nodes.empty())
+      return false;
+
+    const Vector &d = r.direction();
+    const Vector inv_dir(1.0 / d.i(), 1.0 / d.j(), 1.0 / d.k());
+
+    unsigned stack[kMaxDepth];
+    unsigned stack_size = 0;
+    unsigned current = 0;
+
+    for (;;) {
+      const Node &node = _nodes[current];
+      Ruler::Real entry_k;
+      if (node._bounds.intersect(r, inv_dir, Ruler::zero(), max_k, entry_k)) {
+        if (node.is_leaf()) {
+          if (leaf_fn(node._offset, node._count, max_k))
+            return true;
+        } else {
+          unsigned near = current + 1, far = node._offset;
+          if (Ruler::is_negative(d.component(node._split_axis)))
+            std::swap(near, far);
+          assert(stack_size < kMaxDepth && "Hierarchy too deep!");
+          stack[stack_size++] = far;
+          current = near;
+          continue;
+        }
+      }
+
+      if (stack_size == 0)
+        return false;
+      current = stack[--stack_size];
+    }
+  }
+
+  /// Trace the coherent packet \p p through the hierarchy, calling \p leaf_fn
+  /// as leaf_fn(first, count, ray_mask, max_k) for the leaves some of its rays
+  /// may intersect.
+  ///
+  /// Interior nodes are culled for the whole packet at once with
+  /// \c RayPacket::may_intersect.  At the leaves each ray is tested against
+  /// the leaf's bounds, and bit i of ray_mask is set if ray i passes.  As in
+  /// \c traverse_leaves, \p leaf_fn can lower max_k[i] (the bound for ray i,
+  /// which is the array \p max_k) to prune the rest of the traversal.
+  template <typename LeafFnTy>
+  void traverse_packet(const RayPacket &p, Ruler::Real *max_k,
+                       const LeafFnTy &leaf_fn) const {
+    assert(p.is_coherent() && "Expected a coherent packet!");
+    if (_nodes.empty())
+      return;
+
+    unsigned stack[kMaxDepth];
+    unsigned stack_size = 0;
+    unsigned current = 0;
+
+    for (;;) {
+      const Node &node = _nodes[current];
+      Ruler::Real packet_max_k = max_k[0];
+      for (unsigned i = 1, e = p.size(); i != e; ++i)
+        packet_max_k = std::max(packet_max_k, max_k[i]);
+
+      if (p.may_intersect(node._bounds, packet_max_k)) {
+        if (node.is_leaf()) {
+          unsigned ray_mask = 0;
+          for (unsigned i = 0, e = p.size(); i != e; ++i) {
+            Ruler::Real entry_k;
+            if (node._bounds.intersect(p.ray(i), p.inv_dir(i), Ruler::zero(),
+                                       max_k[i], entry_k))
+              ray_mask |= 1u << i;
+          }
+          if (ray_mask)
+            leaf_fn(node._offset, node._count, ray_mask, max_k);
+        } else {
+          unsigned near = current + 1, far = node._offset;
+          if (p.is_negative(node._split_axis))
+            std::swap(near, far);
+          assert(stack_size < kMaxDepth && "Hierarchy too deep!");
+          stack[stack_size++] = far;
+          current = near;
+          continue;
+        }
+      }
+
+      if (stack_size == 0)
+        return;
+      current = stack[--stack_size];
+    }
+  }
+};
+}
+
+#endif
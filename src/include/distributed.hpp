@@ -0,0 +1,79 @@
+/// distributed.hpp: Rendering one frame with several processes.
+
+#ifndef RAY_DISTRIBUTED_HPP
+#define RAY_DISTRIBUTED_HPP
+
+#include "bitmap.hpp"
+#include "scene-generators.hpp"
+
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace ray {
+
+struct DistributedOptions {
+  /// The number of worker processes to fork.
+  unsigned process_count = 2;
+
+  /// The number of render threads in each worker process.
+  unsigned threads_per_process = 1;
+
+  /// The side of the square tiles the coordinator hands out.  These are
+  /// larger than the tiles of \c Camera::snap, since every tile costs a round
+  /// trip to the coordinator.
+  unsigned tile_size = 128;
+
+  /// The time to pass to the scene generator.
+  double time = 0.0;
+};
+
+/// Statistics about a call to \c render_distributed.
+struct DistributedStats {
+  double render_seconds = 0.0;
+
+  /// Per worker process: the number of tiles it sent back, and whether it
+  /// died before it was told to quit.
+  std::vector<unsigned> tile_counts;
+  std::vector<bool> failed;
+
+  void print(std::ostream &out) const {
+    out << "[Distributed render: " << render_seconds * 1000.0 << "ms";
+    for (unsigned i = 0, e = tile_counts.size(); i != e; ++i)
+      out << " Process " << i << ": " << tile_counts[i] << " tiles"
+          << (failed[i] ? " (failed)" : "");
+    out << "]";
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const DistributedStats &s) {
+  s.print(out);
+  return out;
+}
+
+/// Render a frame with worker processes forked from this one, which acts as
+/// the coordinator.
+///
+/// Each worker builds its own copy of the scene and camera by calling
+/// \p setup at \c options.time (\p setup should also configure the camera,
+/// e.g. its packet size), and then repeatedly asks the coordinator for a tile
+/// over a UNIX socket, renders it with a crop of the camera, and sends its
+/// pixels back.  Workers pull tiles as they finish the previous ones, so
+/// faster workers (or ones with cheaper tiles) render more of the frame.  The
+/// tile of a worker that dies is handed to another worker.
+///
+/// Returns the assembled image, or null if every worker died before the
+/// image was done.  Supersampled pixels on the edges of tiles may differ
+/// from those of \c Camera::snap, since each tile is supersampled on its
+/// own.
+///
+/// The workers don't pin their threads, since every worker would pin its
+/// threads to the same CPUs.  This must not be called while other threads
+/// of this process are holding locks that \p setup needs.
+std::unique_ptr<Bitmap>
+render_distributed(const SceneGeneratorTy &setup,
+                   const DistributedOptions &options,
+                   DistributedStats *stats = nullptr);
+}
+
+#endif
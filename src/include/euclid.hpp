@@ -4,9 +4,11 @@
 #ifndef RAY_EUCLID_HPP
 #define RAY_EUCLID_HPP
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <limits>
 #include <vector>
 #include <iostream>
 #include <utility>
@@ -15,17 +17,21 @@ namespace ray {
 
 /// Utilities related to measuring scalar distances.
 ///
-struct Ruler {
+/// The geometry types below are templates over the scalar type \p RealTy, and
+/// the rest of the renderer uses them through the typedefs at the end of this
+/// file, which pick float if RAY_SINGLE_PRECISION is defined and double
+/// otherwise.
+template <typename RealTy> struct RulerT {
   /// The type we use to represent all scalar and vector lengths.
   ///
   /// Put another way, this is the field over which we construct our (euclidian)
   /// vector space.  Realistically, this exists so that I can switch between
   /// doubles and floats easily, and also to put all of the "magic numbers"
   /// (e.g. epsilon) in one place.
-  typedef double Real;
+  typedef RealTy Real;
 
   /// Return true if \p d is zero.
-  static bool is_zero(Real d) { return fabs(d) < Ruler::epsilon(); }
+  static bool is_zero(Real d) { return std::fabs(d) < epsilon(); }
 
   /// Return true if \p d is negative.
   static bool is_negative(Real d) { return d < 0.0; }
@@ -44,14 +50,25 @@ struct Ruler {
   static Real one() { return 1.0; }
 };
 
+/// A float has about 7 significant digits, and our scenes span thousands of
+/// units, so 1E-10 is far below the resolution of a float.
+template <> inline float RulerT<float>::epsilon() { return 1E-4f; }
+
 /// A 3D vector class.
 ///
 /// This can be used to represent both directions and points in 3D space.
 ///
-class Vector {
-  Ruler::Real _i = 0.0;
-  Ruler::Real _j = 0.0;
-  Ruler::Real _k = 0.0;
+template <typename RealTy> class VectorT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+
+  Real _i = 0.0;
+  Real _j = 0.0;
+  Real _k = 0.0;
   unsigned _is_normal : 1;
   unsigned _is_valid : 1;
 
@@ -70,8 +87,8 @@ class Vector {
   bool is_valid() const { return _is_valid; }
 
 public:
-  Vector() : _is_normal(0), _is_valid(0) {}
-  explicit Vector(Ruler::Real i, Ruler::Real j, Ruler::Real k)
+  VectorT() : _is_normal(0), _is_valid(0) {}
+  explicit VectorT(Real i, Real j, Real k)
       : _i(i), _j(j), _k(k), _is_normal(0), _is_valid(1) {}
 
   static Vector get_i() { return Vector(1.0, 0.0, 0.0); }
@@ -80,9 +97,16 @@ public:
 
   static Vector get_origin() { return Vector(0.0, 0.0, 0.0); }
 
-  Ruler::Real i() const { return _i; }
-  Ruler::Real j() const { return _j; }
-  Ruler::Real k() const { return _k; }
+  Real i() const { return _i; }
+  Real j() const { return _j; }
+  Real k() const { return _k; }
+
+  /// Return the component along axis \p axis, with 0, 1 and 2 denoting i, j
+  /// and k respectively.
+  Real component(unsigned axis) const {
+    assert(axis < 3 && "Out of bounds!");
+    return axis == 0 ? i() : (axis == 1 ? j() : k());
+  }
 
   bool is_zero() const {
     assert(is_valid() && "Invalid vector vector vector!");
@@ -115,16 +139,16 @@ public:
     return Vector(-i(), -j(), -k());
   }
 
-  Ruler::Real dot_product(const Vector &other) const {
+  Real dot_product(const Vector &other) const {
     assert(is_valid() && other.is_valid() && "Invalid vector!");
     return i() * other.i() + j() * other.j() + k() * other.k();
   }
 
-  Ruler::Real operator*(const Vector &other) const {
+  Real operator*(const Vector &other) const {
     return this->dot_product(other);
   }
 
-  Vector operator*(Ruler::Real v) const {
+  Vector operator*(Real v) const {
     assert(is_valid() && "Invalid vector!");
     return Vector(v * i(), v * j(), v * k());
   }
@@ -138,7 +162,7 @@ public:
   /// Find \p result such that this vector is equal to \p result * \p v.
   ///
   /// If such a \p result does not exist, return false.
-  bool get_scale(const Vector &v, Ruler::Real &result) const {
+  bool get_scale(const Vector &v, Real &result) const {
     assert(is_valid() && v.is_valid() && "Invalid vector!");
     bool found = false;
     for (auto &p : {std::make_pair(i(), v.i()), std::make_pair(j(), v.j()),
@@ -162,20 +186,20 @@ public:
   }
 
   /// Return tangent of the angle this vector makes with the horizontal plane.
-  Ruler::Real horizontal_gradient() const {
+  Real horizontal_gradient() const {
     assert(is_valid() && "Invalid vector!");
     return k() / std::sqrt(i() * i() + j() * j());
   }
 
   /// Compute the length of this vector.
-  Ruler::Real mag() const {
+  Real mag() const {
     assert(is_valid() && "Invalid vector!");
     return std::sqrt(i() * i() + j() * j() + k() * k());
   }
 
   /// Compute the distance between the 3D point represented by this vector and
   /// the 3D point represented by \p other.
-  Ruler::Real dist(const Vector &other) const {
+  Real dist(const Vector &other) const {
     assert(is_valid() && other.is_valid() && "Invalid vector!");
     return (*this - other).mag();
   }
@@ -197,7 +221,7 @@ public:
 
   /// Rotate this vector by \p radian radians, with \p orth being a normal to
   /// the rotation plane.
-  Vector rotate(Ruler::Real radian, const Vector &orth) {
+  Vector rotate(Real radian, const Vector &orth) {
     assert(is_valid() && orth.is_valid() && "Invalid vector!");
     assert(Ruler::is_zero(*this * orth) && "precondition!");
 
@@ -206,24 +230,34 @@ public:
     return ((*this) * std::cos(radian) +
             normal_in_rotation_plane * std::sin(radian));
   }
+
+  friend Vector operator*(Real d, const Vector &v) { return v * d; }
 };
 
-inline std::ostream &operator<<(std::ostream &out, const Vector &v) {
+template <typename RealTy>
+inline std::ostream &operator<<(std::ostream &out,
+                                const VectorT<RealTy> &v) {
   v.print(out);
   return out;
 }
 
-inline Vector operator*(Ruler::Real d, const Vector &v) { return v * d; }
-
 /// Represents a ray in 3D euclidian space.
 ///
 /// The ray consists of all points p = offset() + k * direction() with k >= 0
 ///
-class Ray {
+template <typename RealTy> class RayT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+
   Vector _direction;
   Vector _offset;
 
-  explicit Ray(Vector o, Vector d) : _direction(d), _offset(o) {}
+  explicit RayT(Vector o, Vector d) : _direction(d), _offset(o) {}
 
 public:
   static Ray from_two_points(Vector from, Vector to) {
@@ -241,13 +275,13 @@ public:
   const Vector &direction() const { return _direction; }
   const Vector &offset() const { return _offset; }
 
-  Vector at(Ruler::Real k) const { return offset() + k * direction(); }
+  Vector at(Real k) const { return offset() + k * direction(); }
 
   /// Find a the point where \p r intersects this ray, if such an unique point
   /// exists.
   ///
-  bool intersect(const Ray &r, Ruler::Real &k_self,
-                 Ruler::Real &k_other) const {
+  bool intersect(const Ray &r, Real &k_self,
+                 Real &k_other) const {
     //     O + k * D  == O' + k' * D'
     // =>  k * D      == (O' - O) + k' * D'
     // =>  k * D X D' == (O' - O) X D'
@@ -263,18 +297,132 @@ public:
     return numerator.get_scale(r.direction(), k_other);
   }
 
-  bool contains(const Vector &v, Ruler::Real &out_k) const {
+  bool contains(const Vector &v, Real &out_k) const {
     if (direction().is_zero())
       return false;
     return (v - offset()).get_scale(direction(), out_k);
   }
 };
 
-inline std::ostream &operator<<(std::ostream &out, const Ray &r) {
+template <typename RealTy>
+inline std::ostream &operator<<(std::ostream &out,
+                                const RayT<RealTy> &r) {
   r.print(out);
   return out;
 }
 
+/// Represents an axis aligned box in 3D space.
+///
+/// The box contains all points p such that min() <= p <= max() holds for each
+/// component.  A default constructed box is empty, and can be grown to contain
+/// points and other boxes using \c extend.
+template <typename RealTy> class AxisAlignedBoxT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef AxisAlignedBoxT<Real> AxisAlignedBox;
+
+  Vector _min;
+  Vector _max;
+
+public:
+  AxisAlignedBoxT()
+      : _min(Ruler::infinity(), Ruler::infinity(), Ruler::infinity()),
+        _max(-Ruler::infinity(), -Ruler::infinity(), -Ruler::infinity()) {}
+
+  explicit AxisAlignedBoxT(const Vector &min, const Vector &max)
+      : _min(min), _max(max) {}
+
+  const Vector &min() const { return _min; }
+  const Vector &max() const { return _max; }
+
+  bool is_empty() const {
+    return _min.i() > _max.i() || _min.j() > _max.j() || _min.k() > _max.k();
+  }
+
+  /// Grow this box to contain the point \p p.
+  void extend(const Vector &p) {
+    _min = Vector(std::min(_min.i(), p.i()), std::min(_min.j(), p.j()),
+                  std::min(_min.k(), p.k()));
+    _max = Vector(std::max(_max.i(), p.i()), std::max(_max.j(), p.j()),
+                  std::max(_max.k(), p.k()));
+  }
+
+  /// Grow this box to contain the box \p b.
+  void extend(const AxisAlignedBox &b) {
+    if (b.is_empty())
+      return;
+    extend(b.min());
+    extend(b.max());
+  }
+
+  /// Return this box grown by \p delta units in every direction.
+  AxisAlignedBox pad(Real delta) const {
+    Vector d(delta, delta, delta);
+    return AxisAlignedBox(min() - d, max() + d);
+  }
+
+  Vector centroid() const { return (min() + max()) * 0.5; }
+
+  Real surface_area() const {
+    if (is_empty())
+      return Ruler::zero();
+    Vector d = max() - min();
+    return 2 * (d.i() * d.j() + d.j() * d.k() + d.k() * d.i());
+  }
+
+  /// Return the axis (0, 1 or 2 for i, j and k) along which this box is the
+  /// longest.
+  unsigned longest_axis() const {
+    Vector d = max() - min();
+    if (d.i() >= d.j() && d.i() >= d.k())
+      return 0;
+    return d.j() >= d.k() ? 1 : 2;
+  }
+
+  /// Return true if the points on \p r with offsets in [\p k_begin, \p k_end]
+  /// pass through this box, and return the offset at which \p r enters the box
+  /// in \p out_k if so.
+  ///
+  /// \p inv_dir is the component-wise inverse of the direction of \p r.  It is
+  /// passed in so that callers testing one ray against many boxes can compute
+  /// it once.  This is the usual "slab" test; a NaN from a 0 * infinity
+  /// product (a ray exactly grazing a slab) never causes a miss.
+  bool intersect(const Ray &r, const Vector &inv_dir, Real k_begin,
+                 Real k_end, Real &out_k) const {
+    for (unsigned axis = 0; axis < 3; axis++) {
+      Real origin = r.offset().component(axis);
+      Real inv = inv_dir.component(axis);
+      Real k0 = (min().component(axis) - origin) * inv;
+      Real k1 = (max().component(axis) - origin) * inv;
+      if (k0 > k1)
+        std::swap(k0, k1);
+      k_begin = k0 > k_begin ? k0 : k_begin;
+      k_end = k1 < k_end ? k1 : k_end;
+      if (k_begin > k_end)
+        return false;
+    }
+
+    out_k = k_begin;
+    return true;
+  }
+
+  void print(std::ostream &out) const {
+    out << "[Min: " << min() << " Max: " << max() << "]";
+  }
+};
+
+template <typename RealTy>
+inline std::ostream &operator<<(std::ostream &out,
+                                const AxisAlignedBoxT<RealTy> &b) {
+  b.print(out);
+  return out;
+}
+
 /// Represents the infinite plane in 3D space.
 ///
 /// The plane contains all p such that (p - point()) * normal() == 0.
@@ -282,20 +430,29 @@ inline std::ostream &operator<<(std::ostream &out, const Ray &r) {
 /// The sign of the normal vector has semantic meaning in some contexts -- the
 /// "outside" is often denoted by as the side the normal points to, and e.g. the
 /// code to compute reflection and refraction use this information.
-class Plane {
+template <typename RealTy> class PlaneT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef PlaneT<Real> Plane;
+
   Vector _normal;
   Vector _point;
 
 public:
   /// Construct a plane from a normal and a point in the plane.
-  explicit Plane(const Vector &norm, const Vector &p)
+  explicit PlaneT(const Vector &norm, const Vector &p)
       : _normal(norm), _point(p) {}
 
   /// Construct a plane from three points.
   ///
   /// This constructor follows the right hand rule for computing the direction
   /// of the normal.
-  explicit Plane(const std::array<Vector, 3> &pts) {
+  explicit PlaneT(const std::array<Vector, 3> &pts) {
     _normal = (pts[1] - pts[0]).cross_product(pts[2] - pts[0]).normalize();
     _point = pts[0];
   }
@@ -315,8 +472,8 @@ public:
 
   /// Returns true if \p r intersects the plane at exactly one point, and
   /// returns the offset at which \p r intersects this plane at \p out.
-  bool intersect(const Ray &r, Ruler::Real &out) const {
-    Ruler::Real denom = normal() * r.direction();
+  bool intersect(const Ray &r, Real &out) const {
+    Real denom = normal() * r.direction();
 
     if (Ruler::is_zero(denom))
       return false;
@@ -334,7 +491,9 @@ public:
   }
 };
 
-inline std::ostream &operator<<(std::ostream &out, const Plane &p) {
+template <typename RealTy>
+inline std::ostream &operator<<(std::ostream &out,
+                                const PlaneT<RealTy> &p) {
   p.print(out);
   return out;
 }
@@ -346,16 +505,26 @@ inline std::ostream &operator<<(std::ostream &out, const Plane &p) {
 /// - _container contains p
 /// - _orth_0_begin <= p * _orth_0 < _orth_0_end
 /// - _orth_1_begin <= p * _orth_1 < _orth_1_end
-class RectanglePlaneSegment {
+template <typename RealTy> class RectanglePlaneSegmentT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef PlaneT<Real> Plane;
+  typedef RectanglePlaneSegmentT<Real> RectanglePlaneSegment;
+
   Plane _container;
   Vector _orth_0, _orth_1;
-  Ruler::Real _orth_0_begin, _orth_0_end;
-  Ruler::Real _orth_1_begin, _orth_1_end;
+  Real _orth_0_begin, _orth_0_end;
+  Real _orth_1_begin, _orth_1_end;
 
 public:
   /// Construct a RectanglePlaneSegment from three conrners of a rectangle (the
   /// fourth one is unique given the three).
-  explicit RectanglePlaneSegment(const std::array<Vector, 3> &pts)
+  explicit RectanglePlaneSegmentT(const std::array<Vector, 3> &pts)
       : _container(pts) {
 #ifndef NDEBUG
     for (const Vector &v : pts)
@@ -379,17 +548,17 @@ public:
 
   /// Return true if \p r intersects this RectanglePlaneSegment, returning the
   /// offset of the ray in \p out.
-  bool intersect(const Ray &r, Ruler::Real &out) const {
+  bool intersect(const Ray &r, Real &out) const {
     if (!container().intersect(r, out))
       return false;
 
     Vector isection = r.at(out);
 
-    Ruler::Real orth_0_component = isection * _orth_0;
+    Real orth_0_component = isection * _orth_0;
     if (orth_0_component > _orth_0_end || orth_0_component < _orth_0_begin)
       return false;
 
-    Ruler::Real orth_1_component = isection * _orth_1;
+    Real orth_1_component = isection * _orth_1;
     return (orth_1_component <= _orth_1_end &&
             orth_1_component >= _orth_1_begin);
   }
@@ -401,8 +570,9 @@ public:
   }
 };
 
+template <typename RealTy>
 inline std::ostream &operator<<(std::ostream &out,
-                                const RectanglePlaneSegment &rps) {
+                                const RectanglePlaneSegmentT<RealTy> &rps) {
   rps.print(out);
   return out;
 }
@@ -410,43 +580,57 @@ inline std::ostream &operator<<(std::ostream &out,
 /// Represents a sphere in 3D space.
 ///
 /// The sphere consists of all points p such that |p - _center| == _radius.
-class Sphere {
+template <typename RealTy> class SphereT {
+public:
+  typedef RealTy Real;
+
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef AxisAlignedBoxT<Real> AxisAlignedBox;
+
   Vector _center;
-  Ruler::Real _radius;
+  Real _radius;
 
   /// This is a cached value that can always be recomputed from _center and
   /// _radius.  Caching this helps us make the implementation of intersect
   /// faster.
-  Ruler::Real _rhs;
+  Real _rhs;
 
 public:
-  explicit Sphere(const Vector &center, Ruler::Real radius)
+  explicit SphereT(const Vector &center, Real radius)
       : _center(center), _radius(radius) {
     _rhs = center * center - radius * radius;
   }
 
   const Vector &center() const { return _center; }
-  Ruler::Real radius() const { return _radius; }
+  Real radius() const { return _radius; }
+
+  AxisAlignedBox bounds() const {
+    Vector r(radius(), radius(), radius());
+    return AxisAlignedBox(center() - r, center() + r);
+  }
 
   /// Return true if \p r intersects this sphere, returning the offset in \p out
   /// if so.
-  bool intersect(const Ray &r, Ruler::Real &out) const {
+  bool intersect(const Ray &r, Real &out) const {
     // Try form an equation of the form "k^2 * a + k * b + c = 0".
 
-    Ruler::Real a = r.direction() * r.direction();
-    Ruler::Real b =
+    Real a = r.direction() * r.direction();
+    Real b =
         2 * (r.direction() * r.offset()) - 2 * (r.direction() * center());
-    Ruler::Real c = r.offset() * r.offset() - 2 * r.offset() * center() + _rhs;
+    Real c = r.offset() * r.offset() - 2 * r.offset() * center() + _rhs;
 
     assert(!Ruler::is_zero(a) && "Direction vector has unit length!");
 
-    Ruler::Real disc_sqr = b * b - 4 * a * c;
+    Real disc_sqr = b * b - 4 * a * c;
     if (Ruler::is_negative(disc_sqr))
       return false;
 
-    Ruler::Real disc = std::sqrt(disc_sqr);
-    Ruler::Real k1 = (-b + disc) / (2 * a);
-    Ruler::Real k2 = (-b - disc) / (2 * a);
+    Real disc = std::sqrt(disc_sqr);
+    Real k1 = (-b + disc) / (2 * a);
+    Real k2 = (-b - disc) / (2 * a);
 
     out = k1 < k2 ? k1 : k2;
     return true;
@@ -455,44 +639,47 @@ public:
 
 /// Represents a cube in 3D space.
 ///
-/// The cube is essentially a 6-tuple of RectanglePlaneSegments.
-class Cube {
-  typedef std::array<RectanglePlaneSegment, 6> FacesTy;
+/// The cube is stored as its center, an orthonormal frame (the normals of three
+/// of its faces) and half the length of its sides, so that in the coordinate
+/// system of the frame it is the box [-half_side, half_side]^3 around the
+/// center.  This makes intersecting it a matter of clipping the ray against
+/// three slabs.
+///
+/// The faces of the cube are numbered 0 to 5, with face 2 * i being the one
+/// whose outward normal is -frame[i] and face 2 * i + 1 the one whose outward
+/// normal is frame[i].
+template <typename RealTy> class CubeT {
+public:
+  typedef RealTy Real;
 
-  FacesTy _faces;
+private:
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef AxisAlignedBoxT<Real> AxisAlignedBox;
+  typedef CubeT<Real> Cube;
 
-  static FacesTy compute_faces(const Vector &center, const Vector &normal_a,
-                               const Vector &normal_b, Ruler::Real side) {
+  Vector _center;
+  std::array<Vector, 3> _frame;
+  Real _half_side;
+  AxisAlignedBox _bounds;
+
+  static std::array<Vector, 3> compute_frame(const Vector &normal_a,
+                                             const Vector &normal_b) {
     Vector n_a = normal_a.normalize();
     Vector n_b = normal_b.normalize();
-    Vector n_c = n_a.cross_product(n_b);
-
-    Vector ns[3] = {n_a, n_b, n_c};
-
-    auto compute_face = [&](unsigned face_idx, int sign) {
-      const Vector &axis_0 = ns[(face_idx + 1) % 3] * side;
-      const Vector &axis_1 = ns[(face_idx + 2) % 3] * side;
-
-      assert(Ruler::is_zero(ns[face_idx] * axis_0) && "Expected orthogonal!");
-      assert(Ruler::is_zero(ns[face_idx] * axis_1) && "Expected orthogonal!");
-
-      Vector pt_in_plane = center + sign * ns[face_idx] * side;
-
-      std::array<Vector, 3> pts;
-      pts[0] = pt_in_plane + axis_0 + axis_1;
-      pts[1] = pt_in_plane - axis_0 + axis_1;
-      pts[2] = pt_in_plane - axis_0 - axis_1;
-
-      if (sign == -1)
-        std::reverse(pts.begin(), pts.end());
-
-      RectanglePlaneSegment rps(pts);
-      assert(rps.normal() == sign * ns[face_idx] && "Bad normal!");
-      return rps;
-    };
+    return {{n_a, n_b, n_a.cross_product(n_b)}};
+  }
 
-    return {{compute_face(0, -1), compute_face(0, 1), compute_face(1, -1),
-             compute_face(1, 1), compute_face(2, -1), compute_face(2, 1)}};
+  AxisAlignedBox compute_bounds() const {
+    AxisAlignedBox result;
+    for (int sign_a : {-1, 1})
+      for (int sign_b : {-1, 1})
+        for (int sign_c : {-1, 1})
+          result.extend(center() + (sign_a * half_side()) * _frame[0] +
+                        (sign_b * half_side()) * _frame[1] +
+                        (sign_c * half_side()) * _frame[2]);
+    return result;
   }
 
 public:
@@ -501,36 +688,86 @@ public:
   ///  - \p center is its geometric center
   ///  - \p normal_a and \p normal_b are normals to two orthogonal faces (all
   ///    other normals are functions of these two normals)
-  ///  - each side of the cube is \p side units long
-  explicit Cube(const Vector &center, const Vector &normal_a,
-                const Vector &normal_b, Ruler::Real side)
-      : _faces(Cube::compute_faces(center, normal_a, normal_b, side)) {}
+  ///  - every point on its surface is \p side units away from \p center along
+  ///    one of the normals, i.e. \p side is half the length of a side
+  explicit CubeT(const Vector &center, const Vector &normal_a,
+                const Vector &normal_b, Real side)
+      : _center(center), _frame(Cube::compute_frame(normal_a, normal_b)),
+        _half_side(side) {
+    assert(Ruler::is_zero(_frame[0] * _frame[1]) && "Expected orthogonal!");
+    _bounds = compute_bounds();
+  }
 
-  const FacesTy &faces() const { return _faces; }
+  const Vector &center() const { return _center; }
+  Real half_side() const { return _half_side; }
+  const AxisAlignedBox &bounds() const { return _bounds; }
 
   static const int kFaceCount = 6;
 
-  /// Return true if \p r intersects this Cube, and return the ray offset in \p
-  /// out_k and the face of intersection in \p face_idx.
-  bool intersect(const Ray &r, Ruler::Real &out_k, unsigned &face_idx) const {
-    Ruler::Real smallest_k = std::numeric_limits<Ruler::Real>::infinity();
-    face_idx = -1;
-
-    for (unsigned i = 0; i < kFaceCount; i++) {
-      Ruler::Real k;
-      if (_faces[i].intersect(r, k) && k < smallest_k) {
-        smallest_k = k;
-        face_idx = i;
+  /// Return the outward normal of face \p face_idx.
+  Vector normal(unsigned face_idx) const {
+    assert(face_idx < kFaceCount && "Out of bounds!");
+    const Vector &n = _frame[face_idx / 2];
+    return face_idx % 2 ? n : -n;
+  }
+
+  /// Return true if the line through \p r intersects this Cube, and return the
+  /// ray offset at which the line enters the cube in \p out_k and the face it
+  /// enters through in \p face_idx.
+  ///
+  /// Note that \p out_k is negative if \p r starts inside (or past) the cube.
+  bool intersect(const Ray &r, Real &out_k, unsigned &face_idx) const {
+    Vector offset = r.offset() - center();
+    Real k_near = -std::numeric_limits<Real>::infinity();
+    Real k_far = std::numeric_limits<Real>::infinity();
+    bool found_face = false;
+
+    for (unsigned axis = 0; axis < 3; axis++) {
+      Real o = offset * _frame[axis];
+      Real d = r.direction() * _frame[axis];
+
+      // A ray parallel to the slab either never enters it or never leaves it.
+      if (Ruler::is_zero(d)) {
+        if (o < -half_side() || o > half_side())
+          return false;
+        continue;
+      }
+
+      // The ray enters the slab through the face facing against it.
+      bool enters_positive = Ruler::is_negative(d);
+      Real near_side = enters_positive ? half_side() : -half_side();
+      Real k_enter = (near_side - o) / d;
+      Real k_exit = (-near_side - o) / d;
+
+      if (k_enter > k_near) {
+        k_near = k_enter;
+        face_idx = 2 * axis + enters_positive;
+        found_face = true;
       }
+      k_far = std::min(k_far, k_exit);
     }
 
-    if (face_idx == -1)
+    if (!found_face || k_near > k_far)
       return false;
 
-    out_k = smallest_k;
+    out_k = k_near;
     return true;
   }
 };
+
+#ifdef RAY_SINGLE_PRECISION
+typedef RulerT<float> Ruler;
+#else
+typedef RulerT<double> Ruler;
+#endif
+
+typedef VectorT<Ruler::Real> Vector;
+typedef RayT<Ruler::Real> Ray;
+typedef AxisAlignedBoxT<Ruler::Real> AxisAlignedBox;
+typedef PlaneT<Ruler::Real> Plane;
+typedef RectanglePlaneSegmentT<Ruler::Real> RectanglePlaneSegment;
+typedef SphereT<Ruler::Real> Sphere;
+typedef CubeT<Ruler::Real> Cube;
 }
 
 #endif
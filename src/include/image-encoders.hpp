@@ -0,0 +1,57 @@
+/// image-encoders.hpp: Compressed image formats for Bitmaps.
+///
+
+#ifndef RAY_IMAGE_ENCODERS_HPP
+#define RAY_IMAGE_ENCODERS_HPP
+
+#include "bitmap.hpp"
+#include "thread-pool.hpp"
+
+#include <memory>
+#include <ostream>
+
+namespace ray {
+
+/// The formats a Bitmap can be written in.
+enum class ImageFormatTy {
+  /// Uncompressed, as by \c Bitmap::write.
+  bmp,
+
+  /// PNG, with the pixel data in stored (uncompressed) deflate blocks.
+  png_stored,
+
+  /// PNG, with the pixel data compressed with deflate.
+  png,
+
+  /// The "Quite OK Image" format, which compresses less than PNG but
+  /// encodes much faster.
+  qoi
+};
+
+/// Return the usual file name extension of \p format, without the dot.
+const char *image_format_extension(ImageFormatTy format);
+
+/// Return an ImageSink that writes the image it is given to \p out as
+/// \p format, writing each band of rows as soon as it gets it, and encoding
+/// on the threads of \p pool.  The image is oriented as \c write_image
+/// orients it, but the bytes can differ from those \c write_image writes
+/// (e.g. BMP rows go from the top down).
+std::unique_ptr<ImageSink> create_image_writer(ImageFormatTy format,
+                                               std::ostream &out,
+                                               ThreadPool &pool);
+
+/// Write \p bmp to \p out as \p format, with the compressed formats encoding
+/// bands of rows in parallel on the threads of \p pool.  The image is
+/// oriented as \c Bitmap::write orients it.
+///
+/// The bands are compressed independently of each other (e.g. deflate
+/// doesn't look for matches across them), which costs a little compression
+/// but leaves the files decodable by any decoder.
+///
+/// Returns false if the encoder refused the image or writing to \p out
+/// failed.
+bool write_image(const Bitmap &bmp, ImageFormatTy format, std::ostream &out,
+                 ThreadPool &pool);
+}
+
+#endif
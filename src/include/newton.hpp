@@ -24,10 +24,10 @@ inline Ray get_reflected_ray(const Ray &r, const Vector &pt,
 /// \p relative.  \p out_total_internal_reflection is set to true if
 /// the ray encountered total internal reflection.
 inline Ray get_refracted_ray(const Ray &r, const Vector &pt, Vector normal,
-                             double relative_refractive_index,
+                             Ruler::Real relative_refractive_index,
                              bool &out_total_internal_reflection) {
   Vector incoming_dir = r.direction().normalize();
-  double inv_ref_index = 1.0 / relative_refractive_index;
+  Ruler::Real inv_ref_index = 1.0 / relative_refractive_index;
 
   // Snell's law in vector form:
   //
@@ -36,7 +36,7 @@ inline Ray get_refracted_ray(const Ray &r, const Vector &pt, Vector normal,
   // ref_index = n2 / n1
 
   Vector n_cross_s1 = normal.cross_product(incoming_dir);
-  double D = std::pow(inv_ref_index, 2) * (n_cross_s1 * n_cross_s1);
+  Ruler::Real D = std::pow(inv_ref_index, 2) * (n_cross_s1 * n_cross_s1);
 
   if (D <= 1.0) {
     out_total_internal_reflection = false;
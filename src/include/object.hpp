@@ -10,10 +10,25 @@ namespace ray {
 
 class Scene;
 
+/// Identifies the concrete type of an Object, for use with \c isa, \c cast and
+/// \c dyn_cast.
+enum class ObjectKindTy {
+  box,
+  spherical_mirror,
+  sky,
+  infinite_plane,
+  refractive_box,
+
+  /// Any object type the scene has no special knowledge of.
+  custom
+};
+
 /// Represents an object that light can interact with.  Object
 /// specific behavior is implemented by overriding virtual methods on
 /// this class.
 class Object {
+  const ObjectKindTy _kind;
+
   /// The object identifier of this object within the containing scene.
   ///
   /// Every object gets an unique and dense ID in the namespace of the scene
@@ -28,8 +43,11 @@ class Object {
   std::string _desc;
 
 public:
-  explicit Object(const Scene &container, std::string desc)
-      : _container(container), _desc(std::move(desc)) {}
+  explicit Object(const Scene &container, std::string desc,
+                  ObjectKindTy kind = ObjectKindTy::custom)
+      : _kind(kind), _container(container), _desc(std::move(desc)) {}
+
+  ObjectKindTy kind() const { return _kind; }
 
   unsigned object_id() const { return _object_id; }
   void set_object_id(unsigned obj_id) { _object_id = obj_id; }
@@ -48,8 +66,48 @@ public:
   /// intersection, the color of ray is returned in \p out_pixel, and the point
   /// of incidence is returned in \p out_incidence_k.
   virtual bool incident(ThreadContext &ctx, const Ray &r,
-                        double current_smallest_k, double &out_incidence_k,
-                        Color &out_pixel) const = 0;
+                        Ruler::Real current_smallest_k,
+                        Ruler::Real &out_incidence_k,
+                        HdrColor &out_pixel) const = 0;
+
+  /// Return true if ray \p r intersects this object at an offset in
+  /// [0, \p max_k).
+  ///
+  /// Unlike \c incident, this doesn't compute a color, so subclasses should
+  /// override it with a purely geometric test that skips shading (and any
+  /// recursive rays shading would trace).  The default implementation falls
+  /// back to \c incident.
+  virtual bool occludes(ThreadContext &ctx, const Ray &r,
+                        Ruler::Real max_k) const {
+    Ruler::Real k;
+    HdrColor c;
+    return incident(ctx, r, max_k, k, c) && k < max_k && k >= 0.0;
+  }
+
+  /// Compute an axis aligned box that contains every point at which a ray can
+  /// be incident on this object.
+  ///
+  /// Returns false if the object has no finite extent (e.g. an infinite plane),
+  /// in which case \p out_bounds is left untouched.  The scene uses these
+  /// bounds to avoid calling \c incident for rays that can't hit the object,
+  /// so overriding this is purely a performance optimization.
+  virtual bool bounds(AxisAlignedBox &out_bounds) const { return false; }
+
+  /// Return true if this object is a "miss shader", i.e. if it only provides
+  /// the color of rays that don't hit anything else in the scene.
+  ///
+  /// The sky is the canonical example.  Miss shaders are consulted after
+  /// every other object has been tested, and their \c incident is never
+  /// called by the scene.
+  virtual bool is_miss_shader() const { return false; }
+
+  /// Compute the color of the ray \p r that did not hit any other object in
+  /// the scene, returning it in \p out_pixel.  Only called on objects that
+  /// return true from \c is_miss_shader.
+  virtual void shade_miss(ThreadContext &ctx, const Ray &r,
+                          HdrColor &out_pixel) const {
+    unreachable("Not a miss shader!");
+  }
 
   /// Return a string describing the object.
   const std::string &description() const { return _desc; }
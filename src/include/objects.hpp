@@ -11,13 +11,22 @@ namespace ray {
 
 class BoxObj : public Object {
   Cube _cube;
-  std::array<Color, Cube::kFaceCount> _colors;
+  std::array<HdrColor, Cube::kFaceCount> _colors;
 
 public:
   BoxObj(const Scene &scene, const Vector &center, const Vector &normal_a,
-         const Vector &normal_b, double side);
-  virtual bool incident(ThreadContext &, const Ray &, double, double &,
-                        Color &) const override;
+         const Vector &normal_b, Ruler::Real side);
+
+  const Cube &cube() const { return _cube; }
+  static bool classof(const Object *o) {
+    return o->kind() == ObjectKindTy::box;
+  }
+
+  virtual bool incident(ThreadContext &, const Ray &, Ruler::Real,
+                        Ruler::Real &, HdrColor &) const override;
+  virtual bool occludes(ThreadContext &, const Ray &,
+                        Ruler::Real) const override;
+  virtual bool bounds(AxisAlignedBox &) const override;
 };
 
 class SphericalMirrorObj : public Object {
@@ -26,39 +35,61 @@ class SphericalMirrorObj : public Object {
   static unsigned max_nesting() { return SphericalMirrorObj::_max_nesting; }
 
 public:
-  SphericalMirrorObj(const Scene &scene, const Vector &center, double radius)
+  SphericalMirrorObj(const Scene &scene, const Vector &center,
+                     Ruler::Real radius)
       : Object(scene,
                generate_description_string("SphericalMirrorObj", "center",
-                                           center, "radius", radius)),
+                                           center, "radius", radius),
+               ObjectKindTy::spherical_mirror),
         _sphere(center, radius) {}
-  virtual bool incident(ThreadContext &, const Ray &, double, double &,
-                        Color &) const override;
+
+  const Sphere &sphere() const { return _sphere; }
+  static bool classof(const Object *o) {
+    return o->kind() == ObjectKindTy::spherical_mirror;
+  }
+
+  virtual bool incident(ThreadContext &, const Ray &, Ruler::Real,
+                        Ruler::Real &, HdrColor &) const override;
+  virtual bool occludes(ThreadContext &, const Ray &,
+                        Ruler::Real) const override;
+  virtual bool bounds(AxisAlignedBox &) const override;
 };
 
+/// The sky.  This is a miss shader, so it colors every ray that doesn't hit
+/// anything else in the scene.
 class SkyObj : public Object {
   bool _uniform = false;
 
 public:
   SkyObj(const Scene &scene, bool uniform = false)
       : Object(scene,
-               generate_description_string("SkyObj", "uniform", uniform)),
+               generate_description_string("SkyObj", "uniform", uniform),
+               ObjectKindTy::sky),
         _uniform(uniform) {}
 
-  virtual bool incident(ThreadContext &, const Ray &, double, double &,
-                        Color &) const override;
+  static bool classof(const Object *o) {
+    return o->kind() == ObjectKindTy::sky;
+  }
+
+  virtual bool incident(ThreadContext &, const Ray &, Ruler::Real,
+                        Ruler::Real &, HdrColor &) const override;
+  virtual bool is_miss_shader() const override { return true; }
+  virtual void shade_miss(ThreadContext &, const Ray &,
+                          HdrColor &) const override;
 };
 
 class InfinitePlane : public Object {
   Plane _plane;
-  double _check_size;
+  Ruler::Real _check_size;
   Vector _axis_0, _axis_1;
 
 public:
   InfinitePlane(const Scene &scene, Plane plane, Vector axis_0,
-                double check_size)
+                Ruler::Real check_size)
       : Object(scene, generate_description_string("InfinitePlane", "plane",
                                                   plane, "axis-0", axis_0,
-                                                  "check-size", check_size)),
+                                                  "check-size", check_size),
+               ObjectKindTy::infinite_plane),
         _plane(plane), _check_size(check_size), _axis_0(axis_0),
         _axis_1(axis_0.cross_product(plane.normal())) {
 
@@ -66,8 +97,14 @@ public:
     _axis_1 = _axis_1.normalize();
   }
 
-  virtual bool incident(ThreadContext &, const Ray &, double, double &,
-                        Color &) const override;
+  static bool classof(const Object *o) {
+    return o->kind() == ObjectKindTy::infinite_plane;
+  }
+
+  virtual bool incident(ThreadContext &, const Ray &, Ruler::Real,
+                        Ruler::Real &, HdrColor &) const override;
+  virtual bool occludes(ThreadContext &, const Ray &,
+                        Ruler::Real) const override;
 };
 
 class RefractiveBoxObj : public Object {
@@ -76,14 +113,23 @@ class RefractiveBoxObj : public Object {
   static constexpr unsigned _max_nesting = 10;
   static unsigned max_nesting() { return RefractiveBoxObj::_max_nesting; }
   Cube _cube;
-  double _relative_refractive_index;
+  Ruler::Real _relative_refractive_index;
 
 public:
   RefractiveBoxObj(const Scene &scene, const Vector &center,
-                   const Vector &normal_a, const Vector &normal_b, double side,
-                   double ref_index);
-  virtual bool incident(ThreadContext &, const Ray &, double, double &,
-                        Color &) const override;
+                   const Vector &normal_a, const Vector &normal_b,
+                   Ruler::Real side, Ruler::Real ref_index);
+
+  const Cube &cube() const { return _cube; }
+  static bool classof(const Object *o) {
+    return o->kind() == ObjectKindTy::refractive_box;
+  }
+
+  virtual bool incident(ThreadContext &, const Ray &, Ruler::Real,
+                        Ruler::Real &, HdrColor &) const override;
+  virtual bool occludes(ThreadContext &, const Ray &,
+                        Ruler::Real) const override;
+  virtual bool bounds(AxisAlignedBox &) const override;
 };
 }
 
@@ -0,0 +1,122 @@
+/// ray-packet.hpp: Bundles of coherent rays that are traced together.
+///
+
+#ifndef RAY_RAY_PACKET_HPP
+#define RAY_RAY_PACKET_HPP
+
+#include "euclid.hpp"
+
+#include <cmath>
+
+namespace ray {
+
+/// A small bundle of rays with a common origin, like the primary rays of a
+/// block of neighboring pixels.
+///
+/// If the directions of the rays agree in sign along every axis the packet is
+/// "coherent", and its rays are bounded by a frustum that can be tested against
+/// an AxisAlignedBox about as cheaply as one ray can.  This lets a bounding
+/// volume hierarchy cull a node for all rays in the packet at once.
+class RayPacket {
+public:
+  static constexpr unsigned kMaxSize = 16;
+
+private:
+  Vector _origin;
+  unsigned _size = 0;
+  Vector _directions[kMaxSize];
+  Vector _inv_dirs[kMaxSize];
+
+  /// The component-wise bounds on the inverse directions of the rays, which
+  /// together with _origin describe the frustum.
+  Ruler::Real _inv_dir_min[3], _inv_dir_max[3];
+  bool _is_coherent = true;
+
+public:
+  /// Add \p r to the packet.  All rays in a packet must start at the same
+  /// point.
+  void push_back(const Ray &r) {
+    assert(_size < kMaxSize && "Packet is full!");
+
+    const Vector &d = r.direction();
+    Vector inv_dir(1.0 / d.i(), 1.0 / d.j(), 1.0 / d.k());
+
+    if (_size == 0) {
+      _origin = r.offset();
+      for (unsigned axis = 0; axis < 3; axis++)
+        _inv_dir_min[axis] = _inv_dir_max[axis] = inv_dir.component(axis);
+    } else {
+      assert(r.offset().i() == _origin.i() && r.offset().j() == _origin.j() &&
+             r.offset().k() == _origin.k() && "Expected a common origin!");
+    }
+
+    for (unsigned axis = 0; axis < 3; axis++) {
+      Ruler::Real inv = inv_dir.component(axis);
+      // A ray parallel to an axis would make the frustum unbounded.
+      if (!std::isfinite(inv) ||
+          Ruler::is_negative(inv) != Ruler::is_negative(_inv_dir_min[axis]))
+        _is_coherent = false;
+      _inv_dir_min[axis] = std::min(_inv_dir_min[axis], inv);
+      _inv_dir_max[axis] = std::max(_inv_dir_max[axis], inv);
+    }
+
+    _directions[_size] = d;
+    _inv_dirs[_size] = inv_dir;
+    _size++;
+  }
+
+  unsigned size() const { return _size; }
+
+  Ray ray(unsigned idx) const {
+    assert(idx < size() && "Out of bounds!");
+    return Ray::from_offset_and_direction(_origin, _directions[idx]);
+  }
+
+  /// Return the component-wise inverse of the direction of ray \p idx.
+  const Vector &inv_dir(unsigned idx) const {
+    assert(idx < size() && "Out of bounds!");
+    return _inv_dirs[idx];
+  }
+
+  /// Return true if the directions of the rays agree in sign along every axis.
+  /// Only coherent packets can be tested with \c may_intersect.
+  bool is_coherent() const { return _size != 0 && _is_coherent; }
+
+  /// Return true if the direction of every ray is negative along \p axis.
+  bool is_negative(unsigned axis) const {
+    assert(is_coherent() && "Expected a coherent packet!");
+    return Ruler::is_negative(_inv_dir_min[axis]);
+  }
+
+  /// Return false if no ray in this packet passes through \p b at an offset
+  /// in [0, \p max_k].  This is conservative: it can return true even if no
+  /// ray hits \p b, but never returns false if some ray does (in the sense of
+  /// \c AxisAlignedBox::intersect).
+  bool may_intersect(const AxisAlignedBox &b, Ruler::Real max_k) const {
+    assert(is_coherent() && "Expected a coherent packet!");
+
+    // Interval arithmetic over the slab test: each ray enters the slab at
+    // (near - origin) * inv for some inv in [_inv_dir_min, _inv_dir_max], and
+    // a product with one fixed factor is monotonic in the other, even after
+    // rounding.
+    Ruler::Real k_begin = Ruler::zero(), k_end = max_k;
+    for (unsigned axis = 0; axis < 3; axis++) {
+      Ruler::Real origin = _origin.component(axis);
+      Ruler::Real near = b.min().component(axis) - origin;
+      Ruler::Real far = b.max().component(axis) - origin;
+      if (is_negative(axis))
+        std::swap(near, far);
+
+      Ruler::Real inv_min = _inv_dir_min[axis], inv_max = _inv_dir_max[axis];
+      k_begin = std::max(k_begin, std::min(near * inv_min, near * inv_max));
+      k_end = std::min(k_end, std::max(far * inv_min, far * inv_max));
+      if (k_begin > k_end)
+        return false;
+    }
+
+    return true;
+  }
+};
+}
+
+#endif
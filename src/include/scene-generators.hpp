@@ -10,7 +10,10 @@
 
 namespace ray {
 
-typedef std::function<Camera(Scene &)> SceneGeneratorTy;
+/// Builds a scene into the Scene it is given, as it is \p time seconds into
+/// an animation, and returns the camera to view it with.  Time 0 is the still
+/// frame.
+typedef std::function<Camera(Scene &, double time)> SceneGeneratorTy;
 
 /// Returns the scene generator named \p name, and null if no such
 /// scene generator exists.
@@ -4,32 +4,172 @@
 #ifndef RAY_SCENE_HPP
 #define RAY_SCENE_HPP
 
+#include "bvh.hpp"
 #include "object.hpp"
+#include "ray-packet.hpp"
+#include "sphere-array.hpp"
 #include "thread-context.hpp"
+#include "thread-pool.hpp"
+#include "topology.hpp"
 #include "support.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace ray {
 
+/// How a Scene lays out its bounded objects.
+enum class ObjectStorageTy {
+  /// One bounding volume hierarchy over all of the bounded objects, which are
+  /// intersected through virtual calls to \c Object::incident.
+  per_object,
+
+  /// Objects whose concrete type the scene knows about are grouped by the type
+  /// of their geometry (all spheres together, all cubes together), with one
+  /// bounding volume hierarchy per group over a contiguous array of the
+  /// group's geometry.  Rays are intersected with that geometry in tight,
+  /// non-virtual loops (vectorized, for spheres), and only the closest hit
+  /// gets shaded through \c Object::incident.  All other objects are stored
+  /// per object.
+  type_batched
+};
+
+/// The order in which Camera::snap visits the tiles of the image, and the
+/// pixels within a tile.
+enum class TileOrderTy {
+  /// Column by column.
+  column_major,
+
+  /// Along a Morton (Z-order) curve.
+  morton,
+
+  /// Along a Hilbert curve, which keeps consecutive tiles (and pixels)
+  /// adjacent, so that consecutive rays tend to touch the same objects and
+  /// nodes of the bounding volume hierarchy while those are still in cache.
+  hilbert
+};
+
+/// A group of objects with the same type of geometry, stored contiguously and
+/// in the order of the leaves of \c bvh.  \p StorageTy lets a type of geometry
+/// use a layout tailored to intersecting it, like \c SphereArray.
+template <typename GeometryTy,
+          typename StorageTy = std::vector<GeometryTy>>
+struct GeometryBatch {
+  StorageTy geometry;
+  std::vector<const Object *> owners;
+  BoundingVolumeHierarchy bvh;
+};
+
 /// A scene is a collection of \code Object s with some related raytracing
 /// logic.
 ///
+/// A ray is first tested against the objects without finite bounds (e.g.
+/// infinite planes), then against the objects in the bounding volume
+/// hierarchy, and if neither yields a hit its color comes from the miss shader
+/// (e.g. the sky).  The order in which objects are added does not matter.
+///
 /// \see Object
 class Scene {
   std::vector<std::unique_ptr<Object>> _objects;
 
+  /// Objects with finite bounds that aren't in one of the geometry batches.
+  /// These are indexed by the primitive indices in \c _bvh.
+  std::vector<const Object *> _bounded_objects;
+
+  ObjectStorageTy _object_storage = ObjectStorageTy::type_batched;
+  GeometryBatch<Sphere, SphereArray> _spheres;
+  GeometryBatch<Cube> _cubes;
+
+  /// Objects without finite bounds, other than the miss shader.  These are
+  /// tested against every ray.
+  std::vector<const Object *> _unbounded_objects;
+
+  /// The object that colors rays that don't hit anything, if any.  If the
+  /// scene has more than one miss shader, the first one added wins.
+  const Object *_miss_shader = nullptr;
+
+  BoundingVolumeHierarchy _bvh;
+  BVHStats _bvh_stats;
+  bool _bvh_is_stale = true;
+
+  /// Find the closest intersection of \p r with the geometry batches at an
+  /// offset in [0, \p max_k), ignoring the objects in \p ignored.  Returns
+  /// the owner of the intersected geometry (or null if there isn't any) and
+  /// lowers \p max_k to the offset of the intersection.
+  const Object *
+  closest_batched_hit(const Ray &r, Ruler::Real &max_k,
+                      const std::vector<const Object *> &ignored) const;
+
+  /// The closest intersection of a ray with the geometry batches.
+  struct BatchedHit {
+    const Object *object;
+    Ruler::Real k;
+  };
+
+  /// Like the public \c render_pixel, but if \p known_hit is not null it is
+  /// the result of closest_batched_hit(r, infinity, {}), already computed by
+  /// the caller.
+  HdrColor render_pixel(const Ray &r, ThreadContext &ctx,
+                        const BatchedHit *known_hit) const;
+
 public:
   /// Add object \p o to the objects contained in this scene.
   void add_object(std::unique_ptr<Object> o) {
     _objects.push_back(std::move(o));
+    _bvh_is_stale = true;
+  }
+
+  /// Sort the objects into bounded objects, unbounded objects and the miss
+  /// shader, and build the bounding volume hierarchy \c render_pixel uses to
+  /// find the bounded objects a ray can hit.
+  ///
+  /// This needs to be called after the last object is added and before the
+  /// first pixel is rendered.
+  void build_bvh(const BVHBuildOptions &options = BVHBuildOptions());
+
+  /// Return statistics about the last build of the bounding volume hierarchy
+  /// (or hierarchies, when the objects are type batched).
+  const BVHStats &bvh_stats() const { return _bvh_stats; }
+
+  /// Choose how the bounded objects are stored.  Takes effect on the next call
+  /// to \c build_bvh.
+  void set_object_storage(ObjectStorageTy storage) {
+    _object_storage = storage;
+    _bvh_is_stale = true;
   }
 
+  /// Return true if objects were added after the last call to \c build_bvh.
+  bool is_bvh_stale() const { return _bvh_is_stale; }
+
   /// Render a single pixel, with the thread context passed in as \p ctx.
   ///
   /// Return the color of the rendered pixel.
-  Color render_pixel(const Ray &r, ThreadContext &ctx) const;
+  HdrColor render_pixel(const Ray &r, ThreadContext &ctx) const {
+    return render_pixel(r, ctx, nullptr);
+  }
+
+  /// Render the pixels whose primary rays are in \p p, writing the color of
+  /// ray i to \p out[i].
+  ///
+  /// The result is the same as that of calling \c render_pixel for each ray.
+  /// If \p p is coherent its rays are traced through the geometry batches
+  /// together, but everything past the first intersection (and all secondary
+  /// rays, e.g. from mirrors or refractive boxes) is traced one ray at a time.
+  void render_packet(const RayPacket &p, ThreadContext &ctx,
+                     HdrColor *out) const;
+
+  /// Return true if some object intersects \p r at an offset in [0, \p max_k).
+  ///
+  /// This is meant for visibility queries (shadow rays and the like): it stops
+  /// at the first intersection it finds, and never shades anything.  Miss
+  /// shaders don't occlude.
+  bool occluded(const Ray &r, Ruler::Real max_k, ThreadContext &ctx) const;
 
   /// Initialize the object_id fields of the contained objects, related state in
   /// \p ctx.
@@ -39,6 +179,144 @@ public:
   unsigned object_count() const { return _objects.size(); }
 };
 
+/// Statistics about a call to \c Camera::snap.
+struct RenderStats {
+  double render_seconds = 0.0;
+
+  /// The spacing, in pixels, of the samples of the last finished pass.  This
+  /// is 1 unless a progressive render ran out of time.
+  unsigned sample_spacing = 1;
+
+  /// The number of primary rays traced, divided by the number of pixels.
+  double samples_per_pixel = 0.0;
+
+  /// Per render thread: the time it spent rendering tiles (as opposed to
+  /// looking for tiles or waiting for the other threads), the number of tiles
+  /// it rendered, and how many of those it stole from other threads.
+  std::vector<double> busy_seconds;
+  std::vector<unsigned> tile_counts;
+  std::vector<unsigned> stolen_counts;
+
+  /// The fraction of the render time the threads spent busy, on average.  This
+  /// is close to 1 if the work was evenly balanced.
+  double utilization() const {
+    double busy = 0.0;
+    for (double s : busy_seconds)
+      busy += s;
+    if (busy_seconds.empty() || render_seconds <= 0.0)
+      return 1.0;
+    return busy / (busy_seconds.size() * render_seconds);
+  }
+
+  void print(std::ostream &out) const {
+    out << "[Render: " << render_seconds * 1000.0
+        << "ms Sample spacing: " << sample_spacing
+        << " Samples per pixel: " << samples_per_pixel
+        << " Utilization: " << utilization() * 100.0 << "%";
+    for (unsigned i = 0, e = busy_seconds.size(); i != e; ++i)
+      out << " Thread " << i << ": " << busy_seconds[i] * 1000.0 << "ms "
+          << tile_counts[i] << " tiles (" << stolen_counts[i] << " stolen)";
+    out << "]";
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const RenderStats &s) {
+  s.print(out);
+  return out;
+}
+
+/// The outcome of a render started by \c Camera::snap_async, which may have
+/// been cancelled part of the way through.
+struct RenderResult {
+  /// The image, with the pixels of tiles the render never got to left blue.
+  Bitmap image = Bitmap(0, 0, Color());
+
+  /// The image is cut into a grid of tile_size x tile_size tiles, with
+  /// tile_done[row * tile_columns + column] set if the tile at that column and
+  /// row has a sample for each of its pixels, and with supersampling has had
+  /// its edge pixels resampled.
+  unsigned tile_size = 0;
+  unsigned tile_columns = 0;
+  unsigned tile_rows = 0;
+  std::vector<bool> tile_done;
+
+  /// True if every tile is done, and supersampling (if enabled) finished too.
+  bool is_complete = false;
+
+  RenderStats stats;
+
+  /// Return true if pixel (\p x, \p y) of the image is in a finished tile.
+  bool is_pixel_done(unsigned x, unsigned y) const {
+    unsigned column = x / tile_size, row = y / tile_size;
+    return column < tile_columns && row < tile_rows &&
+           tile_done[row * tile_columns + column];
+  }
+};
+
+/// A render running in the background, as started by \c Camera::snap_async.
+///
+/// Destroying the handle cancels the render and waits for it to stop.
+class RenderHandle {
+  friend class Camera;
+
+  std::thread _thread;
+  std::atomic<bool> _is_cancelled{false};
+
+  /// Set by the render once it knows how many tiles there are (twice that
+  /// with supersampling, which passes over every tile again), and bumped as
+  /// each pass finishes with a tile.
+  std::atomic<unsigned> _tile_count{0};
+  std::atomic<unsigned> _finished_tile_count{0};
+
+  /// Written by the render threads, one element each, and only read once the
+  /// render is over.
+  std::vector<uint8_t> _tile_done;
+
+  std::mutex _lock;
+  std::condition_variable _stopped;
+  bool _is_stopped = false;
+  RenderResult _result;
+
+  RenderHandle() {}
+
+public:
+  ~RenderHandle();
+
+  RenderHandle(const RenderHandle &) = delete;
+  RenderHandle &operator=(const RenderHandle &) = delete;
+
+  /// Ask the render to stop.  The render threads finish the tiles they are
+  /// rendering, and start no new ones.  This doesn't wait for them.
+  void cancel() { _is_cancelled = true; }
+
+  /// Wait until the render stops (because it finished or was cancelled), or
+  /// until \p deadline, whichever comes first.  Returns true if the render
+  /// stopped.
+  bool wait_until(std::chrono::steady_clock::time_point deadline);
+
+  /// Like \c wait_until, but wait for at most \p seconds.
+  bool wait_for(double seconds);
+
+  /// Wait until the render stops.
+  void wait();
+
+  /// Return true if the render has stopped.
+  bool is_stopped();
+
+  /// The fraction of the work on the tiles that is done: the tiles that have
+  /// a sample for each of their pixels, and with supersampling the tiles
+  /// that have had their edge pixels resampled.  This is 1 once every tile
+  /// is done.
+  double progress() const {
+    unsigned tile_count = _tile_count;
+    return tile_count == 0 ? 0.0 : double(_finished_tile_count) / tile_count;
+  }
+
+  /// Wait until the render stops, and return what it rendered.  This must
+  /// only be called once.
+  RenderResult take_result();
+};
+
 /// Represents the camera in a scene.
 ///
 /// The camera decides which ray each pixel in the generated 2D image
@@ -54,13 +332,171 @@ class Camera {
 
   const Vector _focus_position;
 
+  unsigned _packet_size = 16;
+  unsigned _samples_per_pixel = 1;
+  unsigned _contrast_threshold = 32;
+  TileOrderTy _tile_order = TileOrderTy::hilbert;
+  RenderStats _render_stats;
+
+  /// The part of the image that \c snap renders, in pixels of the full image.
+  unsigned _crop_x = 0;
+  unsigned _crop_y = 0;
+  unsigned _crop_width;
+  unsigned _crop_height;
+
+public:
+  /// Called by \c snap_progressive with the image so far and the spacing of
+  /// its samples every time a pass over the image finishes.
+  typedef std::function<void(const Bitmap &, unsigned)> PassCallbackTy;
+
+private:
+  /// The implementation of the \c snap functions, which renders into \p image
+  /// (the size of the crop).  \p image is an HdrBitmap, or a Bitmap that each
+  /// pixel is tone mapped into as soon as it is shaded, so that rendering a
+  /// Bitmap never holds a whole frame of HdrColors.  A negative
+  /// \p budget_seconds means there is no budget.  \p on_pass (if set) gets
+  /// \p image after every finished pass.  If \p handle is set the render stops
+  /// once it is cancelled, and reports its progress to it.
+  template <typename ImageTy>
+  void render(Scene &s, ThreadPool &pool, ImageTy &image,
+              double budget_seconds,
+              const std::function<void(const ImageTy &, unsigned)> &on_pass,
+              std::vector<std::string> *logs, RenderHandle *handle = nullptr);
+
 public:
   explicit Camera(Ruler::Real focal_length, unsigned screen_width_px,
                   unsigned screen_height_px, unsigned screen_resolution,
                   const Vector &pos);
 
-  Bitmap snap(Scene &s, unsigned thread_count = 12,
+  /// Trace the primary rays of blocks of \p size neighboring pixels together
+  /// as a RayPacket.  \p size must be 1 (no packets), 4, 8 or 16.
+  void set_packet_size(unsigned size) {
+    assert((size == 1 || size == 4 || size == 8 || size == 16) &&
+           "Unsupported packet size!");
+    _packet_size = size;
+  }
+
+  /// Choose the order in which tiles, and pixels within tiles, are rendered.
+  /// Threads start out with contiguous ranges of tiles in this order.
+  void set_tile_order(TileOrderTy order) { _tile_order = order; }
+
+  /// Supersample pixels that differ from one of their four neighbors by more
+  /// than \p contrast_threshold in some color channel, i.e. pixels on edges,
+  /// with a grid of \p samples_per_pixel samples.  Other pixels keep their
+  /// one sample.  \p samples_per_pixel must be 1 (no supersampling, the
+  /// default), 4, 9 or 16.
+  void set_supersampling(unsigned samples_per_pixel,
+                         unsigned contrast_threshold = 32) {
+    assert((samples_per_pixel == 1 || samples_per_pixel == 4 ||
+            samples_per_pixel == 9 || samples_per_pixel == 16) &&
+           "Unsupported sample count!");
+    _samples_per_pixel = samples_per_pixel;
+    _contrast_threshold = contrast_threshold;
+  }
+
+  /// Render only the \p width x \p height pixels of the image whose top left
+  /// corner is pixel (\p x, \p y), so that \c snap returns just that part of
+  /// the image.  The pixels come out as they would in the full image, except
+  /// that supersampling can't see past the edges of the crop.
+  void set_crop(unsigned x, unsigned y, unsigned width, unsigned height) {
+    assert(x + width <= _screen_width_px && y + height <= _screen_height_px &&
+           "Crop is out of bounds!");
+    _crop_x = x;
+    _crop_y = y;
+    _crop_width = width;
+    _crop_height = height;
+  }
+
+  unsigned screen_width_px() const { return _screen_width_px; }
+  unsigned screen_height_px() const { return _screen_height_px; }
+
+  /// Render \p s as seen through this camera.
+  ///
+  /// The image is cut into small tiles, which are split evenly between
+  /// \p thread_count threads.  A thread that runs out of tiles steals tiles
+  /// from the others, so threads that drew cheap parts of the image (like the
+  /// sky) help out with the expensive ones.
+  ///
+  /// The threads come from a pool that is shared by every call with the same
+  /// \p thread_count, so calling this once per frame doesn't create threads
+  /// once per frame.
+  ///
+  /// If supersampling is enabled, a second pass then supersamples the pixels
+  /// that differ too much from one of their neighbors.
+  ///
+  /// The image is rendered (and the samples of each pixel averaged) in
+  /// floating point, and tone mapped to 8 bits per channel as each pixel is
+  /// stored.
+  Bitmap snap(Scene &s, unsigned thread_count = default_thread_count(),
+              std::vector<std::string> *logs = nullptr);
+
+  /// Like the other \c snap, but render with the threads in \p pool.
+  Bitmap snap(Scene &s, ThreadPool &pool,
               std::vector<std::string> *logs = nullptr);
+
+  /// Like \c snap, but render into \p out (which must be the size of the
+  /// crop) instead of a new Bitmap.  With \p out from
+  /// \c Bitmap::create_mapped_file the threads tone map each pixel straight
+  /// into the output file, with no other copy of the image in memory.
+  void snap_into(Scene &s, Bitmap &out,
+                 unsigned thread_count = default_thread_count());
+
+  /// Like the other \c snap_into, but render with the threads in \p pool.
+  void snap_into(Scene &s, ThreadPool &pool, Bitmap &out);
+
+  /// Like \c snap, but hand the image to \p sink a band of rows at a time,
+  /// as soon as each band is done, instead of returning it.  Only two bands
+  /// of the image are in memory at any time.
+  ///
+  /// The bands are rendered one after the other, each by all of the threads,
+  /// and each band is handed to \p sink on another thread while the next one
+  /// renders, so \p sink must not use the render threads.  The image is the
+  /// same as that of \c snap, including supersampling across the edges of
+  /// bands.  Returns false if the sink failed, in which case the render stops
+  /// early.
+  bool snap_streaming(Scene &s, ImageSink &sink,
+                      unsigned thread_count = default_thread_count());
+
+  /// Like the other \c snap_streaming, but render with the threads in
+  /// \p pool.
+  bool snap_streaming(Scene &s, ThreadPool &pool, ImageSink &sink);
+
+  /// Like \c snap, but return the image before tone mapping, with the full
+  /// precision of shading.
+  HdrBitmap snap_hdr(Scene &s, ThreadPool &pool,
+                     std::vector<std::string> *logs = nullptr);
+
+  /// Render \p s in passes of increasing quality, stopping once about
+  /// \p budget_seconds have passed.
+  ///
+  /// The first pass takes one sample per 8x8 block of pixels, and always
+  /// finishes regardless of the budget.  Every later pass halves the spacing
+  /// of the samples, until each pixel has its own sample; the result is then
+  /// the same as that of \c snap.  \p on_pass (if set) gets the image after
+  /// every finished pass (and after supersampling, if enabled and there is
+  /// time left), so it always has the best image so far.  A pass that
+  /// runs out of time stops between tiles, so some tiles of the returned
+  /// image may be finer than the others.  \c render_stats tells how far the
+  /// render got.
+  Bitmap snap_progressive(Scene &s, unsigned thread_count,
+                          double budget_seconds,
+                          const PassCallbackTy &on_pass = PassCallbackTy());
+
+  /// Like the other \c snap_progressive, but render with the threads in
+  /// \p pool.
+  Bitmap snap_progressive(Scene &s, ThreadPool &pool, double budget_seconds,
+                          const PassCallbackTy &on_pass = PassCallbackTy());
+
+  /// Start rendering \p s with the threads in \p pool, like \c snap, on a
+  /// thread of its own, and return a handle to watch, cancel or wait for the
+  /// render with.
+  ///
+  /// The scene, this camera and \p pool must not be used by anything else
+  /// (or destroyed) until the render stops.
+  std::unique_ptr<RenderHandle> snap_async(Scene &s, ThreadPool &pool);
+
+  /// Return statistics about the last call to \c snap.
+  const RenderStats &render_stats() const { return _render_stats; }
 };
 }
 
@@ -0,0 +1,234 @@
+/// sphere-array.hpp: A structure-of-arrays sphere container with a vectorized
+/// ray intersection kernel.
+///
+
+#ifndef RAY_SPHERE_ARRAY_HPP
+#define RAY_SPHERE_ARRAY_HPP
+
+#include "euclid.hpp"
+
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace ray {
+
+/// A collection of spheres stored as a structure of arrays, so that one ray can
+/// be intersected with \c kWidth consecutive spheres at once.
+///
+/// With AVX2 (which -march=native enables on machines that have it) the kernel
+/// uses 256 bit vectors, i.e. 4 doubles or 8 floats, and otherwise it falls
+/// back to an equivalent scalar loop.  Either way it does what
+/// \c Sphere::intersect does, operation for operation, so the results match it
+/// up to the fused multiply-adds the compiler may contract the scalar code
+/// into.
+template <typename RealTy> class SphereArrayT {
+public:
+  typedef RealTy Real;
+
+  /// The number of spheres \c intersect tests at once.
+  static constexpr unsigned kWidth = 32 / sizeof(Real);
+
+  /// Per-ray values that \c intersect needs.  Computing these once per ray
+  /// instead of once per sphere is part of what makes the kernel fast.
+  class RayConstants {
+    friend class SphereArrayT;
+
+    Real _d_i, _d_j, _d_k;
+    Real _o_i, _o_j, _o_k;
+    Real _two_a, _four_a;
+    Real _two_d_o, _o_o;
+
+  public:
+    explicit RayConstants(const RayT<Real> &r) {
+      const VectorT<Real> &d = r.direction();
+      const VectorT<Real> &o = r.offset();
+      _d_i = d.i(), _d_j = d.j(), _d_k = d.k();
+      _o_i = o.i(), _o_j = o.j(), _o_k = o.k();
+      Real a = d * d;
+      _two_a = 2 * a;
+      _four_a = 4 * a;
+      _two_d_o = 2 * (d * o);
+      _o_o = o * o;
+    }
+  };
+
+  void push_back(const SphereT<Real> &s) {
+    // Overwrite the padding with the new sphere, and re-pad.
+    _center_i.resize(_size);
+    _center_j.resize(_size);
+    _center_k.resize(_size);
+    _rhs.resize(_size);
+
+    _center_i.push_back(s.center().i());
+    _center_j.push_back(s.center().j());
+    _center_k.push_back(s.center().k());
+    _rhs.push_back(s.center() * s.center() - s.radius() * s.radius());
+    _size++;
+
+    // Pad with spheres no ray can hit, so that \c intersect can always read
+    // kWidth spheres.  An infinite rhs makes the discriminant negative.
+    for (unsigned i = 0; i < kWidth - 1; i++) {
+      _center_i.push_back(0.0);
+      _center_j.push_back(0.0);
+      _center_k.push_back(0.0);
+      _rhs.push_back(RulerT<Real>::infinity());
+    }
+  }
+
+  unsigned size() const { return _size; }
+
+  /// Intersect the ray described by \p rc with the spheres [first, first +
+  /// kWidth).
+  ///
+  /// Returns a bit mask with bit i set if the sphere first + i is among the
+  /// first \p count spheres and the ray intersects it (in the sense of
+  /// \c Sphere::intersect) at an offset in [0, \p max_k).  The offset of the
+  /// intersection with sphere first + i is returned in out_k[i]; the other
+  /// entries of \p out_k are unspecified.
+  unsigned intersect(const RayConstants &rc, unsigned first, unsigned count,
+                     Real max_k, Real *out_k) const {
+    assert(first + count <= size() && count <= kWidth && "Out of bounds!");
+
+#ifdef __AVX2__
+    return intersect_avx2(rc, first, max_k, out_k) & ((1u << count) - 1);
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < count; i++) {
+      unsigned idx = first + i;
+      Real d_c = rc._d_i * _center_i[idx] + rc._d_j * _center_j[idx] +
+                 rc._d_k * _center_k[idx];
+      Real o_c = rc._o_i * _center_i[idx] + rc._o_j * _center_j[idx] +
+                 rc._o_k * _center_k[idx];
+      Real b = rc._two_d_o - 2 * d_c;
+      Real c = rc._o_o - 2 * o_c + _rhs[idx];
+
+      Real disc_sqr = b * b - rc._four_a * c;
+      if (RulerT<Real>::is_negative(disc_sqr))
+        continue;
+
+      out_k[i] = (-b - std::sqrt(disc_sqr)) / rc._two_a;
+      if (!RulerT<Real>::is_negative(out_k[i]) && out_k[i] < max_k)
+        mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+private:
+  unsigned _size = 0;
+  std::vector<Real> _center_i, _center_j, _center_k, _rhs;
+
+#ifdef __AVX2__
+  /// The vectorized kernel behind \c intersect, for all kWidth lanes.
+  unsigned intersect_avx2(const RayConstants &rc, unsigned first, Real max_k,
+                          Real *out_k) const;
+#endif
+};
+
+template <typename RealTy> constexpr unsigned SphereArrayT<RealTy>::kWidth;
+
+#ifdef __AVX2__
+template <>
+inline unsigned
+SphereArrayT<double>::intersect_avx2(const RayConstants &rc, unsigned first,
+                                     double max_k, double *out_k) const {
+  __m256d c_i = _mm256_loadu_pd(&_center_i[first]);
+  __m256d c_j = _mm256_loadu_pd(&_center_j[first]);
+  __m256d c_k = _mm256_loadu_pd(&_center_k[first]);
+  __m256d rhs = _mm256_loadu_pd(&_rhs[first]);
+
+  // d * center and o * center.
+  __m256d d_c = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(rc._d_i), c_i),
+                    _mm256_mul_pd(_mm256_set1_pd(rc._d_j), c_j)),
+      _mm256_mul_pd(_mm256_set1_pd(rc._d_k), c_k));
+  __m256d o_c = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(rc._o_i), c_i),
+                    _mm256_mul_pd(_mm256_set1_pd(rc._o_j), c_j)),
+      _mm256_mul_pd(_mm256_set1_pd(rc._o_k), c_k));
+
+  __m256d two = _mm256_set1_pd(2.0);
+  __m256d b =
+      _mm256_sub_pd(_mm256_set1_pd(rc._two_d_o), _mm256_mul_pd(two, d_c));
+  __m256d c = _mm256_add_pd(
+      _mm256_sub_pd(_mm256_set1_pd(rc._o_o), _mm256_mul_pd(two, o_c)), rhs);
+
+  __m256d disc_sqr =
+      _mm256_sub_pd(_mm256_mul_pd(b, b),
+                    _mm256_mul_pd(_mm256_set1_pd(rc._four_a), c));
+  __m256d has_root = _mm256_cmp_pd(disc_sqr, _mm256_setzero_pd(), _CMP_GE_OQ);
+  if (!_mm256_movemask_pd(has_root))
+    return 0;
+
+  // 2 * a is positive, so (-b - disc) / (2 * a) is the smaller root and the
+  // only one we need.
+  __m256d disc = _mm256_sqrt_pd(disc_sqr);
+  __m256d neg_b = _mm256_xor_pd(b, _mm256_set1_pd(-0.0));
+  __m256d k = _mm256_div_pd(_mm256_sub_pd(neg_b, disc),
+                            _mm256_set1_pd(rc._two_a));
+
+  __m256d hit = _mm256_and_pd(
+      has_root,
+      _mm256_and_pd(_mm256_cmp_pd(k, _mm256_setzero_pd(), _CMP_GE_OQ),
+                    _mm256_cmp_pd(k, _mm256_set1_pd(max_k), _CMP_LT_OQ)));
+
+  _mm256_storeu_pd(out_k, k);
+  return _mm256_movemask_pd(hit);
+}
+
+template <>
+inline unsigned
+SphereArrayT<float>::intersect_avx2(const RayConstants &rc, unsigned first,
+                                    float max_k, float *out_k) const {
+  __m256 c_i = _mm256_loadu_ps(&_center_i[first]);
+  __m256 c_j = _mm256_loadu_ps(&_center_j[first]);
+  __m256 c_k = _mm256_loadu_ps(&_center_k[first]);
+  __m256 rhs = _mm256_loadu_ps(&_rhs[first]);
+
+  // d * center and o * center.
+  __m256 d_c = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(rc._d_i), c_i),
+                    _mm256_mul_ps(_mm256_set1_ps(rc._d_j), c_j)),
+      _mm256_mul_ps(_mm256_set1_ps(rc._d_k), c_k));
+  __m256 o_c = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(rc._o_i), c_i),
+                    _mm256_mul_ps(_mm256_set1_ps(rc._o_j), c_j)),
+      _mm256_mul_ps(_mm256_set1_ps(rc._o_k), c_k));
+
+  __m256 two = _mm256_set1_ps(2.0f);
+  __m256 b =
+      _mm256_sub_ps(_mm256_set1_ps(rc._two_d_o), _mm256_mul_ps(two, d_c));
+  __m256 c = _mm256_add_ps(
+      _mm256_sub_ps(_mm256_set1_ps(rc._o_o), _mm256_mul_ps(two, o_c)), rhs);
+
+  __m256 disc_sqr =
+      _mm256_sub_ps(_mm256_mul_ps(b, b),
+                    _mm256_mul_ps(_mm256_set1_ps(rc._four_a), c));
+  __m256 has_root = _mm256_cmp_ps(disc_sqr, _mm256_setzero_ps(), _CMP_GE_OQ);
+  if (!_mm256_movemask_ps(has_root))
+    return 0;
+
+  // 2 * a is positive, so (-b - disc) / (2 * a) is the smaller root and the
+  // only one we need.
+  __m256 disc = _mm256_sqrt_ps(disc_sqr);
+  __m256 neg_b = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+  __m256 k =
+      _mm256_div_ps(_mm256_sub_ps(neg_b, disc), _mm256_set1_ps(rc._two_a));
+
+  __m256 hit = _mm256_and_ps(
+      has_root,
+      _mm256_and_ps(_mm256_cmp_ps(k, _mm256_setzero_ps(), _CMP_GE_OQ),
+                    _mm256_cmp_ps(k, _mm256_set1_ps(max_k), _CMP_LT_OQ)));
+
+  _mm256_storeu_ps(out_k, k);
+  return _mm256_movemask_ps(hit);
+}
+#endif
+
+typedef SphereArrayT<Ruler::Real> SphereArray;
+}
+
+#endif
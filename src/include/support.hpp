@@ -3,10 +3,12 @@
 #ifndef RAY_SUPPORT_HPP
 #define RAY_SUPPORT_HPP
 
+#include <cassert>
 #include <memory>
 #include <utility>
 #include <string>
 #include <sstream>
+#include <iterator>
 #include <iostream>
 
 #ifndef NDEBUG
@@ -32,6 +34,23 @@ std::unique_ptr<T> make_unique(Args &&... args) {
   return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+/// LLVM style RTTI (we build with -fno-rtti): return true if \p f is a \p To,
+/// as decided by \p To::classof.
+template <typename To, typename From> bool isa(const From *f) {
+  return To::classof(f);
+}
+
+/// Cast \p f to a \p To, which it must be.
+template <typename To, typename From> const To *cast(const From *f) {
+  assert(isa<To>(f) && "Bad cast!");
+  return static_cast<const To *>(f);
+}
+
+/// Cast \p f to a \p To if it is one, and return null otherwise.
+template <typename To, typename From> const To *dyn_cast(const From *f) {
+  return isa<To>(f) ? static_cast<const To *>(f) : nullptr;
+}
+
 /// A wrapper around printf that appends a "\n" after the message
 /// printf would've printed.
 #define printf_cr(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
@@ -14,15 +14,29 @@ namespace ray {
 class ThreadContext {
   std::unique_ptr<intptr_t[]> _obj_data;
   unsigned _obj_count;
+  unsigned _obj_capacity;
   Logger _logger;
 
 public:
   explicit ThreadContext(unsigned obj_count, bool enable_logger)
       : _obj_data(new intptr_t[obj_count]), _obj_count(obj_count),
-        _logger(enable_logger) {
+        _obj_capacity(obj_count), _logger(enable_logger) {
     (void)_obj_count;
   }
 
+  /// Make room for \p obj_count objects and start a new log, so that a
+  /// long-lived context can be reused for another scene.  The storage is only
+  /// reallocated if it is too small, in which case it is zeroed, so that the
+  /// calling thread is the first to touch it.
+  void reset(unsigned obj_count, bool enable_logger) {
+    if (obj_count > _obj_capacity) {
+      _obj_data.reset(new intptr_t[obj_count]());
+      _obj_capacity = obj_count;
+    }
+    _obj_count = obj_count;
+    _logger = Logger(enable_logger);
+  }
+
   Logger &logger() { return _logger; }
 
   /// Retrieve the thread local storage for the object with object id \p obj_id.
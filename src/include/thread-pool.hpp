@@ -0,0 +1,85 @@
+/// thread-pool.hpp: Long-lived render threads.
+
+#ifndef RAY_THREAD_POOL_HPP
+#define RAY_THREAD_POOL_HPP
+
+#include "thread-context.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ray {
+
+/// A fixed set of worker threads, each with its own ThreadContext, that live
+/// as long as the pool does.
+///
+/// Creating threads and allocating their contexts once, instead of once per
+/// frame, matters for clients that render many frames in one process (e.g.
+/// animations).
+///
+/// Workers are pinned to CPUs as \c CpuTopology::placement suggests, and
+/// allocate their own contexts once pinned, so that a context lives on the
+/// NUMA node of the thread that uses it.
+class ThreadPool {
+public:
+  /// The work \c run hands to each worker: called with the index of the
+  /// worker and its context.
+  typedef std::function<void(unsigned, ThreadContext &)> JobTy;
+
+private:
+  std::vector<std::thread> _workers;
+  std::vector<std::unique_ptr<ThreadContext>> _contexts;
+
+  std::mutex _lock;
+  std::condition_variable _job_posted;
+  std::condition_variable _job_finished;
+
+  /// The job being run, if any, and a counter that is bumped for every job
+  /// so that workers can tell a new job from one they already ran.
+  const JobTy *_job = nullptr;
+  uint64_t _job_generation = 0;
+  unsigned _busy_count = 0;
+  bool _is_shutting_down = false;
+
+  /// The number of workers that were given a CPU but couldn't be pinned to
+  /// it, and run wherever the operating system puts them instead.
+  unsigned _unpinned_count = 0;
+
+  /// The body of worker \p worker_idx, which runs on logical CPU \p cpu, or
+  /// wherever the operating system puts it if \p cpu is negative.
+  void worker_loop(unsigned worker_idx, int cpu);
+
+public:
+  /// Start \p thread_count workers.  If \p pin_threads is false the workers
+  /// are left to the operating system's scheduler.
+  explicit ThreadPool(unsigned thread_count, bool pin_threads = true);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned thread_count() const { return _workers.size(); }
+
+  /// Return the number of workers that were to be pinned to a CPU but
+  /// couldn't be, e.g. because the process may not run there.
+  unsigned unpinned_count() const { return _unpinned_count; }
+
+  /// Return the context of worker \p worker_idx.  This must not be called
+  /// while \c run is running.
+  ThreadContext &context(unsigned worker_idx) {
+    assert(worker_idx < thread_count() && "Out of bounds!");
+    return *_contexts[worker_idx];
+  }
+
+  /// Call \p job once on every worker, and return once all of the calls have
+  /// returned.  Only one thread may call \c run at a time.
+  void run(const JobTy &job);
+};
+}
+
+#endif
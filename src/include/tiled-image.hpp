@@ -0,0 +1,99 @@
+/// tiled-image.hpp: Images stored on disk as square tiles, for renders that
+/// don't fit in memory.
+///
+
+#ifndef RAY_TILED_IMAGE_HPP
+#define RAY_TILED_IMAGE_HPP
+
+#include "bitmap.hpp"
+
+#include <memory>
+
+namespace ray {
+
+/// An image in a file on disk, cut into square tiles that are each stored
+/// contiguously, so that any tile can be read or written on its own.
+///
+/// As an ImageSink it takes the image a band of rows at a time (e.g. from
+/// \c Camera::snap_streaming), and keeps only the rows that don't yet fill a
+/// row of tiles in memory.  \c stitch then hands the image to another
+/// ImageSink (e.g. a PNG writer) a row of tiles at a time, so an image far
+/// larger than memory can be rendered and written in any format.
+///
+/// The file starts with a 16 byte header: "RAYT", then the width, the height
+/// and the tile size as 32 bit little endian integers.  The tiles follow in
+/// row major order, each in a slot of tile size x tile size pixels, with
+/// its pixels in row major order as blue, green and red bytes.  The tiles on
+/// the right and bottom edges are cut to the image, and only use the start
+/// of their slots.
+class TiledImageFile : public ImageSink {
+  int _fd;
+  unsigned _height;
+  unsigned _width;
+  unsigned _tile_size;
+
+  /// The rows given to \c write_rows that don't fill a row of tiles yet, and
+  /// the number of them, which start at row \c _next_row - \c _pending_rows.
+  /// Only allocated by \c begin, so files opened to be read don't hold them.
+  std::unique_ptr<Bitmap> _pending;
+  unsigned _pending_rows = 0;
+  unsigned _next_row = 0;
+
+  TiledImageFile(int fd, unsigned height, unsigned width, unsigned tile_size);
+
+  uint64_t tile_offset(unsigned column, unsigned row) const;
+
+  /// Write the pending rows out as a row of tiles.
+  bool flush_pending();
+
+public:
+  static const unsigned kDefaultTileSize = 64;
+
+  /// Create (or truncate) the file at \p path for an image of \p width x
+  /// \p height pixels in tiles of \p tile_size x \p tile_size pixels.  The
+  /// tiles start out black.  Returns null if the file can't be created.
+  static std::unique_ptr<TiledImageFile>
+  create(const char *path, unsigned height, unsigned width,
+         unsigned tile_size = kDefaultTileSize);
+
+  /// Open the existing file at \p path for reading, e.g. to stitch it.
+  /// Returns null if it can't be opened, isn't a tiled image file or is
+  /// not the size its header says.
+  static std::unique_ptr<TiledImageFile> open(const char *path);
+
+  ~TiledImageFile();
+
+  TiledImageFile(const TiledImageFile &) = delete;
+  TiledImageFile &operator=(const TiledImageFile &) = delete;
+
+  unsigned height() const { return _height; }
+  unsigned width() const { return _width; }
+  unsigned tile_size() const { return _tile_size; }
+  unsigned columns() const { return (_width + _tile_size - 1) / _tile_size; }
+  unsigned rows() const { return (_height + _tile_size - 1) / _tile_size; }
+
+  /// Return the size of the tile in \p column and \p row, which is smaller
+  /// than the tile size on the right and bottom edges.
+  unsigned tile_width(unsigned column) const;
+  unsigned tile_height(unsigned row) const;
+
+  /// Write \p tile, which has to be the size of the tile, to the tile in
+  /// \p column and \p row.  Different tiles can be written from different
+  /// threads at once.  Returns false if the write failed.
+  bool write_tile(unsigned column, unsigned row, const Bitmap &tile);
+
+  /// Read the tile in \p column and \p row into \p tile, which has to be the
+  /// size of the tile.  Returns false if the read failed.
+  bool read_tile(unsigned column, unsigned row, Bitmap &tile) const;
+
+  bool begin(unsigned width, unsigned height) override;
+  bool write_rows(const Bitmap &band, unsigned first_row) override;
+  bool end() override;
+
+  /// Hand the image to \p sink a row of tiles at a time, with only that row
+  /// in memory.  Returns false if reading the file or the sink failed.
+  bool stitch(ImageSink &sink) const;
+};
+}
+
+#endif
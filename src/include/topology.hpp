@@ -0,0 +1,76 @@
+/// topology.hpp: The CPUs of the machine, and placing threads on them.
+
+#ifndef RAY_TOPOLOGY_HPP
+#define RAY_TOPOLOGY_HPP
+
+#include <string>
+#include <vector>
+
+namespace ray {
+
+/// A CPU as the operating system sees it, i.e. a hardware thread.
+struct LogicalCpu {
+  unsigned id = 0;
+
+  /// The socket, the physical core within the socket, and the NUMA node the
+  /// CPU belongs to.
+  unsigned package = 0;
+  unsigned core = 0;
+  unsigned node = 0;
+};
+
+/// The logical CPUs of a machine, grouped into physical cores and NUMA nodes.
+class CpuTopology {
+  std::vector<LogicalCpu> _cpus;
+  bool _is_known;
+
+public:
+  /// \p cpus may be in any order.  \p is_known is false if the topology is a
+  /// guess, in which case threads shouldn't be pinned according to it.
+  explicit CpuTopology(std::vector<LogicalCpu> cpus, bool is_known = true);
+
+  /// Return the topology of this machine, as read from /sys/devices/system
+  /// the first time this is called, restricted to the CPUs in the affinity
+  /// mask of the process (which reflects e.g. the cpuset of its cgroup).
+  /// Without /sys this falls back to the CPUs in the affinity mask, or to
+  /// std::thread::hardware_concurrency() CPUs, as separate cores on one node.
+  static const CpuTopology &get();
+
+  /// Return the part of this topology made of the CPUs in \p cpu_ids.
+  CpuTopology restricted_to(const std::vector<unsigned> &cpu_ids) const;
+
+  const std::vector<LogicalCpu> &cpus() const { return _cpus; }
+  bool is_known() const { return _is_known; }
+  unsigned physical_core_count() const;
+  unsigned node_count() const;
+
+  /// Return the logical CPU to run each of \p thread_count threads on.
+  ///
+  /// Each physical core gets one thread before any gets a second (on another
+  /// hardware thread), and consecutive threads go to different nodes in turn,
+  /// so that any number of threads is spread evenly over the nodes.  With
+  /// more threads than logical CPUs, CPUs are reused in the same order.
+  std::vector<unsigned> placement(unsigned thread_count) const;
+};
+
+/// Parse a list of CPUs (or nodes) in the format of /sys, e.g. "0-3,8,10-11".
+/// Returns false if \p list is malformed.
+bool parse_cpu_list(const std::string &list, std::vector<unsigned> &out_ids);
+
+/// Read the logical CPUs the calling process may run on into \p out_ids.
+/// Returns false if the affinity mask can't be read.
+bool read_process_affinity(std::vector<unsigned> &out_ids);
+
+/// Restrict the calling thread to logical CPU \p cpu.  Returns false if that
+/// isn't possible.
+bool pin_current_thread(unsigned cpu);
+
+/// The number of render threads to use when the client doesn't say: one per
+/// physical core, since hardware threads on the same core mostly compete for
+/// the same floating point units.
+inline unsigned default_thread_count() {
+  return CpuTopology::get().physical_core_count();
+}
+}
+
+#endif
@@ -0,0 +1,59 @@
+/// work-stealing.hpp: Queues for distributing work between threads.
+///
+
+#ifndef RAY_WORK_STEALING_HPP
+#define RAY_WORK_STEALING_HPP
+
+#include <deque>
+#include <mutex>
+
+namespace ray {
+
+/// A queue of work items owned by one thread, from which other threads can
+/// steal when they run out of work of their own.
+///
+/// The owner takes items from the front and thieves take them from the back,
+/// so that the owner works through its items in the order they were pushed
+/// while thieves take the items the owner would have gotten to last.  Items are
+/// expected to be coarse (e.g. a tile of pixels), so a lock per queue is cheap
+/// enough.
+template <typename T> class WorkStealingDeque {
+  std::deque<T> _items;
+  mutable std::mutex _lock;
+
+public:
+  void push(const T &item) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _items.push_back(item);
+  }
+
+  /// Take the next item for the owning thread.  Returns false if the queue is
+  /// empty.
+  bool pop(T &out_item) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_items.empty())
+      return false;
+    out_item = _items.front();
+    _items.pop_front();
+    return true;
+  }
+
+  /// Take an item on behalf of a thread other than the owner.  Returns false
+  /// if the queue is empty.
+  bool steal(T &out_item) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_items.empty())
+      return false;
+    out_item = _items.back();
+    _items.pop_back();
+    return true;
+  }
+
+  unsigned size() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _items.size();
+  }
+};
+}
+
+#endif
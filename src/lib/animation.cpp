@@ -0,0 +1,82 @@
+#include "animation.hpp"
+
+#include <chrono>
+#include <thread>
+
+using namespace ray;
+
+namespace {
+/// A frame on its way through the pipeline.  The scene lives on the heap
+/// since its objects refer back to it.
+struct Frame {
+  std::unique_ptr<Scene> scene;
+  std::unique_ptr<Camera> camera;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+}
+
+void ray::render_animation(const SceneGeneratorTy &setup, unsigned frame_count,
+                           double frames_per_second, ThreadPool &pool,
+                           const FrameWriterTy &write_frame,
+                           AnimationStats *stats) {
+  assert(frames_per_second > 0.0 && "Expected time to pass!");
+  auto start = std::chrono::steady_clock::now();
+  std::vector<double> build_seconds(frame_count);
+  std::vector<double> render_seconds(frame_count);
+  std::vector<double> write_seconds(frame_count);
+
+  // Each stage of a frame runs on its own thread, except for the render
+  // stage, which runs on this one.  The stats are written by one stage each
+  // and read after the stage's thread is joined.
+  auto build = [&](unsigned frame_idx, Frame &out_frame) {
+    auto build_start = std::chrono::steady_clock::now();
+    out_frame.scene = make_unique<Scene>();
+    out_frame.camera = make_unique<Camera>(
+        setup(*out_frame.scene, frame_idx / frames_per_second));
+    if (out_frame.scene->is_bvh_stale())
+      out_frame.scene->build_bvh();
+    build_seconds[frame_idx] = seconds_since(build_start);
+  };
+
+  std::unique_ptr<Bitmap> written_bmp;
+  auto write = [&](unsigned frame_idx) {
+    auto write_start = std::chrono::steady_clock::now();
+    write_frame(frame_idx, *written_bmp);
+    write_seconds[frame_idx] = seconds_since(write_start);
+  };
+
+  Frame next_frame;
+  std::thread builder, writer;
+  if (frame_count != 0)
+    builder = std::thread([&]() { build(0, next_frame); });
+
+  for (unsigned i = 0; i < frame_count; i++) {
+    builder.join();
+    Frame frame = std::move(next_frame);
+    if (i + 1 < frame_count)
+      builder = std::thread([&, i]() { build(i + 1, next_frame); });
+
+    auto render_start = std::chrono::steady_clock::now();
+    Bitmap bmp = frame.camera->snap(*frame.scene, pool);
+    render_seconds[i] = seconds_since(render_start);
+
+    if (writer.joinable())
+      writer.join();
+    written_bmp = make_unique<Bitmap>(std::move(bmp));
+    writer = std::thread([&, i]() { write(i); });
+  }
+  if (writer.joinable())
+    writer.join();
+
+  if (stats) {
+    stats->total_seconds = seconds_since(start);
+    stats->build_seconds = std::move(build_seconds);
+    stats->render_seconds = std::move(render_seconds);
+    stats->write_seconds = std::move(write_seconds);
+  }
+}
@@ -2,34 +2,52 @@
 
 #include "bitops.hpp"
 
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 using namespace ray;
 
-Bitmap::Bitmap(unsigned h, unsigned w, Color background)
-    : _height(h), _width(w) {
+/// The size of the headers of the BMP files we write.
+static const unsigned kHeaderSize = 54;
 
-  _image = std::unique_ptr<Color[]>(new Color[pixel_count()]);
-  std::fill(&_image[0], &_image[pixel_count()], background);
+/// The size in bytes of a row of \p width pixels in a BMP file, which is
+/// padded to a multiple of 4 bytes.
+static uint64_t bmp_row_size(unsigned width) {
+  return (uint64_t(width) * 3 + 3) & ~uint64_t(3);
 }
 
-void Bitmap::write(std::ostream &out) {
+/// Encode the headers of a BMP file of \p width x \p height pixels into
+/// \p out.
+static void encode_bmp_header(unsigned width, unsigned height,
+                              uint8_t (&out)[kHeaderSize]) {
+  uint8_t *p = out;
   auto write_4byte = [&](uint32_t val) {
-    uint8_t encoded[4];
-    Bitops::encode_le(val, encoded);
-    out.write((char *)(&encoded[0]), 4);
+    Bitops::encode_le(val, p);
+    p += 4;
+  };
+  auto write_2byte = [&](uint8_t lo, uint8_t hi) {
+    *p++ = lo;
+    *p++ = hi;
   };
 
+  uint32_t size_of_pixel_data = bmp_row_size(width) * height;
+
   // file header
 
   // bitmap signature
-  out.write("BM", 2);
+  write_2byte('B', 'M');
 
-  uint32_t file_size = 54 + pixel_count() * 3;
+  uint32_t file_size = kHeaderSize + size_of_pixel_data;
   write_4byte(file_size);
 
   uint32_t reserved_0 = 0;
   write_4byte(reserved_0);
 
-  uint32_t offset_of_pixel_data = 54;
+  uint32_t offset_of_pixel_data = kHeaderSize;
   write_4byte(offset_of_pixel_data);
 
   // bitmap header
@@ -37,19 +55,18 @@ void Bitmap::write(std::ostream &out) {
   uint32_t header_size = 40;
   write_4byte(header_size);
 
-  write_4byte(width());
-  write_4byte(height());
+  write_4byte(width);
+  write_4byte(height);
 
-  uint8_t reserved_1[2] = {1, 0};
-  out.write((char *)reserved_1, 2);
+  // planes
+  write_2byte(1, 0);
 
-  uint8_t bits_per_pixel[2] = {24, 0};
-  out.write((char *)bits_per_pixel, 2);
+  // bits per pixel
+  write_2byte(24, 0);
 
   uint32_t compression_method = 0;
   write_4byte(compression_method);
 
-  uint32_t size_of_pixel_data = pixel_count() * 3;
   write_4byte(size_of_pixel_data);
 
   uint32_t horizontal_res = 2835;
@@ -64,10 +81,155 @@ void Bitmap::write(std::ostream &out) {
   uint32_t most_important_color = 0;
   write_4byte(most_important_color);
 
-  // pixel data
-  for (unsigned i = pixel_count(), e = 0; i != e; --i) {
-    Color &c = _image[i - 1];
-    uint8_t pixel_data[3] = {c.blue(), c.green(), c.red()};
-    out.write((char *)pixel_data, 3);
+  assert(p == out + kHeaderSize && "Header size mismatch!");
+}
+
+Bitmap::Bitmap(unsigned h, unsigned w, Color background)
+    : _height(h), _width(w) {
+
+  _image = std::unique_ptr<Color[]>(new Color[pixel_count()]);
+  std::fill(&_image[0], &_image[pixel_count()], background);
+  _origin = reinterpret_cast<uint8_t *>(_image.get());
+  _pixel_stride = sizeof(Color);
+  _row_stride = ptrdiff_t(w) * sizeof(Color);
+}
+
+void Unmapper::operator()(uint8_t *mapping) const {
+  munmap(mapping, size);
+}
+
+std::unique_ptr<Bitmap> Bitmap::create_mapped_file(const char *path,
+                                                   unsigned height,
+                                                   unsigned width) {
+  // The sizes in the header are 32 bits wide.
+  uint64_t row_size = bmp_row_size(width);
+  uint64_t file_size = kHeaderSize + row_size * height;
+  if (file_size > UINT32_MAX)
+    return nullptr;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return nullptr;
+  // The file is sized up front, so that the pixels (and the padding at the
+  // end of each row) start out as zeroes without being written.
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, file_size) == 0)
+    mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  std::unique_ptr<Bitmap> bmp(new Bitmap(0, 0, Color()));
+  bmp->_height = height;
+  bmp->_width = width;
+  bmp->_image.reset();
+  Unmapper unmapper;
+  unmapper.size = file_size;
+  bmp->_mapping = std::unique_ptr<uint8_t, Unmapper>(
+      static_cast<uint8_t *>(mapping), unmapper);
+
+  uint8_t header[kHeaderSize];
+  encode_bmp_header(width, height, header);
+  memcpy(bmp->_mapping.get(), header, kHeaderSize);
+
+  // Pixel (0, 0) is the last pixel of the last row of the file.
+  bmp->_pixel_stride = -ptrdiff_t(sizeof(Color));
+  bmp->_row_stride = -ptrdiff_t(row_size);
+  bmp->_origin = bmp->_mapping.get() + kHeaderSize;
+  if (height != 0 && width != 0)
+    bmp->_origin += (height - 1) * row_size + (width - 1) * sizeof(Color);
+  return bmp;
+}
+
+void Bitmap::write(std::ostream &out) const {
+  uint8_t header[kHeaderSize];
+  encode_bmp_header(width(), height(), header);
+  out.write((char *)header, kHeaderSize);
+
+  // The pixels go out in the reverse of their order in the bitmap: the file's
+  // first (bottom) row is our last row, written from right to left.  Rows are
+  // encoded into a buffer of about kChunkSize bytes, which is written out
+  // whenever it fills up, so that the stream sees a few large writes instead
+  // of one per pixel.
+  const uint64_t kChunkSize = 1 << 20;
+  uint64_t row_size = bmp_row_size(width());
+  uint64_t rows_per_chunk =
+      std::max(kChunkSize / std::max(row_size, uint64_t(1)), uint64_t(1));
+  std::unique_ptr<uint8_t[]> chunk(new uint8_t[rows_per_chunk * row_size]());
+
+  for (unsigned y = height(); y != 0;) {
+    uint8_t *p = chunk.get();
+    unsigned chunk_rows = std::min(rows_per_chunk, uint64_t(y));
+    for (unsigned r = 0; r < chunk_rows; r++, p += row_size) {
+      --y;
+      uint8_t *q = p;
+      for (unsigned x = width(); x != 0; --x) {
+        const Color &c = at(x - 1, y);
+        *q++ = c.blue();
+        *q++ = c.green();
+        *q++ = c.red();
+      }
+    }
+    out.write((char *)chunk.get(), chunk_rows * row_size);
+  }
+}
+
+void Bitmap::write_top_down_header(std::ostream &out, unsigned width,
+                                   unsigned height) {
+  uint8_t header[kHeaderSize];
+  encode_bmp_header(width, height, header);
+  // A negative height says the rows go from the top down.
+  Bitops::encode_le(-int32_t(height), header + 22);
+  out.write((char *)header, kHeaderSize);
+}
+
+HdrBitmap::HdrBitmap(unsigned h, unsigned w, HdrColor background)
+    : _height(h), _width(w) {
+  _image = std::unique_ptr<HdrColor[]>(new HdrColor[pixel_count()]);
+  std::fill(&_image[0], &_image[pixel_count()], background);
+}
+
+void HdrBitmap::tone_map(Bitmap &out, unsigned first_row,
+                         unsigned end_row) const {
+  assert(out.width() == width() && out.height() == height() &&
+         "Size mismatch!");
+  for (unsigned y = first_row; y < end_row; y++)
+    for (unsigned x = 0; x < width(); x++)
+      out.at(x, y) = at(x, y).to_color();
+}
+
+Bitmap HdrBitmap::tone_map() const {
+  Bitmap bmp(height(), width(), Color());
+  tone_map(bmp, 0, height());
+  return bmp;
+}
+
+void HdrBitmap::write_pfm(std::ostream &out) const {
+  // A negative scale says the floats are little endian.
+  static_assert(Bitops::IS_LITTLE_ENDIAN, "big endian unimplemented!");
+  out << "PF\n" << width() << " " << height() << "\n-1.0\n";
+
+  // Like BMP files, PFM files go from the bottom row up, and we write each
+  // row from right to left.
+  const uint64_t kChunkSize = 1 << 20;
+  uint64_t row_size = uint64_t(width()) * 3 * sizeof(float);
+  uint64_t rows_per_chunk =
+      std::max(kChunkSize / std::max(row_size, uint64_t(1)), uint64_t(1));
+  std::unique_ptr<float[]> chunk(new float[rows_per_chunk * width() * 3]);
+
+  for (unsigned y = height(); y != 0;) {
+    float *p = chunk.get();
+    unsigned chunk_rows = std::min(rows_per_chunk, uint64_t(y));
+    for (unsigned r = 0; r < chunk_rows; r++) {
+      --y;
+      for (unsigned x = width(); x != 0; --x) {
+        const HdrColor &c = at(x - 1, y);
+        *p++ = c.red();
+        *p++ = c.green();
+        *p++ = c.blue();
+      }
+    }
+    out.write((char *)chunk.get(), chunk_rows * row_size);
   }
 }
@@ -0,0 +1,277 @@
+#include "bvh.hpp"
+
+#include "support.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace ray;
+
+namespace {
+/// The number of bins the SAH split evaluates along each axis.
+const unsigned kBinCount = 16;
+
+/// The cost of visiting an interior node, relative to the cost of intersecting
+/// a primitive.
+const Ruler::Real kTraversalCost = 1.0;
+
+/// Ranges with fewer primitives than this are not worth handing to a new
+/// thread.
+const unsigned kMinParallelPrimitives = 1024;
+
+/// The SAH doesn't guarantee a balanced tree, so beyond this depth we fall back
+/// to median splits, which do.  This leaves enough room under kMaxDepth for
+/// about 2^30 primitives.
+const unsigned kMaxSAHDepth = 32;
+}
+
+constexpr unsigned BoundingVolumeHierarchy::kMaxLeafSize;
+constexpr unsigned BoundingVolumeHierarchy::kMaxDepth;
+
+struct BoundingVolumeHierarchy::BuildNode {
+  AxisAlignedBox bounds;
+
+  /// The range of primitives in this node; only meaningful for leaves.
+  unsigned begin = 0, end = 0;
+  unsigned split_axis = 0;
+
+  std::unique_ptr<BuildNode> children[2];
+
+  bool is_leaf() const { return !children[0]; }
+};
+
+struct BoundingVolumeHierarchy::BuildInput {
+  const std::vector<AxisAlignedBox> &bounds;
+  std::vector<Vector> centroids;
+  BVHSplitTy split;
+  unsigned max_leaf_size;
+
+  explicit BuildInput(const std::vector<AxisAlignedBox> &b,
+                      const BVHBuildOptions &options)
+      : bounds(b), split(options.split),
+        max_leaf_size(std::max(options.max_leaf_size, 1u)) {
+    centroids.reserve(bounds.size());
+    for (auto &box : bounds)
+      centroids.push_back(box.centroid());
+  }
+};
+
+/// Find the split of \p prims that minimizes the surface area heuristic, and
+/// partition \p prims accordingly.
+///
+/// Returns false if a leaf is cheaper than any split (and \p prims has no more
+/// than \p max_leaf_size primitives) or if the SAH could not find a split at
+/// all, e.g. because all of the centroids coincide.  Otherwise returns true,
+/// with the partition point in \p out_mid and the axis in \p out_axis.
+static bool split_sah(const std::vector<AxisAlignedBox> &bounds,
+                      const std::vector<Vector> &centroids, unsigned *prims,
+                      unsigned count, const AxisAlignedBox &node_bounds,
+                      const AxisAlignedBox &centroid_bounds,
+                      unsigned max_leaf_size, unsigned &out_mid,
+                      unsigned &out_axis) {
+  struct Bin {
+    AxisAlignedBox bounds;
+    unsigned count = 0;
+  };
+
+  Ruler::Real node_area = node_bounds.surface_area();
+  Ruler::Real best_cost = Ruler::infinity();
+  unsigned best_axis = 0, best_bin = 0;
+
+  auto bin_index = [&](unsigned prim, unsigned axis, Ruler::Real lo,
+                       Ruler::Real scale) {
+    unsigned b = unsigned((centroids[prim].component(axis) - lo) * scale);
+    return std::min(b, kBinCount - 1);
+  };
+
+  for (unsigned axis = 0; axis < 3; axis++) {
+    Ruler::Real lo = centroid_bounds.min().component(axis);
+    Ruler::Real extent = centroid_bounds.max().component(axis) - lo;
+    if (!(extent > Ruler::zero()))
+      continue;
+    Ruler::Real scale = kBinCount / extent;
+
+    Bin bins[kBinCount];
+    for (unsigned i = 0; i < count; i++) {
+      Bin &b = bins[bin_index(prims[i], axis, lo, scale)];
+      b.bounds.extend(bounds[prims[i]]);
+      b.count++;
+    }
+
+    // right_cost[i] is the (area weighted) cost of the bins after split i.
+    Ruler::Real right_cost[kBinCount - 1];
+    AxisAlignedBox acc;
+    unsigned acc_count = 0;
+    for (unsigned i = kBinCount - 1; i > 0; i--) {
+      acc.extend(bins[i].bounds);
+      acc_count += bins[i].count;
+      right_cost[i - 1] = acc.surface_area() * acc_count;
+    }
+
+    acc = AxisAlignedBox();
+    acc_count = 0;
+    for (unsigned i = 0; i < kBinCount - 1; i++) {
+      acc.extend(bins[i].bounds);
+      acc_count += bins[i].count;
+      Ruler::Real cost = acc.surface_area() * acc_count + right_cost[i];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = i;
+      }
+    }
+  }
+
+  if (best_cost == Ruler::infinity())
+    return false;
+
+  best_cost = kTraversalCost + best_cost / node_area;
+  if (count <= max_leaf_size && count <= best_cost)
+    return false;
+
+  Ruler::Real lo = centroid_bounds.min().component(best_axis);
+  Ruler::Real scale =
+      kBinCount / (centroid_bounds.max().component(best_axis) - lo);
+  unsigned *mid = std::partition(prims, prims + count, [&](unsigned prim) {
+    return bin_index(prim, best_axis, lo, scale) <= best_bin;
+  });
+
+  out_mid = mid - prims;
+  out_axis = best_axis;
+  return out_mid != 0 && out_mid != count;
+}
+
+void BoundingVolumeHierarchy::build(const std::vector<AxisAlignedBox> &bounds,
+                                    const BVHBuildOptions &options) {
+  auto start = std::chrono::steady_clock::now();
+
+  _nodes.clear();
+  _primitives.clear();
+  _stats = BVHStats();
+
+  if (bounds.empty())
+    return;
+
+  for (unsigned i = 0, e = bounds.size(); i != e; ++i)
+    _primitives.push_back(i);
+
+  BuildInput input(bounds, options);
+  std::unique_ptr<BuildNode> root = build_recursive(
+      input, 0, bounds.size(), 0, std::max(options.thread_count, 1u));
+
+  // A binary tree with at least one primitive per leaf has fewer than twice as
+  // many nodes as primitives.
+  _nodes.reserve(2 * bounds.size());
+  flatten(*root, 0, root->bounds.surface_area());
+
+  _stats.node_count = _nodes.size();
+  _stats.build_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+}
+
+std::unique_ptr<BoundingVolumeHierarchy::BuildNode>
+BoundingVolumeHierarchy::build_recursive(const BuildInput &input,
+                                         unsigned begin, unsigned end,
+                                         unsigned depth,
+                                         unsigned thread_count) {
+  auto node = make_unique<BuildNode>();
+  node->begin = begin;
+  node->end = end;
+
+  AxisAlignedBox centroid_bounds;
+  for (unsigned i = begin; i != end; ++i) {
+    node->bounds.extend(input.bounds[_primitives[i]]);
+    centroid_bounds.extend(input.centroids[_primitives[i]]);
+  }
+
+  unsigned count = end - begin;
+  if (count == 1)
+    return node;
+
+  unsigned mid = 0, axis = 0;
+  bool found_split = false;
+  if (input.split == BVHSplitTy::sah && depth < kMaxSAHDepth) {
+    found_split =
+        split_sah(input.bounds, input.centroids, &_primitives[begin], count,
+                  node->bounds, centroid_bounds, input.max_leaf_size, mid,
+                  axis);
+    mid += begin;
+  }
+
+  if (!found_split) {
+    if (count <= input.max_leaf_size)
+      return node;
+
+    // Split at the median centroid along the axis the centroids are most
+    // spread out on.  Splitting by count (and not by position) bounds the
+    // depth of the tree by log2 of the primitive count.
+    axis = centroid_bounds.longest_axis();
+    mid = begin + count / 2;
+    auto prims = _primitives.begin();
+    std::nth_element(prims + begin, prims + mid, prims + end,
+                     [&](unsigned a, unsigned b) {
+                       return input.centroids[a].component(axis) <
+                              input.centroids[b].component(axis);
+                     });
+  }
+
+  node->split_axis = axis;
+
+  // The two halves touch disjoint ranges of _primitives, so they can be built
+  // concurrently.
+  if (thread_count > 1 && count >= kMinParallelPrimitives) {
+    unsigned left_threads = thread_count / 2;
+    std::thread left([&]() {
+      node->children[0] =
+          build_recursive(input, begin, mid, depth + 1, left_threads);
+    });
+    node->children[1] = build_recursive(input, mid, end, depth + 1,
+                                        thread_count - left_threads);
+    left.join();
+  } else {
+    node->children[0] = build_recursive(input, begin, mid, depth + 1, 1);
+    node->children[1] = build_recursive(input, mid, end, depth + 1, 1);
+  }
+
+  return node;
+}
+
+unsigned BoundingVolumeHierarchy::flatten(const BuildNode &node,
+                                          unsigned depth,
+                                          Ruler::Real root_area) {
+  unsigned node_idx = _nodes.size();
+  _nodes.emplace_back();
+  _nodes[node_idx]._bounds = node.bounds;
+
+  _stats.max_depth = std::max(_stats.max_depth, depth);
+  Ruler::Real area_ratio =
+      root_area > Ruler::zero() ? node.bounds.surface_area() / root_area
+                                : Ruler::one();
+
+  if (node.is_leaf()) {
+    _nodes[node_idx]._offset = node.begin;
+    _nodes[node_idx]._count = node.end - node.begin;
+    _stats.leaf_count++;
+    _stats.sah_cost += area_ratio * (node.end - node.begin);
+    return node_idx;
+  }
+
+  _stats.sah_cost += area_ratio * kTraversalCost;
+  flatten(*node.children[0], depth + 1, root_area);
+  unsigned right = flatten(*node.children[1], depth + 1, root_area);
+
+  // _nodes may have been reallocated by the recursive calls.
+  _nodes[node_idx]._offset = right;
+  _nodes[node_idx]._split_axis = node.split_axis;
+  return node_idx;
+}
+
+std::vector<unsigned> BoundingVolumeHierarchy::renumber_primitives() {
+  std::vector<unsigned> old_indices;
+  old_indices.swap(_primitives);
+  for (unsigned i = 0, e = old_indices.size(); i != e; ++i)
+    _primitives.push_back(i);
+  return old_indices;
+}
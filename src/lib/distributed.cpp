@@ -0,0 +1,350 @@
+#include "distributed.hpp"
+
+#include "bitops.hpp"
+#include "thread-pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace ray;
+
+namespace {
+/// The kinds of message the coordinator and the workers exchange.  Every
+/// message starts with a header of five little endian 32 bit words: the kind,
+/// and the x, y, width and height of a rectangle of pixels.
+enum class MessageTy : uint32_t {
+  /// Worker to coordinator, once the worker has built its scene.  The width
+  /// and height are those of the image.
+  ready = 1,
+
+  /// Coordinator to worker: render the rectangle.
+  assign = 2,
+
+  /// Worker to coordinator: the rectangle is done.  Its pixels follow the
+  /// header, row by row, as red, green and blue bytes.
+  tile = 3,
+
+  /// Coordinator to worker: there is nothing left to render.
+  quit = 4
+};
+
+struct Message {
+  MessageTy kind = MessageTy::quit;
+  unsigned x = 0, y = 0;
+  unsigned width = 0, height = 0;
+};
+
+const unsigned kHeaderSize = 5 * 4;
+
+/// The coordinator's view of a worker process.
+struct Worker {
+  pid_t pid = -1;
+
+  /// The coordinator's end of the socket, or -1 once the worker is done or
+  /// has failed.
+  int fd = -1;
+
+  bool is_ready = false;
+  bool is_busy = false;
+  bool failed = false;
+  Message assigned;
+  unsigned tile_count = 0;
+};
+}
+
+/// Write the \p size bytes at \p data to \p fd.  Returns false on error.
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+  while (size != 0) {
+    // MSG_NOSIGNAL, so that a process writing to a peer that died gets an
+    // error instead of a SIGPIPE.
+    ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// Read exactly \p size bytes from \p fd to \p data.  Returns false on error
+/// or if the peer closes its end first.
+static bool read_all(int fd, uint8_t *data, size_t size) {
+  while (size != 0) {
+    ssize_t read_size = read(fd, data, size);
+    if (read_size < 0 && errno == EINTR)
+      continue;
+    if (read_size <= 0)
+      return false;
+    data += read_size;
+    size -= read_size;
+  }
+  return true;
+}
+
+static void encode_header(const Message &m, uint8_t *out) {
+  Bitops::encode_le(uint32_t(m.kind), out);
+  Bitops::encode_le(m.x, out + 4);
+  Bitops::encode_le(m.y, out + 8);
+  Bitops::encode_le(m.width, out + 12);
+  Bitops::encode_le(m.height, out + 16);
+}
+
+static bool send_header(int fd, const Message &m) {
+  uint8_t header[kHeaderSize];
+  encode_header(m, header);
+  return write_all(fd, header, kHeaderSize);
+}
+
+static bool read_header(int fd, Message &out_m) {
+  uint8_t header[kHeaderSize];
+  if (!read_all(fd, header, kHeaderSize))
+    return false;
+  out_m.kind = MessageTy(Bitops::decode_le(header));
+  out_m.x = Bitops::decode_le(header + 4);
+  out_m.y = Bitops::decode_le(header + 8);
+  out_m.width = Bitops::decode_le(header + 12);
+  out_m.height = Bitops::decode_le(header + 16);
+  return true;
+}
+
+/// The body of a worker process, which talks to the coordinator over \p fd.
+/// Returns false if anything went wrong before the coordinator said to quit.
+static bool run_worker(int fd, const SceneGeneratorTy &setup,
+                       const DistributedOptions &options) {
+  Scene scene;
+  Camera camera = setup(scene, options.time);
+  ThreadPool pool(options.threads_per_process, false);
+
+  Message ready;
+  ready.kind = MessageTy::ready;
+  ready.width = camera.screen_width_px();
+  ready.height = camera.screen_height_px();
+  if (!send_header(fd, ready))
+    return false;
+
+  std::vector<uint8_t> buffer;
+  for (;;) {
+    Message m;
+    if (!read_header(fd, m))
+      return false;
+    if (m.kind == MessageTy::quit)
+      return true;
+    if (m.kind != MessageTy::assign || m.x + m.width > ready.width ||
+        m.y + m.height > ready.height)
+      return false;
+
+    camera.set_crop(m.x, m.y, m.width, m.height);
+    Bitmap tile = camera.snap(scene, pool);
+
+    m.kind = MessageTy::tile;
+    buffer.resize(kHeaderSize + tile.pixel_count() * 3);
+    encode_header(m, &buffer[0]);
+    uint8_t *pixel_data = &buffer[kHeaderSize];
+    for (unsigned y = 0; y < m.height; y++)
+      for (unsigned x = 0; x < m.width; x++) {
+        const Color &c = tile.at(x, y);
+        *pixel_data++ = c.red();
+        *pixel_data++ = c.green();
+        *pixel_data++ = c.blue();
+      }
+    if (!write_all(fd, buffer.data(), buffer.size()))
+      return false;
+  }
+}
+
+std::unique_ptr<Bitmap>
+ray::render_distributed(const SceneGeneratorTy &setup,
+                        const DistributedOptions &options,
+                        DistributedStats *stats) {
+  assert(options.process_count != 0 && options.threads_per_process != 0 &&
+         options.tile_size != 0 && "Expected work to do!");
+  auto start = std::chrono::steady_clock::now();
+
+  // A worker that can't be started counts as one that failed right away.
+  std::vector<Worker> workers(options.process_count);
+  for (unsigned i = 0; i < workers.size(); i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      workers[i].failed = true;
+      continue;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      for (unsigned j = 0; j < i; j++)
+        if (workers[j].fd >= 0)
+          close(workers[j].fd);
+      bool ok = run_worker(fds[1], setup, options);
+      // Skip the destructors of static objects, which this process only has
+      // copies of: e.g. a thread pool whose threads don't exist in this
+      // process would wait forever for them to exit.
+      _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    if (pid < 0) {
+      close(fds[0]);
+      workers[i].failed = true;
+      continue;
+    }
+    workers[i].pid = pid;
+    workers[i].fd = fds[0];
+  }
+
+  // The image is created when the first worker says how large it is.
+  // pending holds the tiles that haven't been handed out (again), and
+  // remaining_count the number of tiles that haven't come back.
+  std::unique_ptr<Bitmap> bmp;
+  std::deque<Message> pending;
+  unsigned remaining_count = 0;
+  std::vector<uint8_t> pixel_data;
+
+  auto fail = [&](Worker &w) {
+    if (w.is_busy)
+      pending.push_front(w.assigned);
+    w.is_busy = false;
+    w.failed = true;
+    close(w.fd);
+    w.fd = -1;
+  };
+
+  auto receive = [&](Worker &w) {
+    Message m;
+    if (!read_header(w.fd, m))
+      return false;
+
+    if (m.kind == MessageTy::ready) {
+      if (w.is_ready)
+        return false;
+      w.is_ready = true;
+      if (bmp)
+        return m.width == bmp->width() && m.height == bmp->height();
+
+      bmp = make_unique<Bitmap>(m.height, m.width, Color::create_blue());
+      for (unsigned y = 0; y < m.height; y += options.tile_size)
+        for (unsigned x = 0; x < m.width; x += options.tile_size) {
+          Message t;
+          t.kind = MessageTy::assign;
+          t.x = x;
+          t.y = y;
+          t.width = std::min(options.tile_size, m.width - x);
+          t.height = std::min(options.tile_size, m.height - y);
+          pending.push_back(t);
+        }
+      remaining_count = pending.size();
+      return true;
+    }
+
+    const Message &a = w.assigned;
+    if (m.kind != MessageTy::tile || !w.is_busy || m.x != a.x ||
+        m.y != a.y || m.width != a.width || m.height != a.height)
+      return false;
+    pixel_data.resize(m.width * m.height * 3);
+    if (!read_all(w.fd, pixel_data.data(), pixel_data.size()))
+      return false;
+
+    const uint8_t *p = pixel_data.data();
+    for (unsigned y = 0; y < m.height; y++)
+      for (unsigned x = 0; x < m.width; x++, p += 3)
+        bmp->at(m.x + x, m.y + y) = Color(p[0], p[1], p[2]);
+    w.is_busy = false;
+    w.tile_count++;
+    remaining_count--;
+    return true;
+  };
+
+  // Give each idle worker a tile, or tell it to quit once every tile is
+  // back.  Idle workers are kept around while tiles are out, in case the
+  // worker rendering one of them dies.
+  auto dispatch = [&]() {
+    for (auto &w : workers) {
+      if (w.fd < 0 || !w.is_ready || w.is_busy)
+        continue;
+      Message m;
+      if (!pending.empty())
+        m = pending.front();
+      else if (remaining_count != 0)
+        continue;
+
+      if (!send_header(w.fd, m)) {
+        fail(w);
+        continue;
+      }
+      if (m.kind == MessageTy::quit) {
+        close(w.fd);
+        w.fd = -1;
+        continue;
+      }
+      pending.pop_front();
+      w.is_busy = true;
+      w.assigned = m;
+    }
+  };
+
+  for (;;) {
+    std::vector<pollfd> poll_fds;
+    std::vector<Worker *> polled;
+    for (auto &w : workers)
+      if (w.fd >= 0) {
+        pollfd p;
+        p.fd = w.fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        poll_fds.push_back(p);
+        polled.push_back(&w);
+      }
+    if (poll_fds.empty())
+      break;
+
+    if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      // Closing the sockets makes the workers exit.
+      for (Worker *w : polled)
+        fail(*w);
+      break;
+    }
+
+    for (unsigned i = 0; i < poll_fds.size(); i++)
+      if (poll_fds[i].revents != 0 && !receive(*polled[i]))
+        fail(*polled[i]);
+    dispatch();
+  }
+
+  for (auto &w : workers) {
+    if (w.pid < 0)
+      continue;
+    int status = 0;
+    pid_t waited;
+    do
+      waited = waitpid(w.pid, &status, 0);
+    while (waited < 0 && errno == EINTR);
+    if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      w.failed = true;
+  }
+
+  if (stats) {
+    *stats = DistributedStats();
+    stats->render_seconds = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+    for (auto &w : workers) {
+      stats->tile_counts.push_back(w.tile_count);
+      stats->failed.push_back(w.failed);
+    }
+  }
+
+  if (!bmp || remaining_count != 0)
+    return nullptr;
+  return bmp;
+}
@@ -0,0 +1,662 @@
+#include "image-encoders.hpp"
+
+#include "bitops.hpp"
+#include "support.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace ray;
+
+namespace {
+/// Writes bits to a byte vector least significant bit first, as deflate
+/// wants them.
+class BitWriter {
+  std::vector<uint8_t> &_out;
+  uint64_t _bits = 0;
+  unsigned _bit_count = 0;
+
+public:
+  explicit BitWriter(std::vector<uint8_t> &out) : _out(out) {}
+
+  void put(uint32_t bits, unsigned count) {
+    _bits |= uint64_t(bits) << _bit_count;
+    _bit_count += count;
+    while (_bit_count >= 8) {
+      _out.push_back(uint8_t(_bits));
+      _bits >>= 8;
+      _bit_count -= 8;
+    }
+  }
+
+  /// Pad the output with zero bits to a byte boundary.
+  void align() {
+    if (_bit_count != 0)
+      put(0, 8 - _bit_count);
+  }
+};
+
+uint32_t reverse_bits(uint32_t bits, unsigned count) {
+  uint32_t result = 0;
+  for (unsigned i = 0; i < count; i++, bits >>= 1)
+    result = (result << 1) | (bits & 1);
+  return result;
+}
+
+const unsigned kLengthBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const unsigned kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                       4, 4, 4, 4, 5, 5, 5, 5, 0};
+const unsigned kDistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const unsigned kDistanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                         4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                         9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/// Deflate's fixed Huffman codes, bit reversed so that they can be written
+/// least significant bit first, and the symbol of each match length.
+struct DeflateTables {
+  uint16_t literal_code[288];
+  uint8_t literal_length[288];
+  uint8_t distance_code[30];
+  uint8_t length_symbol[259];
+
+  DeflateTables() {
+    for (unsigned s = 0; s < 288; s++) {
+      unsigned code, length;
+      if (s < 144) {
+        code = 0x30 + s;
+        length = 8;
+      } else if (s < 256) {
+        code = 0x190 + (s - 144);
+        length = 9;
+      } else if (s < 280) {
+        code = s - 256;
+        length = 7;
+      } else {
+        code = 0xc0 + (s - 280);
+        length = 8;
+      }
+      literal_code[s] = reverse_bits(code, length);
+      literal_length[s] = length;
+    }
+
+    for (unsigned d = 0; d < 30; d++)
+      distance_code[d] = reverse_bits(d, 5);
+
+    for (unsigned s = 0; s < 29; s++) {
+      unsigned end = s == 28 ? 259 : kLengthBase[s + 1];
+      for (unsigned l = kLengthBase[s]; l < end; l++)
+        length_symbol[l] = s;
+    }
+  }
+};
+
+const DeflateTables &deflate_tables() {
+  static const DeflateTables tables;
+  return tables;
+}
+
+/// Compress \p size bytes at \p data to \p out as deflate blocks, using the
+/// fixed Huffman codes and a greedy search for matches.  The blocks aren't
+/// final, and end on a byte boundary so that more can follow.
+void deflate_fixed(const uint8_t *data, size_t size,
+                   std::vector<uint8_t> &out) {
+  const DeflateTables &t = deflate_tables();
+  const unsigned kWindowSize = 32768, kHashBits = 15, kMaxChainLength = 16;
+  const unsigned kMinMatch = 3, kMaxMatch = 258;
+
+  // head[h] is the last position whose next three bytes hash to h, and
+  // prev[p % kWindowSize] the position before p with the same hash.
+  std::vector<int64_t> head(1 << kHashBits, -1), prev(kWindowSize, -1);
+  auto hash = [&](size_t p) {
+    uint32_t v = (data[p] << 16) | (data[p + 1] << 8) | data[p + 2];
+    return (v * 2654435761u) >> (32 - kHashBits);
+  };
+  auto insert = [&](size_t p) {
+    uint32_t h = hash(p);
+    prev[p % kWindowSize] = head[h];
+    head[h] = p;
+  };
+
+  BitWriter w(out);
+  w.put(0, 1); // not final
+  w.put(1, 2); // fixed Huffman codes
+
+  size_t i = 0;
+  while (i < size) {
+    unsigned best_length = 0, best_distance = 0;
+    if (i + kMinMatch <= size) {
+      unsigned max_length = std::min<size_t>(kMaxMatch, size - i);
+      int64_t candidate = head[hash(i)];
+      for (unsigned chain = 0; candidate >= 0 && chain < kMaxChainLength &&
+                               i - candidate <= kWindowSize;
+           chain++) {
+        const uint8_t *a = data + candidate, *b = data + i;
+        if (a[best_length] == b[best_length]) {
+          unsigned length = 0;
+          while (length < max_length && a[length] == b[length])
+            length++;
+          if (length > best_length) {
+            best_length = length;
+            best_distance = i - candidate;
+            if (length == max_length)
+              break;
+          }
+        }
+        int64_t next = prev[candidate % kWindowSize];
+        if (next >= candidate)
+          break;
+        candidate = next;
+      }
+      insert(i);
+    }
+
+    if (best_length < kMinMatch) {
+      w.put(t.literal_code[data[i]], t.literal_length[data[i]]);
+      i++;
+      continue;
+    }
+
+    unsigned ls = t.length_symbol[best_length];
+    w.put(t.literal_code[257 + ls], t.literal_length[257 + ls]);
+    w.put(best_length - kLengthBase[ls], kLengthExtraBits[ls]);
+    unsigned ds = std::upper_bound(kDistanceBase, kDistanceBase + 30,
+                                   best_distance) -
+                  kDistanceBase - 1;
+    w.put(t.distance_code[ds], 5);
+    w.put(best_distance - kDistanceBase[ds], kDistanceExtraBits[ds]);
+
+    // Long matches are mostly runs, which the position of their start finds
+    // again just as well; skip the rest to save time.
+    size_t end = i + best_length;
+    if (best_length <= 32)
+      for (i++; i < end && i + kMinMatch <= size; i++)
+        insert(i);
+    i = end;
+  }
+  w.put(t.literal_code[256], t.literal_length[256]);
+
+  // An empty stored block, which ends on a byte boundary.
+  w.put(0, 3);
+  w.align();
+  const uint8_t empty_stored[4] = {0x00, 0x00, 0xff, 0xff};
+  out.insert(out.end(), empty_stored, empty_stored + 4);
+}
+
+/// Write \p size bytes at \p data to \p out as stored deflate blocks, which
+/// aren't final.  The output must be at a byte boundary.
+void deflate_stored(const uint8_t *data, size_t size,
+                    std::vector<uint8_t> &out) {
+  do {
+    unsigned block_size = std::min<size_t>(size, 65535);
+    const uint8_t header[5] = {
+        0x00, uint8_t(block_size), uint8_t(block_size >> 8),
+        uint8_t(~block_size), uint8_t(~block_size >> 8)};
+    out.insert(out.end(), header, header + 5);
+    out.insert(out.end(), data, data + block_size);
+    data += block_size;
+    size -= block_size;
+  } while (size != 0);
+}
+
+const uint32_t kAdlerBase = 65521;
+
+uint32_t adler32(const uint8_t *data, size_t size) {
+  uint32_t a = 1, b = 0;
+  while (size != 0) {
+    // The largest n such that b can't overflow.
+    size_t n = std::min<size_t>(size, 5552);
+    for (size_t i = 0; i < n; i++) {
+      a += data[i];
+      b += a;
+    }
+    a %= kAdlerBase;
+    b %= kAdlerBase;
+    data += n;
+    size -= n;
+  }
+  return (b << 16) | a;
+}
+
+/// Return the Adler-32 checksum of two strings, given the checksum of each
+/// and the length of the second.
+uint32_t adler32_combine(uint32_t adler0, uint32_t adler1, uint64_t size1) {
+  uint64_t rem = size1 % kAdlerBase;
+  uint64_t a0 = adler0 & 0xffff, b0 = adler0 >> 16;
+  uint64_t a1 = adler1 & 0xffff, b1 = adler1 >> 16;
+  uint64_t a = (a0 + a1 + kAdlerBase - 1) % kAdlerBase;
+  uint64_t b = (rem * a0 + b0 + b1 + kAdlerBase - rem) % kAdlerBase;
+  return (b << 16) | a;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+  // entries[k][n] is the CRC of byte n followed by k zero bytes, so that four
+  // bytes can be folded in at a time.
+  static const struct CrcTable {
+    uint32_t entries[4][256];
+    CrcTable() {
+      for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (unsigned k = 0; k < 8; k++)
+          c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        entries[0][n] = c;
+      }
+      for (unsigned k = 1; k < 4; k++)
+        for (uint32_t n = 0; n < 256; n++)
+          entries[k][n] = entries[0][entries[k - 1][n] & 0xff] ^
+                          (entries[k - 1][n] >> 8);
+    }
+  } table;
+
+  crc = ~crc;
+  for (; size >= 4; data += 4, size -= 4) {
+    crc ^= Bitops::decode_le(data);
+    crc = table.entries[3][crc & 0xff] ^ table.entries[2][(crc >> 8) & 0xff] ^
+          table.entries[1][(crc >> 16) & 0xff] ^ table.entries[0][crc >> 24];
+  }
+  for (; size != 0; data++, size--)
+    crc = table.entries[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/// Copy row \p y of \p bmp to \p out as red, green and blue bytes, in the
+/// order Bitmap::write puts them in, i.e. from the last pixel to the first.
+void get_row(const Bitmap &bmp, unsigned y, uint8_t *out) {
+  for (unsigned x = bmp.width(); x != 0; --x) {
+    const Color &c = bmp.at(x - 1, y);
+    *out++ = c.red();
+    *out++ = c.green();
+    *out++ = c.blue();
+  }
+}
+
+/// Split the rows of \p bmp, each of which is \p row_bytes bytes before
+/// compression, into bands of about a megabyte, and call
+/// \p encode_band(first_row, end_row, band) for each of them on the threads
+/// of \p pool.  Returns the bands in order.
+template <typename BandTy, typename EncodeBandTy>
+std::vector<BandTy> encode_bands(const Bitmap &bmp, uint64_t row_bytes,
+                                 ThreadPool &pool, EncodeBandTy encode_band) {
+  const uint64_t kBandBytes = 1 << 20;
+  unsigned rows_per_band =
+      std::max<uint64_t>(kBandBytes / std::max<uint64_t>(row_bytes, 1), 1);
+  unsigned band_count = (bmp.height() + rows_per_band - 1) / rows_per_band;
+
+  std::vector<BandTy> bands(band_count);
+  std::atomic<unsigned> next_band(0);
+  pool.run([&](unsigned, ThreadContext &) {
+    for (unsigned band; (band = next_band++) < band_count;) {
+      unsigned first_row = band * rows_per_band;
+      encode_band(first_row,
+                  std::min(first_row + rows_per_band, bmp.height()),
+                  bands[band]);
+    }
+  });
+  return bands;
+}
+
+void write_be(std::ostream &out, uint32_t val) {
+  uint8_t encoded[4];
+  Bitops::encode_be(val, encoded);
+  out.write((char *)encoded, 4);
+}
+
+/// Write a PNG chunk of type \p type, whose data is \p data, except for the
+/// CRC, which is \p crc.
+void write_png_chunk(std::ostream &out, const char *type, const uint8_t *data,
+                     uint32_t size, uint32_t crc) {
+  write_be(out, size);
+  out.write(type, 4);
+  out.write((const char *)data, size);
+  write_be(out, crc);
+}
+
+void write_png_chunk(std::ostream &out, const char *type, const uint8_t *data,
+                     uint32_t size) {
+  uint32_t crc = crc32_update(0, (const uint8_t *)type, 4);
+  write_png_chunk(out, type, data, size, crc32_update(crc, data, size));
+}
+
+/// Filter the \p size bytes of \p row, whose predecessor is \p prior, into
+/// \p out, predicting each byte with \p predict(left, up, up_left).  Returns
+/// the sum of the absolute values of the filtered bytes.
+template <typename PredictorTy>
+uint64_t apply_png_filter(const uint8_t *row, const uint8_t *prior,
+                          unsigned size, uint8_t *out, PredictorTy predict) {
+  const unsigned bpp = 3;
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < size; i++) {
+    int a = i >= bpp ? row[i - bpp] : 0, c = i >= bpp ? prior[i - bpp] : 0;
+    out[i] = row[i] - predict(a, prior[i], c);
+    sum += std::abs(int8_t(out[i]));
+  }
+  return sum;
+}
+
+/// Filter the row \p row, whose predecessor is \p prior, into \p out, which
+/// gets the filter type followed by the filtered bytes.  Each row gets the
+/// filter with the smallest sum of absolute differences, as libpng does.
+void filter_png_row(const uint8_t *row, const uint8_t *prior, unsigned size,
+                    uint8_t *out, std::vector<uint8_t> &scratch) {
+  scratch.resize(5 * size);
+  uint64_t sums[5];
+  sums[0] = apply_png_filter(row, prior, size, &scratch[0],
+                             [](int, int, int) { return 0; });
+  sums[1] = apply_png_filter(row, prior, size, &scratch[size],
+                             [](int a, int, int) { return a; });
+  sums[2] = apply_png_filter(row, prior, size, &scratch[2 * size],
+                             [](int, int b, int) { return b; });
+  sums[3] = apply_png_filter(row, prior, size, &scratch[3 * size],
+                             [](int a, int b, int) { return (a + b) / 2; });
+  sums[4] = apply_png_filter(
+      row, prior, size, &scratch[4 * size], [](int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+      });
+
+  unsigned best_filter = std::min_element(sums, sums + 5) - sums;
+  out[0] = best_filter;
+  memcpy(out + 1, &scratch[best_filter * size], size);
+}
+
+/// The output of a band of a PNG file: a compressed part of the zlib stream
+/// of the image data, and the checksums of its contents.
+struct PngBand {
+  std::vector<uint8_t> idat;
+  uint32_t idat_crc = 0;
+  uint32_t adler = 1;
+  uint64_t filtered_size = 0;
+};
+
+/// Writes a PNG file, a band of rows at a time.  The image data is one zlib
+/// stream, spread over an IDAT chunk per band of about a megabyte.
+class PngWriter : public ImageSink {
+  std::ostream &_out;
+  ThreadPool &_pool;
+  bool _compress;
+
+  unsigned _row_size = 0;
+  unsigned _row_count = 0;
+
+  /// The last row written, which the filters of the next row refer to, and
+  /// the checksum of the zlib stream so far.
+  std::vector<uint8_t> _prior;
+  uint32_t _adler = 1;
+
+public:
+  PngWriter(std::ostream &out, ThreadPool &pool, bool compress)
+      : _out(out), _pool(pool), _compress(compress) {}
+
+  bool begin(unsigned width, unsigned height) override {
+    const uint8_t signature[8] = {0x89, 'P',  'N',  'G',
+                                  '\r', '\n', 0x1a, '\n'};
+    _out.write((const char *)signature, 8);
+
+    uint8_t ihdr[13];
+    Bitops::encode_be(width, ihdr);
+    Bitops::encode_be(height, ihdr + 4);
+    ihdr[8] = 8;  // bits per channel
+    ihdr[9] = 2;  // RGB
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlacing
+    write_png_chunk(_out, "IHDR", ihdr, 13);
+
+    const uint8_t zlib_header[2] = {0x78, 0x01};
+    write_png_chunk(_out, "IDAT", zlib_header, 2);
+
+    _row_size = width * 3;
+    _prior.assign(_row_size, 0);
+    return _out.good();
+  }
+
+  bool write_rows(const Bitmap &bmp, unsigned image_row) override {
+    assert(image_row == _row_count && "Rows out of order!");
+    auto bands = encode_bands<PngBand>(
+        bmp, _row_size + 1, _pool,
+        [&](unsigned first_row, unsigned end_row, PngBand &band) {
+          std::vector<uint8_t> filtered((end_row - first_row) *
+                                        uint64_t(_row_size + 1));
+          std::vector<uint8_t> row(_row_size), prior(_row_size), scratch;
+          if (first_row != 0)
+            get_row(bmp, first_row - 1, prior.data());
+          else
+            prior = _prior;
+          for (unsigned y = first_row; y < end_row; y++) {
+            get_row(bmp, y, row.data());
+            filter_png_row(
+                row.data(), prior.data(), _row_size,
+                &filtered[(y - first_row) * uint64_t(_row_size + 1)],
+                scratch);
+            std::swap(row, prior);
+          }
+
+          if (_compress)
+            deflate_fixed(filtered.data(), filtered.size(), band.idat);
+          else
+            deflate_stored(filtered.data(), filtered.size(), band.idat);
+          uint32_t crc = crc32_update(0, (const uint8_t *)"IDAT", 4);
+          band.idat_crc =
+              crc32_update(crc, band.idat.data(), band.idat.size());
+          band.adler = adler32(filtered.data(), filtered.size());
+          band.filtered_size = filtered.size();
+        });
+
+    for (auto &band : bands) {
+      write_png_chunk(_out, "IDAT", band.idat.data(), band.idat.size(),
+                      band.idat_crc);
+      _adler = adler32_combine(_adler, band.adler, band.filtered_size);
+      std::vector<uint8_t>().swap(band.idat);
+    }
+    if (bmp.height() != 0)
+      get_row(bmp, bmp.height() - 1, _prior.data());
+    _row_count += bmp.height();
+    return _out.good();
+  }
+
+  bool end() override {
+    // A final, empty block with fixed codes, and the checksum of the stream.
+    uint8_t zlib_trailer[6] = {0x03, 0x00};
+    Bitops::encode_be(_adler, zlib_trailer + 2);
+    write_png_chunk(_out, "IDAT", zlib_trailer, 6);
+    write_png_chunk(_out, "IEND", nullptr, 0);
+    return _out.good();
+  }
+};
+
+struct QoiPixel {
+  uint8_t r = 0, g = 0, b = 0;
+  bool operator==(const QoiPixel &other) const {
+    return r == other.r && g == other.g && b == other.b;
+  }
+};
+
+/// Encode rows [\p first_row, \p end_row) of \p bmp as QOI chunks.
+///
+/// The band doesn't know the state the decoder is in when it gets to the
+/// band's first pixel, so that pixel is always written in full, and the band
+/// only refers to entries of the decoder's index that it wrote itself.  Any
+/// band can then follow any other.
+void encode_qoi_band(const Bitmap &bmp, unsigned first_row, unsigned end_row,
+                     std::vector<uint8_t> &out) {
+  QoiPixel index[64];
+  uint64_t valid_entries = 0;
+  QoiPixel prev;
+  bool has_prev = false;
+  unsigned run = 0;
+
+  std::vector<uint8_t> row(bmp.width() * 3);
+  out.reserve((end_row - first_row) * uint64_t(bmp.width()));
+  for (unsigned y = first_row; y < end_row; y++) {
+    get_row(bmp, y, row.data());
+    for (unsigned x = 0; x < bmp.width(); x++) {
+      QoiPixel p;
+      p.r = row[3 * x];
+      p.g = row[3 * x + 1];
+      p.b = row[3 * x + 2];
+
+      if (has_prev && p == prev) {
+        if (++run == 62) {
+          out.push_back(0xc0 | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+      if (run != 0) {
+        out.push_back(0xc0 | (run - 1));
+        run = 0;
+      }
+
+      // Alpha is always 255.
+      unsigned h = (p.r * 3 + p.g * 5 + p.b * 7 + 255 * 11) % 64;
+      if ((valid_entries >> h & 1) && index[h] == p) {
+        out.push_back(h);
+      } else {
+        index[h] = p;
+        valid_entries |= uint64_t(1) << h;
+        int dr = int8_t(p.r - prev.r), dg = int8_t(p.g - prev.g);
+        int db = int8_t(p.b - prev.b);
+        int dr_dg = dr - dg, db_dg = db - dg;
+        if (has_prev && dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+            db >= -2 && db <= 1) {
+          out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        } else if (has_prev && dg >= -32 && dg <= 31 && dr_dg >= -8 &&
+                   dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+          out.push_back(0x80 | (dg + 32));
+          out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+        } else {
+          const uint8_t rgb[4] = {0xfe, p.r, p.g, p.b};
+          out.insert(out.end(), rgb, rgb + 4);
+        }
+      }
+      prev = p;
+      has_prev = true;
+    }
+  }
+  if (run != 0)
+    out.push_back(0xc0 | (run - 1));
+}
+
+/// Writes a QOI file, a band of rows at a time.
+class QoiWriter : public ImageSink {
+  std::ostream &_out;
+  ThreadPool &_pool;
+
+public:
+  QoiWriter(std::ostream &out, ThreadPool &pool) : _out(out), _pool(pool) {}
+
+  bool begin(unsigned width, unsigned height) override {
+    uint8_t header[14] = {'q', 'o', 'i', 'f'};
+    Bitops::encode_be(width, header + 4);
+    Bitops::encode_be(height, header + 8);
+    header[12] = 3; // RGB
+    header[13] = 0; // sRGB
+    _out.write((const char *)header, 14);
+    return _out.good();
+  }
+
+  bool write_rows(const Bitmap &bmp, unsigned) override {
+    auto bands = encode_bands<std::vector<uint8_t>>(
+        bmp, bmp.width(), _pool,
+        [&](unsigned first_row, unsigned end_row, std::vector<uint8_t> &band) {
+          encode_qoi_band(bmp, first_row, end_row, band);
+        });
+    for (auto &output : bands) {
+      _out.write((const char *)output.data(), output.size());
+      std::vector<uint8_t>().swap(output);
+    }
+    return _out.good();
+  }
+
+  bool end() override {
+    const uint8_t end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    _out.write((const char *)end_marker, 8);
+    return _out.good();
+  }
+};
+
+/// Writes a BMP file, a band of rows at a time.  Unlike \c Bitmap::write,
+/// this has to write the rows from the top down.
+class BmpWriter : public ImageSink {
+  std::ostream &_out;
+
+public:
+  explicit BmpWriter(std::ostream &out) : _out(out) {}
+
+  bool begin(unsigned width, unsigned height) override {
+    Bitmap::write_top_down_header(_out, width, height);
+    return _out.good();
+  }
+
+  bool write_rows(const Bitmap &bmp, unsigned) override {
+    // Rows are padded to a multiple of 4 bytes, and go from right to left as
+    // in Bitmap::write.
+    uint64_t row_size = (uint64_t(bmp.width()) * 3 + 3) & ~uint64_t(3);
+    std::vector<uint8_t> chunk(row_size * bmp.height());
+    uint8_t *p = chunk.data();
+    for (unsigned y = 0; y < bmp.height(); y++, p += row_size) {
+      uint8_t *q = p;
+      for (unsigned x = bmp.width(); x != 0; --x) {
+        const Color &c = bmp.at(x - 1, y);
+        *q++ = c.blue();
+        *q++ = c.green();
+        *q++ = c.red();
+      }
+    }
+    _out.write((const char *)chunk.data(), chunk.size());
+    return _out.good();
+  }
+
+  bool end() override { return _out.good(); }
+};
+}
+
+const char *ray::image_format_extension(ImageFormatTy format) {
+  switch (format) {
+  case ImageFormatTy::bmp:
+    return "bmp";
+  case ImageFormatTy::png_stored:
+  case ImageFormatTy::png:
+    return "png";
+  case ImageFormatTy::qoi:
+    return "qoi";
+  }
+  unreachable("Unknown image format!");
+}
+
+std::unique_ptr<ImageSink> ray::create_image_writer(ImageFormatTy format,
+                                                    std::ostream &out,
+                                                    ThreadPool &pool) {
+  switch (format) {
+  case ImageFormatTy::bmp:
+    return make_unique<BmpWriter>(out);
+  case ImageFormatTy::png_stored:
+    return make_unique<PngWriter>(out, pool, false);
+  case ImageFormatTy::png:
+    return make_unique<PngWriter>(out, pool, true);
+  case ImageFormatTy::qoi:
+    return make_unique<QoiWriter>(out, pool);
+  }
+  unreachable("Unknown image format!");
+}
+
+bool ray::write_image(const Bitmap &bmp, ImageFormatTy format,
+                      std::ostream &out, ThreadPool &pool) {
+  if (format == ImageFormatTy::bmp) {
+    bmp.write(out);
+    return out.good();
+  }
+
+  std::unique_ptr<ImageSink> writer = create_image_writer(format, out, pool);
+  return writer->begin(bmp.width(), bmp.height()) &&
+         writer->write_rows(bmp, 0) && writer->end();
+}
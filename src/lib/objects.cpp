@@ -6,27 +6,29 @@
 
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 using namespace ray;
 
 BoxObj::BoxObj(const Scene &s, const Vector &center, const Vector &normal_a,
-               const Vector &normal_b, double side)
+               const Vector &normal_b, Ruler::Real side)
     : Object(s,
              generate_description_string("BoxObj", "center", center, "normal-a",
-                                         normal_a, "normal-b", normal_b)),
+                                         normal_a, "normal-b", normal_b),
+             ObjectKindTy::box),
       _cube(center, normal_a, normal_b, side) {
-  _colors[0] = Color(61, 31, 0);
-  _colors[1] = Color(102, 0, 60);
-  _colors[2] = Color(0, 102, 153);
+  _colors[0] = HdrColor(Color(61, 31, 0));
+  _colors[1] = HdrColor(Color(102, 0, 60));
+  _colors[2] = HdrColor(Color(0, 102, 153));
 
-  _colors[3] = Color(0, 0, 153);
-  _colors[4] = Color(51, 153, 50);
-  _colors[5] = Color(71, 0, 71);
+  _colors[3] = HdrColor(Color(0, 0, 153));
+  _colors[4] = HdrColor(Color(51, 153, 50));
+  _colors[5] = HdrColor(Color(71, 0, 71));
 }
 
 bool BoxObj::incident(ThreadContext &ctx, const Ray &incoming,
-                      double current_best_k, double &out_k,
-                      Color &out_c) const {
+                      Ruler::Real current_best_k, Ruler::Real &out_k,
+                      HdrColor &out_c) const {
   unsigned idx;
   if (_cube.intersect(incoming, out_k, idx)) {
     out_c = _colors[idx];
@@ -36,27 +38,46 @@ bool BoxObj::incident(ThreadContext &ctx, const Ray &incoming,
   return false;
 }
 
-bool SkyObj::incident(ThreadContext &, const Ray &incoming,
-                      double current_best_k, double &out_k,
-                      Color &out_c) const {
-  if (current_best_k < std::numeric_limits<double>::max())
+bool BoxObj::occludes(ThreadContext &, const Ray &r, Ruler::Real max_k) const {
+  Ruler::Real k;
+  unsigned idx;
+  return _cube.intersect(r, k, idx) && k < max_k && k >= 0.0;
+}
+
+bool BoxObj::bounds(AxisAlignedBox &out_bounds) const {
+  out_bounds = _cube.bounds();
+  return true;
+}
+
+bool SkyObj::incident(ThreadContext &ctx, const Ray &incoming,
+                      Ruler::Real current_best_k, Ruler::Real &out_k,
+                      HdrColor &out_c) const {
+  // The scene only ever uses us through shade_miss.  This exists for clients
+  // that want to use the sky as an ordinary object, in which case it behaves
+  // as if it were behind everything else.
+  if (current_best_k < std::numeric_limits<Ruler::Real>::max())
     return false;
 
-  if (_uniform)
-    out_c = Color::create_white();
-  else {
-    double grad = incoming.direction().horizontal_gradient();
-    double angle_ratio = std::fabs(std::atan(grad * 1.8) / (M_PI / 2));
-    out_k = std::numeric_limits<double>::max();
-    out_c = Color(uint8_t(255 * angle_ratio), uint8_t(255 * angle_ratio), 255);
+  out_k = std::numeric_limits<Ruler::Real>::max();
+  shade_miss(ctx, incoming, out_c);
+  return true;
+}
+
+void SkyObj::shade_miss(ThreadContext &, const Ray &incoming,
+                        HdrColor &out_c) const {
+  if (_uniform) {
+    out_c = HdrColor::create_white();
+    return;
   }
 
-  return true;
+  Ruler::Real grad = incoming.direction().horizontal_gradient();
+  Ruler::Real angle_ratio = std::fabs(std::atan(grad * 1.8) / (M_PI / 2));
+  out_c = HdrColor(angle_ratio, angle_ratio, 1.0f);
 }
 
 bool InfinitePlane::incident(ThreadContext &, const Ray &incoming,
-                             double current_best_k, double &out_k,
-                             Color &out_c) const {
+                             Ruler::Real current_best_k, Ruler::Real &out_k,
+                             HdrColor &out_c) const {
   if (!_plane.intersect(incoming, out_k) || out_k > current_best_k)
     return false;
 
@@ -65,15 +86,21 @@ bool InfinitePlane::incident(ThreadContext &, const Ray &incoming,
   int comp_1 = int((pt * _axis_1) / _check_size);
 
   if (((comp_0 % 2) ^ (comp_1 % 2)))
-    out_c = Color::create_white();
+    out_c = HdrColor::create_white();
   else
-    out_c = Color::create_black();
+    out_c = HdrColor::create_black();
   return true;
 }
 
+bool InfinitePlane::occludes(ThreadContext &, const Ray &r,
+                             Ruler::Real max_k) const {
+  Ruler::Real k;
+  return _plane.intersect(r, k) && k < max_k && k >= 0.0;
+}
+
 bool SphericalMirrorObj::incident(ThreadContext &ctx, const Ray &incoming,
-                                  double current_best_k, double &out_k,
-                                  Color &out_c) const {
+                                  Ruler::Real current_best_k,
+                                  Ruler::Real &out_k, HdrColor &out_c) const {
   intptr_t &nesting = ctx.get(object_id());
   if (nesting >= SphericalMirrorObj::max_nesting())
     return false;
@@ -92,19 +119,31 @@ bool SphericalMirrorObj::incident(ThreadContext &ctx, const Ray &incoming,
   return false;
 }
 
+bool SphericalMirrorObj::occludes(ThreadContext &, const Ray &r,
+                                  Ruler::Real max_k) const {
+  Ruler::Real k;
+  return _sphere.intersect(r, k) && k < max_k && k >= 0.0;
+}
+
+bool SphericalMirrorObj::bounds(AxisAlignedBox &out_bounds) const {
+  out_bounds = _sphere.bounds();
+  return true;
+}
+
 RefractiveBoxObj::RefractiveBoxObj(const Scene &s, const Vector &center,
                                    const Vector &normal_a,
-                                   const Vector &normal_b, double side,
-                                   double ref_index)
+                                   const Vector &normal_b, Ruler::Real side,
+                                   Ruler::Real ref_index)
     : Object(s, generate_description_string(
                     "RefractiveBoxObj", "center", center, "normal-a", normal_a,
-                    "normal-b", normal_b, "side", side)),
+                    "normal-b", normal_b, "side", side),
+                ObjectKindTy::refractive_box),
       _cube(center, normal_a, normal_b, side),
       _relative_refractive_index(ref_index) {}
 
 bool RefractiveBoxObj::incident(ThreadContext &ctx, const Ray &incoming,
-                                double current_best_k, double &out_k,
-                                Color &out_c) const {
+                                Ruler::Real current_best_k, Ruler::Real &out_k,
+                                HdrColor &out_c) const {
   intptr_t &nesting = ctx.get(object_id());
   if (nesting >= RefractiveBoxObj::max_nesting())
     return false;
@@ -114,19 +153,19 @@ bool RefractiveBoxObj::incident(ThreadContext &ctx, const Ray &incoming,
     return false;
 
   auto r_i = incoming;
-  double k = out_k;
-  const double ratio0 = 1.0 / _relative_refractive_index;
-  const double ratio1 = _relative_refractive_index;
+  Ruler::Real k = out_k;
+  const Ruler::Real ratio0 = 1.0 / _relative_refractive_index;
+  const Ruler::Real ratio1 = _relative_refractive_index;
 
   bool is_tir;
-  r_i = get_refracted_ray(r_i, r_i.at(k), _cube.faces()[incident_idx].normal(), ratio0,
+  r_i = get_refracted_ray(r_i, r_i.at(k), _cube.normal(incident_idx), ratio0,
                           is_tir);
 
   for (int i = 0; i < 30; i++) {
     if (!_cube.intersect(r_i, k, incident_idx))
       return false;
 
-    const Vector normal = -_cube.faces()[incident_idx].normal();
+    const Vector normal = -_cube.normal(incident_idx);
     r_i = get_refracted_ray(r_i, r_i.at(k), normal, ratio1, is_tir);
     if (!is_tir)
       break;
@@ -140,3 +179,15 @@ bool RefractiveBoxObj::incident(ThreadContext &ctx, const Ray &incoming,
   nesting--;
   return true;
 }
+
+bool RefractiveBoxObj::occludes(ThreadContext &, const Ray &r,
+                                Ruler::Real max_k) const {
+  Ruler::Real k;
+  unsigned idx;
+  return _cube.intersect(r, k, idx) && k < max_k && k >= 0.0;
+}
+
+bool RefractiveBoxObj::bounds(AxisAlignedBox &out_bounds) const {
+  out_bounds = _cube.bounds();
+  return true;
+}
@@ -3,10 +3,12 @@
 #include "scene.hpp"
 #include "scene-generators.hpp"
 
+#include <cstring>
+
 using namespace ray;
 using namespace std;
 
-static Camera generate_basic_scene(Scene &s) {
+static Camera generate_basic_scene(Scene &s, double time) {
   Vector init_normal_a =
       Vector::get_i() +
       (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
@@ -15,7 +17,8 @@ static Camera generate_basic_scene(Scene &s) {
       Vector::get_i() -
       (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
 
-  init_normal_a = init_normal_a.rotate(0.1, init_normal_b);
+  // The boxes spin as time passes.
+  init_normal_a = init_normal_a.rotate(0.1 + 0.5 * time, init_normal_b);
   init_normal_b = init_normal_b.rotate(0.1, init_normal_a);
 
   for (int i = 0; i < 8; i++) {
@@ -33,7 +36,7 @@ static Camera generate_basic_scene(Scene &s) {
   return Camera(6.0, 2000, 2000, 150, ray::Vector::get_origin());
 }
 
-static Camera generate_sphere_scene(Scene &s) {
+static Camera generate_sphere_scene(Scene &s, double time) {
   Vector init_normal_a =
       Vector::get_i() +
       (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
@@ -42,7 +45,8 @@ static Camera generate_sphere_scene(Scene &s) {
       Vector::get_i() -
       (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
 
-  init_normal_a = init_normal_a.rotate(0.1, init_normal_b);
+  // The boxes spin as time passes.
+  init_normal_a = init_normal_a.rotate(0.1 + 0.5 * time, init_normal_b);
   init_normal_b = init_normal_b.rotate(0.1, init_normal_a);
 
   for (int i = 0; i < 8; i++) {
@@ -64,7 +68,9 @@ static Camera generate_sphere_scene(Scene &s) {
   auto sphere_pos_b =
       Vector::get_i() * 4500 - Vector::get_j() * 2000 - Vector::get_k() * 2000;
 
-  auto sphere_pos_c = Vector::get_i() * 3500;
+  // The middle sphere bobs up and down.
+  auto sphere_pos_c =
+      Vector::get_i() * 3500 + Vector::get_k() * 800 * std::sin(time);
 
   s.add_object(make_unique<SphericalMirrorObj>(s, sphere_pos_a, 600));
   s.add_object(make_unique<SphericalMirrorObj>(s, sphere_pos_b, 600));
@@ -73,21 +79,22 @@ static Camera generate_sphere_scene(Scene &s) {
   return Camera(6.0, 5000, 2500, 200, ray::Vector::get_origin());
 }
 
-static Camera generate_refraction_scene_0(Scene &s) {
+static Camera generate_refraction_scene_0(Scene &s, double time) {
   Plane plane(-Vector::get_k(), Vector::get_k() * 3500);
   s.add_object(make_unique<InfinitePlane>(s, plane, Vector::get_i(), 500));
   s.add_object(make_unique<SkyObj>(s));
 
+  // The refractive box turns about the vertical axis.
   auto refractive_pos_a = (2 * Vector::get_j() + Vector::get_i()) * 1500;
-  Vector init_normal_a = Vector::get_i();
-  Vector init_normal_b = Vector::get_j();
+  Vector init_normal_a = Vector::get_i().rotate(0.3 * time, Vector::get_k());
+  Vector init_normal_b = Vector::get_j().rotate(0.3 * time, Vector::get_k());
   s.add_object(make_unique<RefractiveBoxObj>(s, refractive_pos_a, init_normal_a,
                                              init_normal_b, 1000.0, 1.0));
 
   return Camera(6.0, 5000, 2500, 20, ray::Vector::get_origin());
 }
 
-static Camera generate_refraction_scene_1(Scene &s) {
+static Camera generate_refraction_scene_1(Scene &s, double time) {
   {
     Plane plane(-Vector::get_i(), Vector::get_i() * 3500);
     Vector check_direction = (Vector::get_j() + Vector::get_k()).normalize();
@@ -126,20 +133,56 @@ static Camera generate_refraction_scene_1(Scene &s) {
 
   s.add_object(make_unique<SkyObj>(s));
 
+  // The refractive box turns about the vertical axis.
   auto refractive_pos_a = (2 * Vector::get_j() + Vector::get_i()) * 1500;
-  Vector init_normal_a = Vector::get_i();
-  Vector init_normal_b = Vector::get_j();
+  Vector init_normal_a = Vector::get_i().rotate(0.3 * time, Vector::get_k());
+  Vector init_normal_b = Vector::get_j().rotate(0.3 * time, Vector::get_k());
   s.add_object(make_unique<RefractiveBoxObj>(s, refractive_pos_a, init_normal_a,
                                              init_normal_b, 800.0, 1.0));
 
   return Camera(6.0, 5000, 2500, 20, ray::Vector::get_origin());
 }
 
+/// A large field of small boxes, mostly useful for benchmarking the bounding
+/// volume hierarchy.
+static Camera generate_box_field_scene(Scene &s, double time) {
+  Vector init_normal_a =
+      Vector::get_i() +
+      (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
+
+  Vector init_normal_b =
+      Vector::get_i() -
+      (1.0 / std::sqrt(2)) * (Vector::get_k() + Vector::get_j());
+
+  const int grid_size = 96;
+  for (int row = 0; row < grid_size; row++)
+    for (int col = 0; col < grid_size; col++) {
+      int idx = row * grid_size + col;
+      Vector position =
+          Vector::get_i() * (3500 + 60 * ((row * 7 + col * 13) % 17)) +
+          Vector::get_j() * 80 * (col - grid_size / 2) +
+          Vector::get_k() * 80 * (row - grid_size / 2);
+
+      // Rotate the initial normals afresh for every box so that rounding
+      // errors don't accumulate across thousands of boxes.  The boxes spin as
+      // time passes.
+      Vector normal_a = init_normal_a.rotate(0.3 * idx + time, init_normal_b);
+      Vector normal_b = init_normal_b.rotate(1.3 * idx, normal_a);
+      s.add_object(
+          make_unique<BoxObj>(s, position, normal_a, normal_b, 25.0));
+    }
+
+  s.add_object(make_unique<SkyObj>(s));
+
+  return Camera(6.0, 2000, 2000, 150, ray::Vector::get_origin());
+}
+
 void ray::for_each_scene_generator(SceneGenCallbackTy callback) {
   callback("basic", generate_basic_scene);
   callback("sphere", generate_sphere_scene);
   callback("refraction-0", generate_refraction_scene_0);
   callback("refraction-1", generate_refraction_scene_1);
+  callback("box-field", generate_box_field_scene);
 }
 
 SceneGeneratorTy ray::get_scene_generator_by_name(const char *name) {
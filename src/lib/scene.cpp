@@ -1,155 +1,1071 @@
 #include "scene.hpp"
 
+#include "bitops.hpp"
+#include "objects.hpp"
+#include "thread-pool.hpp"
+#include "work-stealing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <limits>
+#include <mutex>
 #include <thread>
+#include <type_traits>
 
 using namespace ray;
 
-template <typename RenderFnTy> struct ThreadTask {
-public:
-  class Point {
-    int _x;
-    int _y;
+namespace {
+/// The side of the square tiles Camera::snap cuts the image into.  Tiles are
+/// small enough that each thread gets many, so a thread that runs out of work
+/// has something left to steal, and large enough that the per tile overhead
+/// doesn't matter.  This is a multiple of the packet block sizes.
+const int kTileSize = 32;
 
-  public:
-    explicit Point(int x, int y) : _x(x), _y(y) {}
+/// The spacing of the samples in the first pass of a progressive render.
+/// This has to divide kTileSize so that every tile has the same grid of
+/// samples.
+const int kPreviewSpacing = 8;
+static_assert(kTileSize % kPreviewSpacing == 0, "Misaligned preview grid!");
 
-    int x() const { return _x; }
-    int y() const { return _y; }
-  };
+/// A rectangle of pixels, in screen coordinates.
+struct Tile {
+  int x = 0, y = 0;
+  int width = 0, height = 0;
+};
 
-  explicit ThreadTask(Point top_left, Point bottom_right, RenderFnTy &render_fn,
-                      Scene &s, bool enable_logging)
-      : _top_left(top_left), _bottom_right(bottom_right), _render_fn(render_fn),
-        _ctx(s.object_count(), enable_logging) {
-    _result.reset(new Color[(bottom_right.x() - top_left.x()) *
-                            (bottom_right.y() - top_left.y())]);
-    s.init_object_ids(_ctx);
-  }
+/// A point on the screen that a primary ray goes through, in pixels.  Pixel
+/// (x, y) is sampled at (x, y) unless it is supersampled.
+struct Sample {
+  Ruler::Real x = 0, y = 0;
+};
 
-  void do_threaded_work() {
-    auto &render_fn = _render_fn;
-    for (int xi = _top_left.x(), xe = _bottom_right.x(); xi != xe; ++xi)
-      for (int yi = _top_left.y(), ye = _bottom_right.y(); yi != ye; ++yi)
-        at(xi, yi) = render_fn(xi, yi, _ctx);
-  }
+typedef std::chrono::steady_clock::time_point TimePointTy;
+
+/// Store the shaded color \p c in pixel \p out of the image being rendered:
+/// as it is in an HdrBitmap, and tone mapped in a Bitmap.
+void store(HdrColor &out, const HdrColor &c) { out = c; }
+void store(Color &out, const HdrColor &c) { out = c.to_color(); }
+
+/// Return pixel \p p of the image being rendered, tone mapped.
+Color tone_mapped(const HdrColor &p) { return p.to_color(); }
+Color tone_mapped(const Color &p) { return p; }
+}
+
+/// One thread's share of a pass over the tiles of the image.
+template <typename TileFnTy> struct ThreadTask {
+public:
+  /// Call \p tile_fn(tile, ctx) for the tiles of this task, except that no
+  /// tiles are started after \p deadline, or once \p is_cancelled (if set)
+  /// is.
+  explicit ThreadTask(TileFnTy &tile_fn, TimePointTy deadline,
+                      const std::atomic<bool> *is_cancelled)
+      : _tile_fn(tile_fn), _deadline(deadline), _is_cancelled(is_cancelled) {}
+
+  WorkStealingDeque<Tile> &tiles() { return _tiles; }
 
-  ThreadContext &context() { return _ctx; }
+  /// Process the tiles in this task's queue, and then tiles stolen from the
+  /// queues of the other tasks in \p tasks (this task is \p tasks[self_idx])
+  /// until every queue is empty, the deadline passes or the pass is
+  /// cancelled.  \p ctx is the context of the calling thread.
+  void do_threaded_work(std::vector<std::unique_ptr<ThreadTask>> &tasks,
+                        unsigned self_idx, ThreadContext &ctx) {
+    Tile tile;
+    for (;;) {
+      if (_deadline != TimePointTy::max() &&
+          std::chrono::steady_clock::now() >= _deadline)
+        return;
+      if (_is_cancelled && *_is_cancelled)
+        return;
 
-  template <typename DrainFnTy> void drain_work(const DrainFnTy &drain_fn) {
-    for (int xi = _top_left.x(), xe = _bottom_right.x(); xi != xe; ++xi)
-      for (int yi = _top_left.y(), ye = _bottom_right.y(); yi != ye; ++yi)
-        drain_fn(xi, yi, at(xi, yi));
+      if (_tiles.pop(tile)) {
+        process(tile, ctx);
+        continue;
+      }
+
+      // Tiles are only added before the threads start, so once every queue
+      // has been seen empty there is nothing left to do.
+      bool stole = false;
+      for (unsigned i = 1, e = tasks.size(); i < e && !stole; i++)
+        stole = tasks[(self_idx + i) % e]->_tiles.steal(tile);
+      if (!stole)
+        return;
+
+      _stolen_count++;
+      process(tile, ctx);
+    }
   }
 
+  double busy_seconds() const { return _busy_seconds; }
+  unsigned tile_count() const { return _tile_count; }
+  unsigned stolen_count() const { return _stolen_count; }
+
 private:
-  Point _top_left;
-  Point _bottom_right;
-  RenderFnTy &_render_fn;
-  ThreadContext _ctx;
-  std::unique_ptr<Color[]> _result;
+  TileFnTy &_tile_fn;
+  TimePointTy _deadline;
+  const std::atomic<bool> *_is_cancelled;
+  WorkStealingDeque<Tile> _tiles;
 
-  Color &at(int x, int y) {
-    int x_offset = x - _top_left.x();
-    int y_offset = y - _top_left.y();
-    int y_size = _bottom_right.y() - _top_left.y();
+  double _busy_seconds = 0.0;
+  unsigned _tile_count = 0;
+  unsigned _stolen_count = 0;
 
-    return _result[x_offset * y_size + y_offset];
+  void process(const Tile &t, ThreadContext &ctx) {
+    auto start = std::chrono::steady_clock::now();
+    _tile_fn(t, ctx);
+    _tile_count++;
+    _busy_seconds += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
   }
 };
 
+/// Call \p tile_fn on each of \p tiles using the threads of \p pool, with no
+/// tiles started after \p deadline or once \p is_cancelled (if set) is, and
+/// add the work done to \p stats.  Return true if every tile was processed.
+template <typename TileFnTy>
+static bool run_pass(ThreadPool &pool, const std::vector<Tile> &tiles,
+                     TileFnTy &tile_fn, TimePointTy deadline,
+                     const std::atomic<bool> *is_cancelled,
+                     RenderStats &stats) {
+  typedef ThreadTask<TileFnTy> TaskTy;
+  unsigned thread_count = pool.thread_count();
+
+  std::vector<std::unique_ptr<TaskTy>> subtasks;
+  for (unsigned i = 0; i < thread_count; i++)
+    subtasks.push_back(make_unique<TaskTy>(tile_fn, deadline, is_cancelled));
+
+  // Give each thread a contiguous range of tiles, so that neighboring tiles
+  // (which touch much of the same geometry) tend to be processed by the same
+  // thread.
+  for (unsigned i = 0, e = tiles.size(); i != e; ++i)
+    subtasks[uint64_t(i) * thread_count / e]->tiles().push(tiles[i]);
+
+  pool.run([&subtasks](unsigned worker_idx, ThreadContext &ctx) {
+    subtasks[worker_idx]->do_threaded_work(subtasks, worker_idx, ctx);
+  });
+
+  unsigned processed_count = 0;
+  for (unsigned i = 0; i < thread_count; i++) {
+    stats.busy_seconds[i] += subtasks[i]->busy_seconds();
+    stats.tile_counts[i] += subtasks[i]->tile_count();
+    stats.stolen_counts[i] += subtasks[i]->stolen_count();
+    processed_count += subtasks[i]->tile_count();
+  }
+  return processed_count == tiles.size();
+}
+
+/// Return the cells of a \p columns x \p rows grid, as (column, row) pairs,
+/// in the order \p order visits them.
+static std::vector<std::pair<int, int>> grid_order(int columns, int rows,
+                                                   TileOrderTy order) {
+  std::vector<std::pair<int, int>> cells;
+  for (int x = 0; x < columns; x++)
+    for (int y = 0; y < rows; y++)
+      cells.emplace_back(x, y);
+  if (order == TileOrderTy::column_major)
+    return cells;
+
+  // The curves cover square grids with power of two sides, so cover the grid
+  // with the smallest such square, and leave out the cells outside the grid.
+  unsigned curve_order = 0;
+  while ((1 << curve_order) < std::max(columns, rows))
+    curve_order++;
+  auto key = [&](const std::pair<int, int> &c) {
+    return order == TileOrderTy::morton
+               ? Bitops::morton_key(c.first, c.second)
+               : Bitops::hilbert_key(curve_order, c.first, c.second);
+  };
+  std::sort(cells.begin(), cells.end(),
+            [&](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+              return key(a) < key(b);
+            });
+  return cells;
+}
+
 Camera::Camera(Ruler::Real focal_length, unsigned screen_width_px,
                unsigned screen_height_px, unsigned screen_resolution,
                const Vector &pos)
     : _focal_length(focal_length), _screen_width_px(screen_width_px),
       _screen_height_px(screen_height_px),
-      _screen_resolution(screen_resolution), _focus_position(pos) {}
+      _screen_resolution(screen_resolution), _focus_position(pos),
+      _crop_width(screen_width_px), _crop_height(screen_height_px) {}
+
+/// Call \p fn with a pool of \p thread_count threads that is kept for the
+/// life of the process, and only replaced when the thread count changes.
+/// Calls are serialized, since they would compete for the same threads.
+static void
+with_shared_pool(unsigned thread_count,
+                 const std::function<void(ThreadPool &)> &fn) {
+  static std::mutex shared_pool_lock;
+  static std::unique_ptr<ThreadPool> shared_pool;
+
+  std::lock_guard<std::mutex> guard(shared_pool_lock);
+  if (!shared_pool || shared_pool->thread_count() != thread_count)
+    shared_pool = make_unique<ThreadPool>(thread_count);
+  fn(*shared_pool);
+}
 
 Bitmap Camera::snap(Scene &scene, unsigned thread_count,
                     std::vector<std::string> *logs) {
-  Bitmap bmp(_screen_height_px, _screen_width_px, Color::create_blue());
+  Bitmap bmp(_crop_height, _crop_width, Color::create_blue());
+  with_shared_pool(thread_count, [&](ThreadPool &pool) {
+    render(scene, pool, bmp, -1.0, PassCallbackTy(), logs);
+  });
+  return bmp;
+}
+
+Bitmap Camera::snap(Scene &scene, ThreadPool &pool,
+                    std::vector<std::string> *logs) {
+  Bitmap bmp(_crop_height, _crop_width, Color::create_blue());
+  render(scene, pool, bmp, -1.0, PassCallbackTy(), logs);
+  return bmp;
+}
+
+void Camera::snap_into(Scene &scene, Bitmap &out, unsigned thread_count) {
+  with_shared_pool(thread_count,
+                   [&](ThreadPool &pool) { snap_into(scene, pool, out); });
+}
+
+void Camera::snap_into(Scene &scene, ThreadPool &pool, Bitmap &out) {
+  render(scene, pool, out, -1.0, PassCallbackTy(), nullptr);
+}
+
+bool Camera::snap_streaming(Scene &scene, ImageSink &sink,
+                            unsigned thread_count) {
+  bool succeeded = false;
+  with_shared_pool(thread_count, [&](ThreadPool &pool) {
+    succeeded = snap_streaming(scene, pool, sink);
+  });
+  return succeeded;
+}
+
+bool Camera::snap_streaming(Scene &scene, ThreadPool &pool, ImageSink &sink) {
+  const unsigned crop_x = _crop_x, crop_y = _crop_y;
+  const unsigned crop_width = _crop_width, crop_height = _crop_height;
+  if (!sink.begin(crop_width, crop_height))
+    return false;
+
+  // Bands are whole rows of tiles, enough of them that every thread gets a
+  // few tiles of each band.
+  unsigned thread_count = pool.thread_count();
+  unsigned columns = std::max((crop_width + kTileSize - 1) / kTileSize, 1u);
+  unsigned band_height =
+      (4 * thread_count + columns - 1) / columns * kTileSize;
+
+  // Supersampling compares each pixel with its neighbors, so each band is
+  // rendered with the row above and the row below it (as far as the crop
+  // goes), which are then dropped.
+  unsigned margin = _samples_per_pixel > 1 ? 1 : 0;
+
+  auto start = std::chrono::steady_clock::now();
+  RenderStats stats;
+  stats.busy_seconds.resize(thread_count);
+  stats.tile_counts.resize(thread_count);
+  stats.stolen_counts.resize(thread_count);
+  double sample_count = 0.0;
+
+  // Each band goes to the sink on a thread of its own, so that it is encoded
+  // while the next band renders.
+  std::thread writer;
+  std::unique_ptr<Bitmap> written_band;
+  bool write_succeeded = true;
+
+  bool succeeded = true;
+  for (unsigned y = 0; y < crop_height && succeeded; y += band_height) {
+    unsigned height = std::min(band_height, crop_height - y);
+    unsigned top = y == 0 ? 0 : margin;
+    unsigned bottom = y + height == crop_height ? 0 : margin;
+    set_crop(crop_x, crop_y + y - top, crop_width, top + height + bottom);
+
+    Bitmap band(top + height + bottom, crop_width, Color::create_blue());
+    render(scene, pool, band, -1.0, PassCallbackTy(), nullptr);
+    if (top + bottom != 0) {
+      Bitmap inner(height, crop_width, Color());
+      for (unsigned by = 0; by < height; by++)
+        for (unsigned x = 0; x < crop_width; x++)
+          inner.at(x, by) = band.at(x, by + top);
+      band = std::move(inner);
+    }
+
+    for (unsigned i = 0; i < thread_count; i++) {
+      stats.busy_seconds[i] += _render_stats.busy_seconds[i];
+      stats.tile_counts[i] += _render_stats.tile_counts[i];
+      stats.stolen_counts[i] += _render_stats.stolen_counts[i];
+    }
+    sample_count += _render_stats.samples_per_pixel *
+                    ((top + height + bottom) * uint64_t(crop_width));
+
+    if (writer.joinable())
+      writer.join();
+    succeeded = write_succeeded;
+    if (!succeeded)
+      break;
+    written_band = make_unique<Bitmap>(std::move(band));
+    writer = std::thread(
+        [&, y]() { write_succeeded = sink.write_rows(*written_band, y); });
+  }
+  if (writer.joinable())
+    writer.join();
+  succeeded = succeeded && write_succeeded;
+  set_crop(crop_x, crop_y, crop_width, crop_height);
+
+  stats.render_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  if (crop_width != 0 && crop_height != 0)
+    stats.samples_per_pixel =
+        sample_count / (uint64_t(crop_width) * crop_height);
+  _render_stats = stats;
+  return succeeded && sink.end();
+}
+
+HdrBitmap Camera::snap_hdr(Scene &scene, ThreadPool &pool,
+                           std::vector<std::string> *logs) {
+  HdrBitmap image(_crop_height, _crop_width, HdrColor::create_blue());
+  render(scene, pool, image, -1.0, {}, logs);
+  return image;
+}
+
+Bitmap Camera::snap_progressive(Scene &scene, unsigned thread_count,
+                                double budget_seconds,
+                                const PassCallbackTy &on_pass) {
+  Bitmap bmp(_crop_height, _crop_width, Color::create_blue());
+  with_shared_pool(thread_count, [&](ThreadPool &pool) {
+    render(scene, pool, bmp, budget_seconds, on_pass, nullptr);
+  });
+  return bmp;
+}
+
+Bitmap Camera::snap_progressive(Scene &scene, ThreadPool &pool,
+                                double budget_seconds,
+                                const PassCallbackTy &on_pass) {
+  assert(budget_seconds >= 0.0 && "Expected a budget!");
+  Bitmap bmp(_crop_height, _crop_width, Color::create_blue());
+  render(scene, pool, bmp, budget_seconds, on_pass, nullptr);
+  return bmp;
+}
+
+template <typename ImageTy>
+void Camera::render(
+    Scene &scene, ThreadPool &pool, ImageTy &image, double budget_seconds,
+    const std::function<void(const ImageTy &, unsigned)> &on_pass,
+    std::vector<std::string> *logs, RenderHandle *handle) {
+  assert(image.width() == _crop_width && image.height() == _crop_height &&
+         "Image doesn't fit the crop!");
+  typedef typename std::remove_reference<decltype(image.at(0, 0))>::type
+      PixelTy;
+  auto start = std::chrono::steady_clock::now();
+  bool is_progressive = budget_seconds >= 0.0;
+  TimePointTy deadline = TimePointTy::max();
+  if (is_progressive)
+    deadline = start + std::chrono::duration_cast<
+                           std::chrono::steady_clock::duration>(
+                           std::chrono::duration<double>(budget_seconds));
+
+  unsigned thread_count = pool.thread_count();
+  if (scene.is_bvh_stale()) {
+    BVHBuildOptions options;
+    options.thread_count = thread_count;
+    scene.build_bvh(options);
+  }
 
   Ruler::Real max_diag_square =
       std::pow(_screen_height_px / 2, 2) + std::pow(_screen_width_px / 2, 2);
 
-  double focal_length = _focal_length;
+  Ruler::Real focal_length = _focal_length;
   unsigned resolution = _screen_resolution;
   auto focus = _focus_position;
 
-  auto render_one_pixel = [&](int x, int y, ThreadContext &ctx) {
-    auto scale = Ruler::one() + (x * x + y * y) / max_diag_square;
-    const Vector sample_pt(focal_length, (x * scale) / resolution,
-                           (y * scale) / resolution);
-    return scene.render_pixel(Ray::from_two_points(focus, focus + sample_pt),
-                              ctx);
+  auto primary_ray = [&](const Sample &s) {
+    auto scale = Ruler::one() + (s.x * s.x + s.y * s.y) / max_diag_square;
+    const Vector sample_pt(focal_length, (s.x * scale) / resolution,
+                           (s.y * scale) / resolution);
+    return Ray::from_two_points(focus, focus + sample_pt);
+  };
+
+  auto render_samples = [&](const Sample *samples, unsigned count,
+                            ThreadContext &ctx, HdrColor *out) {
+    if (count == 1) {
+      out[0] = scene.render_pixel(primary_ray(samples[0]), ctx);
+      return;
+    }
+
+    RayPacket packet;
+    for (unsigned i = 0; i < count; i++)
+      packet.push_back(primary_ray(samples[i]));
+    scene.render_packet(packet, ctx, out);
   };
 
-  typedef decltype(render_one_pixel) RenderFnTy;
+  // Pixel (0, 0) of the full image is at (-width / 2, -height / 2) on the
+  // screen.
+  int bmp_origin_x = int(_screen_width_px / 2) - int(_crop_x);
+  int bmp_origin_y = int(_screen_height_px / 2) - int(_crop_y);
+  std::atomic<uint64_t> sample_count(0);
+  auto pixel = [&](int x, int y) -> PixelTy & {
+    return image.at(x + bmp_origin_x, y + bmp_origin_y);
+  };
+
+  // Packets are as square as possible, since square blocks of pixels have the
+  // narrowest frusta.
+  int block_width = 1;
+  while (block_width * block_width * 2 <= int(_packet_size))
+    block_width *= 2;
+  int block_height = _packet_size / block_width;
+
+  // Sample the pixels of a tile at multiples of spacing from its corner, with
+  // each sample coloring the spacing x spacing square to its bottom right,
+  // and skip the samples that a pass with twice the spacing took if
+  // is_refinement is set.  No two tiles overlap, so the threads write
+  // disjoint pixels.
+  //
+  // The blocks of samples are rendered in the order of block_order, which is
+  // in units of blocks.
+  int spacing = 1;
+  bool is_refinement = false;
+  std::vector<std::pair<int, int>> block_order;
+  auto render_tile = [&](const Tile &t, ThreadContext &ctx) {
+    Sample samples[RayPacket::kMaxSize];
+    HdrColor colors[RayPacket::kMaxSize];
+    int s = spacing, bw = block_width * s, bh = block_height * s;
+    int xe = t.x + t.width, ye = t.y + t.height;
+    unsigned tile_sample_count = 0;
+
+    for (const auto &block : block_order) {
+      int xi = t.x + block.first * bw, yi = t.y + block.second * bh;
+      if (xi >= xe || yi >= ye)
+        continue;
+
+      unsigned count = 0;
+      for (int y = yi; y < std::min(yi + bh, ye); y += s)
+        for (int x = xi; x < std::min(xi + bw, xe); x += s)
+          if (!is_refinement || (x - t.x) % (2 * s) != 0 ||
+              (y - t.y) % (2 * s) != 0) {
+            samples[count].x = x;
+            samples[count].y = y;
+            count++;
+          }
+
+      if (count == 0)
+        continue;
+      render_samples(samples, count, ctx, colors);
+      tile_sample_count += count;
+
+      for (unsigned i = 0; i < count; i++) {
+        int x = samples[i].x, y = samples[i].y;
+        PixelTy c;
+        store(c, colors[i]);
+        for (int yj = y; yj < std::min(y + s, ye); yj++)
+          for (int xj = x; xj < std::min(x + s, xe); xj++)
+            pixel(xj, yj) = c;
+      }
+    }
+
+    sample_count += tile_sample_count;
+  };
+
+  // Reset the contexts on their own threads, so that any memory they need
+  // is allocated on the threads' nodes.
+  pool.run([&](unsigned, ThreadContext &ctx) {
+    ctx.reset(scene.object_count(), logs != nullptr);
+  });
+  for (unsigned i = 0; i < thread_count; i++)
+    scene.init_object_ids(pool.context(i));
 
-  std::vector<ThreadTask<RenderFnTy>> subtasks;
-  std::vector<std::thread> threads;
+  int x_begin = -bmp_origin_x;
+  int x_end = std::max(
+      std::min(x_begin + int(_crop_width), int(_screen_width_px / 2)), x_begin);
+  int y_begin = -bmp_origin_y;
+  int y_end = std::max(
+      std::min(y_begin + int(_crop_height), int(_screen_height_px / 2)),
+      y_begin);
 
-  int x_begin = -(_screen_width_px / 2);
-  int x_delta = _screen_width_px / thread_count;
+  // Screens with an odd width or height have a last column or row that no
+  // primary ray goes through, which is left blue.
+  for (unsigned y = 0; y < image.height(); y++)
+    for (unsigned x = y < unsigned(y_end - y_begin) ? x_end - x_begin : 0;
+         x < image.width(); x++)
+      store(image.at(x, y), HdrColor::create_blue());
 
-  for (int i = 0; i < thread_count; i++) {
-    int x_end =
-        i == (thread_count - 1) ? (_screen_width_px / 2) : (x_begin + x_delta);
-    ThreadTask<RenderFnTy>::Point p0(x_begin, -(_screen_height_px / 2));
-    ThreadTask<RenderFnTy>::Point p1(x_end, (_screen_height_px / 2));
-    subtasks.emplace_back(p0, p1, render_one_pixel, scene, logs != nullptr);
-    x_begin = x_end;
+  int columns = (x_end - x_begin + kTileSize - 1) / kTileSize;
+  int rows = (y_end - y_begin + kTileSize - 1) / kTileSize;
+  std::vector<Tile> tiles;
+  for (const auto &cell : grid_order(columns, rows, _tile_order)) {
+    Tile t;
+    t.x = x_begin + cell.first * kTileSize;
+    t.y = y_begin + cell.second * kTileSize;
+    t.width = std::min(kTileSize, x_end - t.x);
+    t.height = std::min(kTileSize, y_end - t.y);
+    tiles.push_back(t);
   }
 
-  for (int i = 0; i < thread_count; i++) {
-    auto *task = &subtasks[i];
-    threads.emplace_back([task]() { task->do_threaded_work(); });
+  // A tile is done once the pass with a spacing of 1 is done with it, and,
+  // with supersampling, once its edge pixels have been resampled too.  Each
+  // of those passes counts towards the progress.
+  bool is_supersampled = _samples_per_pixel > 1;
+  const std::atomic<bool> *is_cancelled =
+      handle ? &handle->_is_cancelled : nullptr;
+  if (handle) {
+    handle->_tile_done.assign(tiles.size(), 0);
+    handle->_tile_count = tiles.size() * (is_supersampled ? 2 : 1);
   }
+  auto mark_tile_done = [&](const Tile &t) {
+    handle->_tile_done[(t.y - y_begin) / kTileSize * columns +
+                       (t.x - x_begin) / kTileSize] = 1;
+  };
+  auto render_and_report_tile = [&](const Tile &t, ThreadContext &ctx) {
+    render_tile(t, ctx);
+    if (handle && spacing == 1) {
+      if (!is_supersampled)
+        mark_tile_done(t);
+      handle->_finished_tile_count++;
+    }
+  };
+
+  _render_stats = RenderStats();
+  _render_stats.busy_seconds.resize(thread_count);
+  _render_stats.tile_counts.resize(thread_count);
+  _render_stats.stolen_counts.resize(thread_count);
+
+  // A progressive render starts with a coarse preview, which always runs to
+  // completion so that every pixel gets a color, and then halves the spacing
+  // of the samples until every pixel has its own sample or the budget runs
+  // out.
+  bool is_complete = true;
+  for (spacing = is_progressive ? kPreviewSpacing : 1; spacing >= 1;
+       spacing /= 2) {
+    is_refinement = spacing != (is_progressive ? kPreviewSpacing : 1);
+    int block_side = kTileSize / spacing;
+    block_order =
+        grid_order((block_side + block_width - 1) / block_width,
+                   (block_side + block_height - 1) / block_height, _tile_order);
+    is_complete = run_pass(pool, tiles, render_and_report_tile,
+                           is_refinement ? deadline : TimePointTy::max(),
+                           is_cancelled, _render_stats);
+    if (!is_complete)
+      break;
+    _render_stats.sample_spacing = spacing;
+    if (on_pass)
+      on_pass(image, spacing);
+  }
+
+  if (is_complete && is_supersampled) {
+    // Mark the pixels that differ from one of their neighbors by more than the
+    // threshold once tone mapped, before any of them change.
+    unsigned width = x_end - x_begin, height = y_end - y_begin;
+    std::vector<uint8_t> is_edge(width * height);
+    auto differ = [&](const PixelTy &p0, const PixelTy &p1) {
+      Color c0 = tone_mapped(p0), c1 = tone_mapped(p1);
+      return unsigned(std::abs(c0.red() - c1.red())) > _contrast_threshold ||
+             unsigned(std::abs(c0.green() - c1.green())) >
+                 _contrast_threshold ||
+             unsigned(std::abs(c0.blue() - c1.blue())) > _contrast_threshold;
+    };
+    pool.run([&](unsigned worker_idx, ThreadContext &) {
+      for (unsigned y = height * worker_idx / thread_count,
+                    ye = height * (worker_idx + 1) / thread_count;
+           y < ye; y++)
+        for (unsigned x = 0; x < width; x++) {
+          const PixelTy &c = image.at(x, y);
+          is_edge[y * width + x] =
+              (x > 0 && differ(c, image.at(x - 1, y))) ||
+              (x + 1 < width && differ(c, image.at(x + 1, y))) ||
+              (y > 0 && differ(c, image.at(x, y - 1))) ||
+              (y + 1 < height && differ(c, image.at(x, y + 1)));
+        }
+    });
+
+    // Replace the color of each such pixel with the average of a grid of
+    // samples spread over the pixel.
+    unsigned grid_size = std::sqrt(_samples_per_pixel);
+    std::vector<std::pair<int, int>> pixel_order =
+        grid_order(kTileSize, kTileSize, _tile_order);
+    auto supersample_tile = [&](const Tile &t, ThreadContext &ctx) {
+      Sample samples[RayPacket::kMaxSize];
+      HdrColor colors[RayPacket::kMaxSize];
+      unsigned tile_sample_count = 0;
+
+      for (const auto &p : pixel_order) {
+        int x = t.x + p.first, y = t.y + p.second;
+        if (p.first >= t.width || p.second >= t.height ||
+            !is_edge[(y + bmp_origin_y) * width + x + bmp_origin_x])
+          continue;
+
+        unsigned count = 0;
+        for (unsigned j = 0; j < grid_size; j++)
+          for (unsigned i = 0; i < grid_size; i++) {
+            samples[count].x = x + (i + 0.5) / grid_size - 0.5;
+            samples[count].y = y + (j + 0.5) / grid_size - 0.5;
+            count++;
+          }
+        render_samples(samples, count, ctx, colors);
+        tile_sample_count += count;
+
+        HdrColor sum;
+        for (unsigned i = 0; i < count; i++)
+          sum += colors[i];
+        store(pixel(x, y), sum * (1.0f / count));
+      }
 
-  int x_bmp_delta = _screen_width_px / 2, y_bmp_delta = _screen_height_px / 2;
+      sample_count += tile_sample_count;
+      if (handle) {
+        mark_tile_done(t);
+        handle->_finished_tile_count++;
+      }
+    };
 
-  for (int i = 0; i < thread_count; i++) {
-    threads[i].join();
-    subtasks[i].drain_work(
-        [&bmp, x_bmp_delta, y_bmp_delta](int x, int y, const Color &c) {
-          bmp.at(x + x_bmp_delta, y + y_bmp_delta) = c;
-        });
+    is_complete = run_pass(pool, tiles, supersample_tile, deadline,
+                           is_cancelled, _render_stats);
+    if (is_complete && on_pass)
+      on_pass(image, 1);
   }
 
+  _render_stats.render_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  unsigned pixel_count = unsigned(x_end - x_begin) * unsigned(y_end - y_begin);
+  if (pixel_count != 0)
+    _render_stats.samples_per_pixel = double(sample_count) / pixel_count;
+
   if (logs)
-    for (auto &task : subtasks)
-      logs->emplace_back(std::move(task.context().logger().get_log()));
+    for (unsigned i = 0; i < thread_count; i++)
+      logs->emplace_back(std::move(pool.context(i).logger().get_log()));
 
-  return bmp;
+  if (handle) {
+    RenderResult &result = handle->_result;
+    result.tile_size = kTileSize;
+    result.tile_columns = columns;
+    result.tile_rows = rows;
+    result.tile_done.assign(handle->_tile_done.begin(),
+                            handle->_tile_done.end());
+    result.is_complete = is_complete;
+  }
 }
 
-Color Scene::render_pixel(const Ray &r, ThreadContext &ctx) const {
-  double smallest_k = std::numeric_limits<double>::infinity();
-  Color pixel;
-  Logger &l = ctx.logger();
+std::unique_ptr<RenderHandle> Camera::snap_async(Scene &scene,
+                                                 ThreadPool &pool) {
+  std::unique_ptr<RenderHandle> handle(new RenderHandle());
+  RenderHandle *h = handle.get();
+  h->_result.image = Bitmap(_crop_height, _crop_width, Color::create_blue());
+  h->_thread = std::thread([this, &scene, &pool, h]() {
+    render(scene, pool, h->_result.image, -1.0, PassCallbackTy(), nullptr, h);
+
+    std::lock_guard<std::mutex> guard(h->_lock);
+    h->_result.stats = _render_stats;
+    h->_is_stopped = true;
+    h->_stopped.notify_all();
+  });
+  return handle;
+}
+
+RenderHandle::~RenderHandle() {
+  cancel();
+  if (_thread.joinable())
+    _thread.join();
+}
+
+bool RenderHandle::wait_until(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> guard(_lock);
+  return _stopped.wait_until(guard, deadline, [&]() { return _is_stopped; });
+}
+
+bool RenderHandle::wait_for(double seconds) {
+  return wait_until(std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(seconds)));
+}
+
+void RenderHandle::wait() {
+  std::unique_lock<std::mutex> guard(_lock);
+  _stopped.wait(guard, [&]() { return _is_stopped; });
+}
+
+bool RenderHandle::is_stopped() {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _is_stopped;
+}
+
+RenderResult RenderHandle::take_result() {
+  assert(_thread.joinable() && "Result already taken!");
+  _thread.join();
+  return std::move(_result);
+}
+
+/// Intersect \p r with \p c, returning the offset in \p out_k.
+static bool intersect_geometry(const Cube &c, const Ray &r,
+                               Ruler::Real &out_k) {
+  unsigned face_idx;
+  return c.intersect(r, out_k, face_idx);
+}
+
+/// Build the hierarchy for \p batch over \p geometry, which is owned by
+/// \p owners, and lay out the batch in the order of the hierarchy's leaves.
+template <typename GeometryTy, typename StorageTy>
+static void build_batch(GeometryBatch<GeometryTy, StorageTy> &batch,
+                        const std::vector<GeometryTy> &geometry,
+                        const std::vector<const Object *> &owners,
+                        const std::vector<AxisAlignedBox> &bounds,
+                        const BVHBuildOptions &options) {
+  batch = GeometryBatch<GeometryTy, StorageTy>();
+  batch.bvh.build(bounds, options);
+
+  batch.owners.reserve(owners.size());
+  for (unsigned old_idx : batch.bvh.renumber_primitives()) {
+    batch.geometry.push_back(geometry[old_idx]);
+    batch.owners.push_back(owners[old_idx]);
+  }
+}
 
+template <typename GeometryTy>
+static const Object *
+closest_hit_in_batch(const GeometryBatch<GeometryTy> &batch, const Ray &r,
+                     Ruler::Real &max_k,
+                     const std::vector<const Object *> &ignored,
+                     const Object *closest) {
+  batch.bvh.traverse(r, max_k, [&](unsigned idx, Ruler::Real &bound) {
+    Ruler::Real k;
+    if (!intersect_geometry(batch.geometry[idx], r, k) || k >= bound ||
+        Ruler::is_negative(k))
+      return;
+
+    const Object *owner = batch.owners[idx];
+    if (!ignored.empty() &&
+        std::find(ignored.begin(), ignored.end(), owner) != ignored.end())
+      return;
+
+    bound = k;
+    closest = owner;
+  });
+
+  return closest;
+}
+
+template <typename GeometryTy>
+static bool any_hit_in_batch(const GeometryBatch<GeometryTy> &batch,
+                             const Ray &r, Ruler::Real max_k) {
+  Ruler::Real traversal_k = max_k;
+  return batch.bvh.traverse_until(r, traversal_k,
+                                  [&](unsigned idx, Ruler::Real &) {
+    Ruler::Real k;
+    return intersect_geometry(batch.geometry[idx], r, k) && k < max_k &&
+           !Ruler::is_negative(k);
+  });
+}
+
+/// Like \c closest_hit_in_batch, but intersects whole leaves of spheres at a
+/// time with the vectorized kernel in \c SphereArray.
+static const Object *
+closest_hit_in_batch(const GeometryBatch<Sphere, SphereArray> &batch,
+                     const Ray &r, Ruler::Real &max_k,
+                     const std::vector<const Object *> &ignored,
+                     const Object *closest) {
+  const unsigned kWidth = SphereArray::kWidth;
+  SphereArray::RayConstants rc(r);
+
+  batch.bvh.traverse_leaves(
+      r, max_k, [&](unsigned first, unsigned count, Ruler::Real &bound) {
+        for (unsigned i = first, e = first + count; i < e; i += kWidth) {
+          Ruler::Real ks[kWidth];
+          unsigned hits = batch.geometry.intersect(
+              rc, i, std::min(kWidth, e - i), bound, ks);
+
+          // Visit the hits in order, so that ties go to the first sphere, as
+          // they would with a scalar loop.
+          for (; hits; hits &= hits - 1) {
+            unsigned lane = __builtin_ctz(hits);
+            const Object *owner = batch.owners[i + lane];
+            if (ks[lane] >= bound ||
+                (!ignored.empty() &&
+                 std::find(ignored.begin(), ignored.end(), owner) !=
+                     ignored.end()))
+              continue;
+
+            bound = ks[lane];
+            closest = owner;
+          }
+        }
+      });
+
+  return closest;
+}
+
+static bool any_hit_in_batch(const GeometryBatch<Sphere, SphereArray> &batch,
+                             const Ray &r, Ruler::Real max_k) {
+  const unsigned kWidth = SphereArray::kWidth;
+  SphereArray::RayConstants rc(r);
+
+  Ruler::Real traversal_k = max_k;
+  return batch.bvh.traverse_leaves_until(
+      r, traversal_k, [&](unsigned first, unsigned count, Ruler::Real &) {
+        for (unsigned i = first, e = first + count; i < e; i += kWidth) {
+          Ruler::Real ks[kWidth];
+          if (batch.geometry.intersect(rc, i, std::min(kWidth, e - i), max_k,
+                                       ks))
+            return true;
+        }
+        return false;
+      });
+}
+
+/// Find the closest hit in \p batch of each ray in the coherent packet \p p,
+/// as \c closest_hit_in_batch would with an empty list of ignored objects.
+/// max_k[i] and closest[i] are the bound and result for ray i.
+template <typename GeometryTy>
+static void closest_hits_in_batch(const GeometryBatch<GeometryTy> &batch,
+                                  const RayPacket &p, Ruler::Real *max_k,
+                                  const Object **closest) {
+  batch.bvh.traverse_packet(p, max_k, [&](unsigned first, unsigned count,
+                                          unsigned ray_mask,
+                                          Ruler::Real *bounds) {
+    for (; ray_mask; ray_mask &= ray_mask - 1) {
+      unsigned ray_idx = __builtin_ctz(ray_mask);
+      Ray r = p.ray(ray_idx);
+      for (unsigned i = first, e = first + count; i != e; ++i) {
+        Ruler::Real k;
+        if (!intersect_geometry(batch.geometry[i], r, k) ||
+            k >= bounds[ray_idx] || Ruler::is_negative(k))
+          continue;
+
+        bounds[ray_idx] = k;
+        closest[ray_idx] = batch.owners[i];
+      }
+    }
+  });
+}
+
+static void
+closest_hits_in_batch(const GeometryBatch<Sphere, SphereArray> &batch,
+                      const RayPacket &p, Ruler::Real *max_k,
+                      const Object **closest) {
+  const unsigned kWidth = SphereArray::kWidth;
+  std::vector<SphereArray::RayConstants> rcs;
+  rcs.reserve(p.size());
+  for (unsigned i = 0, e = p.size(); i != e; ++i)
+    rcs.emplace_back(p.ray(i));
+
+  batch.bvh.traverse_packet(p, max_k, [&](unsigned first, unsigned count,
+                                          unsigned ray_mask,
+                                          Ruler::Real *bounds) {
+    for (; ray_mask; ray_mask &= ray_mask - 1) {
+      unsigned ray_idx = __builtin_ctz(ray_mask);
+      for (unsigned i = first, e = first + count; i < e; i += kWidth) {
+        Ruler::Real ks[kWidth];
+        unsigned hits = batch.geometry.intersect(
+            rcs[ray_idx], i, std::min(kWidth, e - i), bounds[ray_idx], ks);
+        for (; hits; hits &= hits - 1) {
+          unsigned lane = __builtin_ctz(hits);
+          if (ks[lane] >= bounds[ray_idx])
+            continue;
+          bounds[ray_idx] = ks[lane];
+          closest[ray_idx] = batch.owners[i + lane];
+        }
+      }
+    }
+  });
+}
+
+/// Return the bounds of \p o, padded to account for rounding errors, in
+/// \p out_bounds.  Return false if \p o is unbounded.
+static bool get_padded_bounds(const Object &o, AxisAlignedBox &out_bounds) {
+  AxisAlignedBox b;
+  if (!o.bounds(b))
+    return false;
+
+  // Objects compute their points of incidence with some rounding error, so
+  // give them a little slack.  The padding is relative to the magnitude of
+  // the coordinates since that is what the rounding error scales with.
+  Ruler::Real magnitude = 0.0;
+  for (unsigned axis = 0; axis < 3; axis++)
+    magnitude = std::max({magnitude, std::fabs(b.min().component(axis)),
+                          std::fabs(b.max().component(axis))});
+  out_bounds = b.pad(Ruler::epsilon() + magnitude * 1E-9);
+  return true;
+}
+
+void Scene::build_bvh(const BVHBuildOptions &options) {
+  _bounded_objects.clear();
+  _unbounded_objects.clear();
+  _miss_shader = nullptr;
+
+  std::vector<AxisAlignedBox> bounds, sphere_bounds, cube_bounds;
+  std::vector<Sphere> spheres;
+  std::vector<Cube> cubes;
+  std::vector<const Object *> sphere_owners, cube_owners;
   for (auto &o : _objects) {
-    double k;
-    Color c;
+    if (o->is_miss_shader()) {
+      if (!_miss_shader)
+        _miss_shader = o.get();
+      continue;
+    }
+
+    AxisAlignedBox b;
+    if (!get_padded_bounds(*o, b)) {
+      _unbounded_objects.push_back(o.get());
+      continue;
+    }
+
+    if (_object_storage == ObjectStorageTy::type_batched) {
+      if (auto *mirror = dyn_cast<SphericalMirrorObj>(o.get())) {
+        spheres.push_back(mirror->sphere());
+        sphere_owners.push_back(mirror);
+        sphere_bounds.push_back(b);
+        continue;
+      }
+
+      const Cube *cube = nullptr;
+      if (auto *box = dyn_cast<BoxObj>(o.get()))
+        cube = &box->cube();
+      else if (auto *refractive_box = dyn_cast<RefractiveBoxObj>(o.get()))
+        cube = &refractive_box->cube();
+
+      if (cube) {
+        cubes.push_back(*cube);
+        cube_owners.push_back(o.get());
+        cube_bounds.push_back(b);
+        continue;
+      }
+    }
+
+    bounds.push_back(b);
+    _bounded_objects.push_back(o.get());
+  }
+
+  _bvh.build(bounds, options);
+  _bvh_stats = _bvh.stats();
+
+  // Leaves as wide as the sphere kernel make the most of each call to it.
+  BVHBuildOptions sphere_options = options;
+  sphere_options.max_leaf_size = SphereArray::kWidth;
+  build_batch(_spheres, spheres, sphere_owners, sphere_bounds, sphere_options);
+  _bvh_stats.accumulate(_spheres.bvh.stats());
+
+  build_batch(_cubes, cubes, cube_owners, cube_bounds, options);
+  _bvh_stats.accumulate(_cubes.bvh.stats());
+
+  _bvh_is_stale = false;
+}
+
+const Object *
+Scene::closest_batched_hit(const Ray &r, Ruler::Real &max_k,
+                           const std::vector<const Object *> &ignored) const {
+  const Object *closest = nullptr;
+  closest = closest_hit_in_batch(_spheres, r, max_k, ignored, closest);
+  closest = closest_hit_in_batch(_cubes, r, max_k, ignored, closest);
+  return closest;
+}
+
+HdrColor Scene::render_pixel(const Ray &r, ThreadContext &ctx,
+                             const BatchedHit *known_hit) const {
+  assert(!is_bvh_stale() && "Call build_bvh before rendering!");
+
+  Ruler::Real smallest_k = Ruler::infinity();
+  bool found_hit = false;
+  HdrColor pixel;
+  Logger &l = ctx.logger();
+
+  auto try_object = [&](const Object &o) {
+    Ruler::Real k;
+    HdrColor c;
     bool success;
     {
       IndentScope i_scope(l);
       success =
-          o->incident(ctx, r, smallest_k, k, c) && k < smallest_k && k >= 0.0;
+          o.incident(ctx, r, smallest_k, k, c) && k < smallest_k && k >= 0.0;
       if (success) {
         smallest_k = k;
         pixel = c;
+        found_hit = true;
       }
     }
 
     if (Logger::kIsEnabled && success)
-      l << indent << LogTag("scene") << "success with " << o->description()
+      l << indent << LogTag("scene") << "success with " << o.description()
         << " for " << r << "\n";
+    return success;
+  };
+
+  for (const Object *o : _unbounded_objects)
+    try_object(*o);
+
+  // try_object lowers smallest_k as it finds hits, which prunes the rest of
+  // the traversal.
+  _bvh.traverse(r, smallest_k, [&](unsigned idx, Ruler::Real &) {
+    try_object(*_bounded_objects[idx]);
+  });
+
+  // Only the closest batched hit gets shaded.  Shading can fail (e.g. for a
+  // mirror past its nesting limit), in which case the next closest hit gets a
+  // chance, just as if every object had been shaded.
+  std::vector<const Object *> rejected;
+  for (;;) {
+    Ruler::Real k = smallest_k;
+    const Object *o;
+    if (known_hit && rejected.empty())
+      o = known_hit->k < smallest_k ? known_hit->object : nullptr;
+    else
+      o = closest_batched_hit(r, k, rejected);
+    if (!o || try_object(*o))
+      break;
+    rejected.push_back(o);
+  }
+
+  if (!found_hit && _miss_shader) {
+    _miss_shader->shade_miss(ctx, r, pixel);
+
+    if (Logger::kIsEnabled)
+      l << indent << LogTag("scene") << "miss, shaded by "
+        << _miss_shader->description() << " for " << r << "\n";
   }
 
   return pixel;
 }
 
+void Scene::render_packet(const RayPacket &p, ThreadContext &ctx,
+                          HdrColor *out) const {
+  assert(!is_bvh_stale() && "Call build_bvh before rendering!");
+
+  if (!p.is_coherent()) {
+    for (unsigned i = 0, e = p.size(); i != e; ++i)
+      out[i] = render_pixel(p.ray(i), ctx);
+    return;
+  }
+
+  Ruler::Real ks[RayPacket::kMaxSize];
+  const Object *hits[RayPacket::kMaxSize];
+  std::fill(ks, ks + p.size(), Ruler::infinity());
+  std::fill(hits, hits + p.size(), nullptr);
+
+  closest_hits_in_batch(_spheres, p, ks, hits);
+  closest_hits_in_batch(_cubes, p, ks, hits);
+
+  for (unsigned i = 0, e = p.size(); i != e; ++i) {
+    BatchedHit known_hit = {hits[i], ks[i]};
+    out[i] = render_pixel(p.ray(i), ctx, &known_hit);
+  }
+}
+
+bool Scene::occluded(const Ray &r, Ruler::Real max_k,
+                     ThreadContext &ctx) const {
+  assert(!is_bvh_stale() && "Call build_bvh before rendering!");
+
+  for (const Object *o : _unbounded_objects)
+    if (o->occludes(ctx, r, max_k))
+      return true;
+
+  if (any_hit_in_batch(_spheres, r, max_k) ||
+      any_hit_in_batch(_cubes, r, max_k))
+    return true;
+
+  // Any hit will do, so nothing lowers the bound during the traversal.
+  Ruler::Real traversal_k = max_k;
+  return _bvh.traverse_until(r, traversal_k, [&](unsigned idx, Ruler::Real &) {
+    return _bounded_objects[idx]->occludes(ctx, r, max_k);
+  });
+}
+
 void Scene::init_object_ids(ThreadContext &ctx) const {
   for (unsigned i = 0, e = _objects.size(); i != e; ++i) {
     _objects[i]->set_object_id(i);
@@ -1,5 +1,7 @@
 #include "test.hpp"
 
+#include <cstring>
+
 using namespace ray;
 using namespace ray::internal;
 
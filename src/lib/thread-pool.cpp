@@ -0,0 +1,87 @@
+#include "thread-pool.hpp"
+
+#include "topology.hpp"
+
+#include <cstdio>
+
+using namespace ray;
+
+ThreadPool::ThreadPool(unsigned thread_count, bool pin_threads)
+    : _contexts(thread_count) {
+  assert(thread_count != 0 && "Expected at least one thread!");
+
+  std::vector<unsigned> cpus;
+  if (pin_threads && CpuTopology::get().is_known())
+    cpus = CpuTopology::get().placement(thread_count);
+
+  // Each worker allocates its own context, and the pool isn't ready until
+  // they all have.
+  std::unique_lock<std::mutex> guard(_lock);
+  _busy_count = thread_count;
+  for (unsigned i = 0; i < thread_count; i++) {
+    int cpu = cpus.empty() ? -1 : int(cpus[i]);
+    _workers.emplace_back([this, i, cpu]() { worker_loop(i, cpu); });
+  }
+  _job_finished.wait(guard, [&]() { return _busy_count == 0; });
+
+  if (_unpinned_count != 0)
+    fprintf(stderr, "warning: could not pin %u of %u threads to their CPUs\n",
+            _unpinned_count, thread_count);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _is_shutting_down = true;
+  }
+  _job_posted.notify_all();
+  for (auto &w : _workers)
+    w.join();
+}
+
+void ThreadPool::worker_loop(unsigned worker_idx, int cpu) {
+  // Pin the thread before allocating the context so that, with the usual
+  // first touch policy, the context's memory ends up on the thread's node.
+  bool failed_to_pin = cpu >= 0 && !pin_current_thread(cpu);
+  {
+    auto ctx = make_unique<ThreadContext>(0, false);
+    std::lock_guard<std::mutex> guard(_lock);
+    _contexts[worker_idx] = std::move(ctx);
+    _unpinned_count += failed_to_pin;
+    if (--_busy_count == 0)
+      _job_finished.notify_one();
+  }
+
+  uint64_t last_generation = 0;
+  for (;;) {
+    const JobTy *job;
+    {
+      std::unique_lock<std::mutex> guard(_lock);
+      _job_posted.wait(guard, [&]() {
+        return _is_shutting_down || _job_generation != last_generation;
+      });
+      if (_is_shutting_down)
+        return;
+      last_generation = _job_generation;
+      job = _job;
+    }
+
+    (*job)(worker_idx, *_contexts[worker_idx]);
+
+    std::lock_guard<std::mutex> guard(_lock);
+    if (--_busy_count == 0)
+      _job_finished.notify_one();
+  }
+}
+
+void ThreadPool::run(const JobTy &job) {
+  std::unique_lock<std::mutex> guard(_lock);
+  assert(_busy_count == 0 && "Expected one job at a time!");
+  _job = &job;
+  _job_generation++;
+  _busy_count = thread_count();
+  _job_posted.notify_all();
+
+  _job_finished.wait(guard, [&]() { return _busy_count == 0; });
+  _job = nullptr;
+}
@@ -0,0 +1,205 @@
+#include "tiled-image.hpp"
+
+#include "bitops.hpp"
+#include "support.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ray;
+
+/// The size of the header of a tiled image file.
+static const unsigned kHeaderSize = 16;
+
+/// Write all \p size bytes of \p data to \p fd at \p offset.
+static bool write_fully(int fd, const uint8_t *data, size_t size,
+                        uint64_t offset) {
+  while (size != 0) {
+    ssize_t count = pwrite(fd, data, size, offset);
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+    offset += count;
+  }
+  return true;
+}
+
+/// Read all \p size bytes at \p offset in \p fd into \p data.
+static bool read_fully(int fd, uint8_t *data, size_t size, uint64_t offset) {
+  while (size != 0) {
+    ssize_t count = pread(fd, data, size, offset);
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+    offset += count;
+  }
+  return true;
+}
+
+TiledImageFile::TiledImageFile(int fd, unsigned height, unsigned width,
+                               unsigned tile_size)
+    : _fd(fd), _height(height), _width(width), _tile_size(tile_size) {}
+
+TiledImageFile::~TiledImageFile() { close(_fd); }
+
+std::unique_ptr<TiledImageFile>
+TiledImageFile::create(const char *path, unsigned height, unsigned width,
+                       unsigned tile_size) {
+  assert(tile_size != 0 && "Expected a tile size!");
+  int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return nullptr;
+  std::unique_ptr<TiledImageFile> file(
+      new TiledImageFile(fd, height, width, tile_size));
+
+  uint8_t header[kHeaderSize];
+  memcpy(header, "RAYT", 4);
+  Bitops::encode_le(width, header + 4);
+  Bitops::encode_le(height, header + 8);
+  Bitops::encode_le(tile_size, header + 12);
+  // The file is sized up front, so that the tiles start out as zeroes
+  // without being written.
+  if (!write_fully(fd, header, kHeaderSize, 0) ||
+      ftruncate(fd, file->tile_offset(0, file->rows())) != 0)
+    return nullptr;
+  return file;
+}
+
+std::unique_ptr<TiledImageFile> TiledImageFile::open(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  uint8_t header[kHeaderSize];
+  if (!read_fully(fd, header, kHeaderSize, 0) ||
+      memcmp(header, "RAYT", 4) != 0 || Bitops::decode_le(header + 12) == 0) {
+    close(fd);
+    return nullptr;
+  }
+  std::unique_ptr<TiledImageFile> file(new TiledImageFile(
+      fd, Bitops::decode_le(header + 8), Bitops::decode_le(header + 4),
+      Bitops::decode_le(header + 12)));
+
+  // A file cut short (or a header that doesn't describe the file) would
+  // otherwise only show up as failed reads halfway through a stitch.
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      uint64_t(file_stat.st_size) != file->tile_offset(0, file->rows()))
+    return nullptr;
+  return file;
+}
+
+uint64_t TiledImageFile::tile_offset(unsigned column, unsigned row) const {
+  uint64_t slot_size = uint64_t(_tile_size) * _tile_size * sizeof(Color);
+  return kHeaderSize + (uint64_t(row) * columns() + column) * slot_size;
+}
+
+unsigned TiledImageFile::tile_width(unsigned column) const {
+  assert(column < columns() && "Out of bounds!");
+  return std::min(_tile_size, _width - column * _tile_size);
+}
+
+unsigned TiledImageFile::tile_height(unsigned row) const {
+  assert(row < rows() && "Out of bounds!");
+  return std::min(_tile_size, _height - row * _tile_size);
+}
+
+bool TiledImageFile::write_tile(unsigned column, unsigned row,
+                                const Bitmap &tile) {
+  unsigned width = tile_width(column), height = tile_height(row);
+  assert(tile.width() == width && tile.height() == height &&
+         "Bitmap doesn't fit the tile!");
+  std::vector<Color> pixels;
+  pixels.reserve(uint64_t(width) * height);
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++)
+      pixels.push_back(tile.at(x, y));
+  return write_fully(_fd, reinterpret_cast<const uint8_t *>(pixels.data()),
+                     pixels.size() * sizeof(Color), tile_offset(column, row));
+}
+
+bool TiledImageFile::read_tile(unsigned column, unsigned row,
+                               Bitmap &tile) const {
+  unsigned width = tile_width(column), height = tile_height(row);
+  assert(tile.width() == width && tile.height() == height &&
+         "Bitmap doesn't fit the tile!");
+  std::vector<Color> pixels(uint64_t(width) * height);
+  if (!read_fully(_fd, reinterpret_cast<uint8_t *>(pixels.data()),
+                  pixels.size() * sizeof(Color), tile_offset(column, row)))
+    return false;
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++)
+      tile.at(x, y) = pixels[y * width + x];
+  return true;
+}
+
+bool TiledImageFile::begin(unsigned width, unsigned height) {
+  _pending_rows = 0;
+  _next_row = 0;
+  if (width != _width || height != _height)
+    return false;
+  if (!_pending)
+    _pending = make_unique<Bitmap>(std::min(_tile_size, _height), _width,
+                                   Color());
+  return true;
+}
+
+bool TiledImageFile::flush_pending() {
+  unsigned row = (_next_row - _pending_rows) / _tile_size;
+  for (unsigned column = 0; column < columns(); column++) {
+    Bitmap tile(_pending_rows, tile_width(column), Color());
+    for (unsigned y = 0; y < tile.height(); y++)
+      for (unsigned x = 0; x < tile.width(); x++)
+        tile.at(x, y) = _pending->at(column * _tile_size + x, y);
+    if (!write_tile(column, row, tile))
+      return false;
+  }
+  _pending_rows = 0;
+  return true;
+}
+
+bool TiledImageFile::write_rows(const Bitmap &band, unsigned first_row) {
+  assert(_pending && "Expected begin to be called first!");
+  assert(band.width() == _width && first_row == _next_row &&
+         first_row + band.height() <= _height && "Out of order rows!");
+  for (unsigned y = 0; y < band.height(); y++) {
+    for (unsigned x = 0; x < _width; x++)
+      _pending->at(x, _pending_rows) = band.at(x, y);
+    _pending_rows++;
+    _next_row++;
+    if ((_pending_rows == _tile_size || _next_row == _height) &&
+        !flush_pending())
+      return false;
+  }
+  return true;
+}
+
+bool TiledImageFile::end() {
+  _pending.reset();
+  return _next_row == _height;
+}
+
+bool TiledImageFile::stitch(ImageSink &sink) const {
+  if (!sink.begin(_width, _height))
+    return false;
+  for (unsigned row = 0; row < rows(); row++) {
+    Bitmap band(tile_height(row), _width, Color());
+    for (unsigned column = 0; column < columns(); column++) {
+      Bitmap tile(band.height(), tile_width(column), Color());
+      if (!read_tile(column, row, tile))
+        return false;
+      for (unsigned y = 0; y < tile.height(); y++)
+        for (unsigned x = 0; x < tile.width(); x++)
+          band.at(column * _tile_size + x, y) = tile.at(x, y);
+    }
+    if (!sink.write_rows(band, row * _tile_size))
+      return false;
+  }
+  return sink.end();
+}
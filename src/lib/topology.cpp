@@ -0,0 +1,211 @@
+#include "topology.hpp"
+
+#include "support.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <thread>
+#include <tuple>
+
+#include <pthread.h>
+#include <sched.h>
+
+using namespace ray;
+
+CpuTopology::CpuTopology(std::vector<LogicalCpu> cpus, bool is_known)
+    : _cpus(std::move(cpus)), _is_known(is_known) {
+  std::sort(_cpus.begin(), _cpus.end(),
+            [](const LogicalCpu &a, const LogicalCpu &b) {
+              return a.id < b.id;
+            });
+}
+
+unsigned CpuTopology::physical_core_count() const {
+  std::set<std::pair<unsigned, unsigned>> cores;
+  for (auto &c : _cpus)
+    cores.insert(std::make_pair(c.package, c.core));
+  return std::max(unsigned(cores.size()), 1u);
+}
+
+unsigned CpuTopology::node_count() const {
+  std::set<unsigned> nodes;
+  for (auto &c : _cpus)
+    nodes.insert(c.node);
+  return std::max(unsigned(nodes.size()), 1u);
+}
+
+CpuTopology
+CpuTopology::restricted_to(const std::vector<unsigned> &cpu_ids) const {
+  std::set<unsigned> allowed(cpu_ids.begin(), cpu_ids.end());
+  std::vector<LogicalCpu> cpus;
+  for (auto &c : _cpus)
+    if (allowed.count(c.id))
+      cpus.push_back(c);
+  return CpuTopology(std::move(cpus), _is_known);
+}
+
+std::vector<unsigned> CpuTopology::placement(unsigned thread_count) const {
+  std::vector<unsigned> result;
+  if (_cpus.empty())
+    return result;
+
+  // rounds[r][n] lists the r'th hardware thread of each core on node n.
+  std::map<std::tuple<unsigned, unsigned, unsigned>, unsigned> seen;
+  std::vector<std::map<unsigned, std::vector<unsigned>>> rounds;
+  for (auto &c : _cpus) {
+    unsigned round = seen[std::make_tuple(c.node, c.package, c.core)]++;
+    if (rounds.size() <= round)
+      rounds.resize(round + 1);
+    rounds[round][c.node].push_back(c.id);
+  }
+
+  // Within a round, deal the CPUs out one node at a time.
+  std::vector<unsigned> order;
+  for (auto &round : rounds)
+    for (unsigned i = 0;; i++) {
+      bool found = false;
+      for (auto &node : round)
+        if (i < node.second.size()) {
+          order.push_back(node.second[i]);
+          found = true;
+        }
+      if (!found)
+        break;
+    }
+
+  for (unsigned i = 0; i < thread_count; i++)
+    result.push_back(order[i % order.size()]);
+  return result;
+}
+
+bool ray::parse_cpu_list(const std::string &list,
+                         std::vector<unsigned> &out_ids) {
+  out_ids.clear();
+  const char *p = list.c_str();
+  while (*p && *p != '\n') {
+    char *end;
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p)
+      return false;
+    unsigned long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtoul(p + 1, &end, 10);
+      if (end == p + 1 || last < first)
+        return false;
+      p = end;
+    }
+    for (unsigned long id = first; id <= last; id++)
+      out_ids.push_back(id);
+    if (*p == ',')
+      p++;
+    else if (*p && *p != '\n')
+      return false;
+  }
+  return true;
+}
+
+/// Read the first line of file \p path into \p out_line.
+static bool read_line(const std::string &path, std::string &out_line) {
+  std::ifstream in(path);
+  return in && std::getline(in, out_line);
+}
+
+/// Read the topology of this machine from /sys, returning false if any of it
+/// is missing.
+static bool read_sys_topology(std::vector<LogicalCpu> &out_cpus) {
+  const std::string cpu_dir = "/sys/devices/system/cpu/";
+  const std::string node_dir = "/sys/devices/system/node/";
+
+  std::string line;
+  std::vector<unsigned> cpu_ids;
+  if (!read_line(cpu_dir + "online", line) || !parse_cpu_list(line, cpu_ids))
+    return false;
+
+  // Machines without NUMA support have no node directory; all of their CPUs
+  // are on node 0.
+  std::map<unsigned, unsigned> node_of_cpu;
+  std::vector<unsigned> node_ids;
+  if (read_line(node_dir + "online", line) && parse_cpu_list(line, node_ids))
+    for (unsigned node : node_ids) {
+      std::vector<unsigned> node_cpus;
+      std::string node_path = node_dir + "node" + std::to_string(node);
+      if (read_line(node_path + "/cpulist", line) &&
+          parse_cpu_list(line, node_cpus))
+        for (unsigned cpu : node_cpus)
+          node_of_cpu[cpu] = node;
+    }
+
+  for (unsigned id : cpu_ids) {
+    LogicalCpu c;
+    c.id = id;
+    std::string topology_path =
+        cpu_dir + "cpu" + std::to_string(id) + "/topology/";
+    std::string package, core;
+    if (!read_line(topology_path + "physical_package_id", package) ||
+        !read_line(topology_path + "core_id", core))
+      return false;
+    c.package = strtoul(package.c_str(), nullptr, 10);
+    c.core = strtoul(core.c_str(), nullptr, 10);
+    c.node = node_of_cpu[id];
+    out_cpus.push_back(c);
+  }
+
+  return !out_cpus.empty();
+}
+
+const CpuTopology &CpuTopology::get() {
+  static CpuTopology topology = []() {
+    // /sys lists every online CPU, but a process in a container may only be
+    // allowed a few of them.
+    std::vector<unsigned> allowed;
+    bool has_affinity = read_process_affinity(allowed);
+
+    std::vector<LogicalCpu> cpus;
+    if (read_sys_topology(cpus)) {
+      CpuTopology machine(std::move(cpus));
+      if (!has_affinity)
+        return machine;
+      CpuTopology restricted = machine.restricted_to(allowed);
+      return restricted.cpus().empty() ? machine : restricted;
+    }
+
+    if (!has_affinity)
+      for (unsigned i = 0,
+                    e = std::max(std::thread::hardware_concurrency(), 1u);
+           i != e; ++i)
+        allowed.push_back(i);
+    cpus.clear();
+    for (unsigned id : allowed) {
+      LogicalCpu c;
+      c.id = c.core = id;
+      cpus.push_back(c);
+    }
+    return CpuTopology(std::move(cpus), false);
+  }();
+  return topology;
+}
+
+bool ray::read_process_affinity(std::vector<unsigned> &out_ids) {
+  out_ids.clear();
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return false;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set))
+      out_ids.push_back(cpu);
+  return !out_ids.empty();
+}
+
+bool ray::pin_current_thread(unsigned cpu) {
+  if (cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
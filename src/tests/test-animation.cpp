@@ -0,0 +1,117 @@
+#include "animation.hpp"
+#include "objects.hpp"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace ray;
+
+namespace {
+/// A mirrored sphere that moves to the right as time passes.
+Camera make_moving_sphere(Scene &s, double time) {
+  s.add_object(make_unique<SphericalMirrorObj>(
+      s, Vector::get_i() * 100 + Vector::get_j() * (10 * time - 15), 8));
+  s.add_object(make_unique<SkyObj>(s));
+  return Camera(6.0, 60, 40, 20, Vector::get_origin());
+}
+
+bool same_image(const Bitmap &b0, const Bitmap &b1) {
+  if (b0.width() != b1.width() || b0.height() != b1.height())
+    return false;
+  for (unsigned x = 0; x < b0.width(); x++)
+    for (unsigned y = 0; y < b0.height(); y++) {
+      const Color &c0 = b0.at(x, y), &c1 = b1.at(x, y);
+      if (c0.red() != c1.red() || c0.green() != c1.green() ||
+          c0.blue() != c1.blue())
+        return false;
+    }
+  return true;
+}
+}
+
+TEST(AnimationTest, frames_match_snaps) {
+  const unsigned frame_count = 5;
+  const double frames_per_second = 2.0;
+  ThreadPool pool(2);
+
+  std::vector<unsigned> written;
+  std::vector<std::unique_ptr<Bitmap>> frames;
+  AnimationStats stats;
+  render_animation(make_moving_sphere, frame_count, frames_per_second, pool,
+                   [&](unsigned frame_idx, const Bitmap &bmp) {
+                     // A slow writer mustn't hold up anything but itself.
+                     std::this_thread::sleep_for(
+                         std::chrono::milliseconds(5));
+                     written.push_back(frame_idx);
+                     auto copy = make_unique<Bitmap>(bmp.height(), bmp.width(),
+                                                     Color());
+                     for (unsigned x = 0; x < bmp.width(); x++)
+                       for (unsigned y = 0; y < bmp.height(); y++)
+                         copy->at(x, y) = bmp.at(x, y);
+                     frames.push_back(std::move(copy));
+                   },
+                   &stats);
+
+  ASSERT_EQ(written.size(), frame_count);
+  for (unsigned i = 0; i < frame_count; i++) {
+    EXPECT_EQ(written[i], i);
+
+    Scene s;
+    Camera c = make_moving_sphere(s, i / frames_per_second);
+    Bitmap expected = c.snap(s, pool);
+    EXPECT_TRUE(same_image(expected, *frames[i])) << "frame " << i;
+  }
+  EXPECT_FALSE(same_image(*frames[0], *frames[frame_count - 1]));
+
+  EXPECT_EQ(stats.build_seconds.size(), frame_count);
+  EXPECT_EQ(stats.render_seconds.size(), frame_count);
+  EXPECT_EQ(stats.write_seconds.size(), frame_count);
+  for (double s : stats.write_seconds)
+    EXPECT_GT(s, 0.0);
+}
+
+TEST(AnimationTest, stages_overlap) {
+  // With the stages pipelined, frame i is still being written when the build
+  // of frame i + 2 starts, i.e. while frame i + 1 renders.  Each write waits
+  // for that build, which never comes if the stages run one after another;
+  // the timeout only keeps such a failure from hanging the test.
+  const unsigned frame_count = 6;
+  ThreadPool pool(1);
+  std::mutex lock;
+  std::condition_variable build_started;
+  unsigned builds_started = 0;
+  unsigned overlapped_writes = 0;
+
+  render_animation(
+      [&](Scene &s, double time) {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          builds_started++;
+        }
+        build_started.notify_all();
+        return make_moving_sphere(s, time);
+      },
+      frame_count, 24.0, pool,
+      [&](unsigned frame_idx, const Bitmap &) {
+        unsigned wanted = std::min(frame_idx + 3, frame_count);
+        std::unique_lock<std::mutex> guard(lock);
+        if (build_started.wait_for(guard, std::chrono::seconds(30),
+                                   [&]() { return builds_started >= wanted; }))
+          overlapped_writes++;
+      });
+
+  EXPECT_EQ(overlapped_writes, frame_count);
+}
+
+TEST(AnimationTest, no_frames) {
+  ThreadPool pool(1);
+  unsigned calls = 0;
+  render_animation(make_moving_sphere, 0, 24.0, pool,
+                   [&](unsigned, const Bitmap &) { calls++; });
+  EXPECT_EQ(calls, 0u);
+}
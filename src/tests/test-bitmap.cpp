@@ -0,0 +1,179 @@
+#include "bitmap.hpp"
+#include "bitops.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+using namespace ray;
+
+namespace {
+uint32_t read_4byte(const std::string &file, unsigned offset) {
+  return Bitops::decode_le(reinterpret_cast<const uint8_t *>(&file[offset]));
+}
+}
+
+TEST(BitmapTest, rows_are_padded) {
+  for (unsigned width : {1u, 2u, 3u, 4u, 5u, 7u, 33u, 1000u}) {
+    const unsigned height = 3;
+    Bitmap bmp(height, width, Color());
+    for (unsigned x = 0; x < width; x++)
+      for (unsigned y = 0; y < height; y++)
+        bmp.at(x, y) = Color(x, y, 7);
+
+    std::ostringstream out;
+    bmp.write(out);
+    std::string file = out.str();
+
+    unsigned row_size = (width * 3 + 3) / 4 * 4;
+    ASSERT_EQ(file.size(), 54 + row_size * height) << width;
+    EXPECT_EQ(file.substr(0, 2), "BM");
+    EXPECT_EQ(read_4byte(file, 2), file.size());
+    EXPECT_EQ(read_4byte(file, 10), 54u);
+    EXPECT_EQ(read_4byte(file, 18), width);
+    EXPECT_EQ(read_4byte(file, 22), height);
+    EXPECT_EQ(read_4byte(file, 34), row_size * height);
+
+    // The file's rows go from the bottom of the image up, and the pixels of
+    // each row from right to left, as blue, green and red bytes.
+    for (unsigned r = 0; r < height; r++) {
+      const char *row = &file[54 + r * row_size];
+      for (unsigned i = 0; i < width; i++) {
+        const Color &c = bmp.at(width - 1 - i, height - 1 - r);
+        EXPECT_EQ(uint8_t(row[3 * i]), c.blue());
+        EXPECT_EQ(uint8_t(row[3 * i + 1]), c.green());
+        EXPECT_EQ(uint8_t(row[3 * i + 2]), c.red());
+      }
+      for (unsigned i = width * 3; i < row_size; i++)
+        EXPECT_EQ(row[i], 0) << width;
+    }
+  }
+}
+
+TEST(BitmapTest, large_image_spans_chunks) {
+  // More than one chunk of rows, with a partial chunk at the end.
+  const unsigned width = 1001, height = 1500;
+  Bitmap bmp(height, width, Color());
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      bmp.at(x, y) = Color(x, y, x ^ y);
+
+  std::ostringstream out;
+  bmp.write(out);
+  std::string file = out.str();
+
+  unsigned row_size = (width * 3 + 3) / 4 * 4;
+  ASSERT_EQ(file.size(), 54 + row_size * height);
+  for (unsigned r = 0; r < height; r++) {
+    const char *row = &file[54 + r * row_size];
+    for (unsigned i = 0; i < width; i++) {
+      const Color &c = bmp.at(width - 1 - i, height - 1 - r);
+      ASSERT_EQ(uint8_t(row[3 * i]), c.blue());
+      ASSERT_EQ(uint8_t(row[3 * i + 1]), c.green());
+      ASSERT_EQ(uint8_t(row[3 * i + 2]), c.red());
+    }
+  }
+}
+
+TEST(BitmapTest, mapped_file_matches_write) {
+  for (unsigned width : {1u, 6u, 33u}) {
+    const unsigned height = 5;
+    std::string path = "/tmp/ray-test-mapped-" + std::to_string(getpid()) +
+                       "-" + std::to_string(width) + ".bmp";
+
+    Bitmap expected(height, width, Color());
+    {
+      std::unique_ptr<Bitmap> mapped =
+          Bitmap::create_mapped_file(path.c_str(), height, width);
+      ASSERT_TRUE(mapped != nullptr);
+      EXPECT_TRUE(mapped->is_mapped());
+      ASSERT_EQ(mapped->width(), width);
+      ASSERT_EQ(mapped->height(), height);
+      for (unsigned x = 0; x < width; x++)
+        for (unsigned y = 0; y < height; y++) {
+          Color c(x * 7, y * 13, x + y);
+          mapped->at(x, y) = c;
+          expected.at(x, y) = c;
+        }
+      for (unsigned x = 0; x < width; x++)
+        for (unsigned y = 0; y < height; y++)
+          ASSERT_EQ(mapped->at(x, y).green(), y * 13);
+    }
+
+    std::ostringstream out;
+    expected.write(out);
+    std::ifstream in(path, std::ifstream::binary);
+    std::string file((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    EXPECT_EQ(file, out.str()) << width;
+    unlink(path.c_str());
+  }
+}
+
+TEST(BitmapTest, mapped_file_fails_cleanly) {
+  EXPECT_TRUE(Bitmap::create_mapped_file("/nonexistent/dir/out.bmp", 4, 4) ==
+              nullptr);
+}
+
+TEST(BitmapTest, hdr_colors_keep_precision) {
+  // Colors truncate every time they are scaled, HdrColors only once they are
+  // tone mapped.
+  Color c(100, 200, 250);
+  HdrColor hdr(c);
+  for (int i = 0; i < 10; i++) {
+    c = c * 0.9;
+    hdr = hdr * 0.9;
+  }
+  EXPECT_EQ(c.red(), 32);
+  EXPECT_EQ(hdr.to_color().red(), 35);
+  EXPECT_EQ(hdr.to_color().green(), 70);
+  EXPECT_EQ(hdr.to_color().blue(), 87);
+
+  // Tone mapping clamps.
+  Color clamped = HdrColor(-0.5f, 0.5f, 7.0f).to_color();
+  EXPECT_EQ(clamped.red(), 0);
+  EXPECT_EQ(clamped.green(), 128);
+  EXPECT_EQ(clamped.blue(), 255);
+  for (unsigned level = 0; level < 256; level++)
+    ASSERT_EQ(HdrColor(Color(level, 0, 0)).to_color().red(), level);
+}
+
+TEST(BitmapTest, pfm_matches_bmp_orientation) {
+  const unsigned width = 3, height = 2;
+  HdrBitmap hdr(height, width, HdrColor());
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      hdr.at(x, y) = HdrColor(x, y, 1.5f);
+
+  std::ostringstream out;
+  hdr.write_pfm(out);
+  std::string file = out.str();
+  const std::string header = "PF\n3 2\n-1.0\n";
+  ASSERT_EQ(file.size(), header.size() + width * height * 3 * sizeof(float));
+  EXPECT_EQ(file.substr(0, header.size()), header);
+
+  // The file's rows go from the bottom of the image up, and the pixels of
+  // each row from right to left, as in a BMP file.
+  const char *p = &file[header.size()];
+  for (unsigned r = 0; r < height; r++)
+    for (unsigned i = 0; i < width; i++) {
+      float rgb[3];
+      memcpy(rgb, p, sizeof(rgb));
+      p += sizeof(rgb);
+      const HdrColor &c = hdr.at(width - 1 - i, height - 1 - r);
+      EXPECT_EQ(rgb[0], c.red());
+      EXPECT_EQ(rgb[1], c.green());
+      EXPECT_EQ(rgb[2], c.blue());
+    }
+
+  Bitmap bmp = hdr.tone_map();
+  EXPECT_EQ(bmp.at(2, 1).red(), 255);
+  EXPECT_EQ(bmp.at(0, 1).green(), 255);
+  EXPECT_EQ(bmp.at(0, 0).blue(), 255);
+}
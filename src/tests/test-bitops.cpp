@@ -0,0 +1,39 @@
+#include "bitops.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+#include <vector>
+
+using namespace ray;
+
+TEST(BitopsTest, morton_key) {
+  EXPECT_EQ(Bitops::morton_key(0, 0), 0u);
+  EXPECT_EQ(Bitops::morton_key(1, 0), 1u);
+  EXPECT_EQ(Bitops::morton_key(0, 1), 2u);
+  EXPECT_EQ(Bitops::morton_key(3, 1), 7u);
+  EXPECT_EQ(Bitops::morton_key(0xffffffff, 0), 0x5555555555555555ull);
+  EXPECT_EQ(Bitops::morton_key(0, 0xffffffff), 0xaaaaaaaaaaaaaaaaull);
+}
+
+TEST(BitopsTest, hilbert_key_is_a_continuous_curve) {
+  for (unsigned order = 0; order < 6; order++) {
+    unsigned n = 1u << order;
+    std::vector<int> xs(n * n, -1), ys(n * n, -1);
+    for (unsigned x = 0; x < n; x++)
+      for (unsigned y = 0; y < n; y++) {
+        uint64_t key = Bitops::hilbert_key(order, x, y);
+        ASSERT_LT(key, n * n);
+        ASSERT_EQ(xs[key], -1) << "Key " << key << " is used twice\n";
+        xs[key] = x;
+        ys[key] = y;
+      }
+
+    // The curve starts at the origin and only steps to adjacent cells.
+    EXPECT_EQ(xs[0], 0);
+    EXPECT_EQ(ys[0], 0);
+    for (unsigned i = 1; i < n * n; i++)
+      EXPECT_EQ(std::abs(xs[i] - xs[i - 1]) + std::abs(ys[i] - ys[i - 1]), 1)
+          << "order " << order << ", step " << i << "\n";
+  }
+}
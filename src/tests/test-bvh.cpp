@@ -0,0 +1,156 @@
+#include "bvh.hpp"
+
+#include "gtest/gtest.h"
+
+#include <random>
+
+using namespace ray;
+
+namespace {
+class BVHFixture : public ::testing::Test {
+protected:
+  std::mt19937 _rng;
+  std::vector<Sphere> _spheres;
+  std::vector<Ray> _rays;
+
+  Ruler::Real random(Ruler::Real begin, Ruler::Real end) {
+    return std::uniform_real_distribution<Ruler::Real>(begin, end)(_rng);
+  }
+
+  Vector random_vector(Ruler::Real begin, Ruler::Real end) {
+    return Vector(random(begin, end), random(begin, end), random(begin, end));
+  }
+
+  BVHFixture() : _rng(42) {
+    for (int i = 0; i < 500; i++)
+      _spheres.emplace_back(random_vector(-100, 100), random(0.5, 5));
+
+    for (int i = 0; i < 500; i++)
+      _rays.push_back(Ray::from_two_points(random_vector(-150, 150),
+                                           random_vector(-50, 50)));
+  }
+
+  static bool closest_hit(const Sphere &s, const Ray &r, Ruler::Real max_k,
+                          Ruler::Real &out_k) {
+    Ruler::Real k;
+    if (!s.intersect(r, k) || Ruler::is_negative(k) || k >= max_k)
+      return false;
+    out_k = k;
+    return true;
+  }
+};
+}
+
+TEST_F(BVHFixture, closest_hit_matches_brute_force) {
+  std::vector<AxisAlignedBox> bounds;
+  for (auto &s : _spheres)
+    bounds.push_back(s.bounds().pad(1E-6));
+
+  for (BVHSplitTy split : {BVHSplitTy::median, BVHSplitTy::sah})
+    for (unsigned thread_count : {1, 4}) {
+      BVHBuildOptions options;
+      options.split = split;
+      options.thread_count = thread_count;
+
+      BoundingVolumeHierarchy bvh;
+      bvh.build(bounds, options);
+      EXPECT_EQ(bvh.primitive_count(), _spheres.size());
+
+      unsigned hit_count = 0;
+      for (auto &r : _rays) {
+        Ruler::Real expected_k = Ruler::infinity();
+        for (auto &s : _spheres)
+          closest_hit(s, r, expected_k, expected_k);
+
+        Ruler::Real actual_k = Ruler::infinity();
+        bvh.traverse(r, actual_k, [&](unsigned idx, Ruler::Real &max_k) {
+          closest_hit(_spheres[idx], r, max_k, max_k);
+        });
+
+        EXPECT_EQ(expected_k, actual_k) << r << "\n";
+        hit_count += expected_k != Ruler::infinity();
+      }
+
+      // Make sure the test is actually testing something.
+      EXPECT_GT(hit_count, 50u);
+    }
+}
+
+TEST_F(BVHFixture, build_statistics) {
+  // Clusters of boxes are where the SAH does much better than a median split.
+  std::vector<AxisAlignedBox> bounds;
+  for (int cluster = 0; cluster < 8; cluster++) {
+    Vector center = random_vector(-1000, 1000);
+    for (int i = 0; i < 5000; i++) {
+      Vector p = center + random_vector(-20, 20);
+      bounds.emplace_back(p, p + random_vector(0.1, 2));
+    }
+  }
+
+  BVHBuildOptions options;
+  options.thread_count = 4;
+
+  BoundingVolumeHierarchy bvh;
+  options.split = BVHSplitTy::median;
+  bvh.build(bounds, options);
+  BVHStats median_stats = bvh.stats();
+
+  options.split = BVHSplitTy::sah;
+  bvh.build(bounds, options);
+  BVHStats sah_stats = bvh.stats();
+
+  for (const BVHStats &stats : {median_stats, sah_stats}) {
+    EXPECT_EQ(stats.node_count, 2 * stats.leaf_count - 1);
+    EXPECT_GE(stats.leaf_count,
+              bounds.size() / BoundingVolumeHierarchy::kMaxLeafSize);
+    EXPECT_LT(stats.max_depth, BoundingVolumeHierarchy::kMaxDepth);
+    EXPECT_GT(stats.sah_cost, 0.0);
+  }
+
+  EXPECT_LT(sah_stats.sah_cost, median_stats.sah_cost);
+}
+
+TEST_F(BVHFixture, empty_hierarchy) {
+  BoundingVolumeHierarchy bvh;
+  bvh.build({});
+
+  Ruler::Real k = Ruler::infinity();
+  bool visited = false;
+  bvh.traverse(_rays[0], k, [&](unsigned, Ruler::Real &) { visited = true; });
+  EXPECT_FALSE(visited);
+}
+
+TEST_F(BVHFixture, packet_frustum_is_conservative) {
+  std::vector<AxisAlignedBox> bounds;
+  for (auto &s : _spheres)
+    bounds.push_back(s.bounds());
+
+  unsigned culled_count = 0;
+  for (int packet_idx = 0; packet_idx < 100; packet_idx++) {
+    Vector origin = random_vector(-150, 150);
+    Vector target = random_vector(-50, 50);
+
+    RayPacket packet;
+    for (unsigned i = 0; i < RayPacket::kMaxSize; i++)
+      packet.push_back(
+          Ray::from_two_points(origin, target + random_vector(-2, 2)));
+    if (!packet.is_coherent())
+      continue;
+
+    for (auto &b : bounds) {
+      bool any_hit = false;
+      for (unsigned i = 0; i < packet.size(); i++) {
+        Ruler::Real k;
+        any_hit |= b.intersect(packet.ray(i), packet.inv_dir(i), Ruler::zero(),
+                               Ruler::infinity(), k);
+      }
+
+      bool may_hit = packet.may_intersect(b, Ruler::infinity());
+      EXPECT_TRUE(may_hit || !any_hit) << b << "\n";
+      culled_count += !may_hit;
+    }
+  }
+
+  // The frustum should be tight enough to cull most boxes.
+  EXPECT_GT(culled_count, 100u * bounds.size() / 2);
+}
@@ -0,0 +1,73 @@
+#include "distributed.hpp"
+#include "objects.hpp"
+
+#include "gtest/gtest.h"
+
+#include <random>
+
+#include <unistd.h>
+
+using namespace ray;
+
+namespace {
+Camera make_test_scene(Scene &s, double) {
+  std::mt19937 rng(42);
+  auto random = [&](Ruler::Real begin, Ruler::Real end) {
+    return std::uniform_real_distribution<Ruler::Real>(begin, end)(rng);
+  };
+  auto random_vector = [&](Ruler::Real begin, Ruler::Real end) {
+    return Vector(random(begin, end), random(begin, end), random(begin, end));
+  };
+
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // Not a multiple of the tile sizes, to exercise the partial tiles.
+  return Camera(6.0, 150, 90, 20, Vector::get_origin());
+}
+}
+
+TEST(DistributedTest, matches_snap) {
+  Scene s;
+  Camera c = make_test_scene(s, 0.0);
+  Bitmap expected = c.snap(s, 2);
+
+  DistributedOptions options;
+  options.process_count = 3;
+  options.tile_size = 40;
+  DistributedStats stats;
+  std::unique_ptr<Bitmap> bmp =
+      render_distributed(make_test_scene, options, &stats);
+  ASSERT_TRUE(bmp != nullptr);
+  ASSERT_EQ(bmp->width(), expected.width());
+  ASSERT_EQ(bmp->height(), expected.height());
+  for (unsigned x = 0; x < expected.width(); x++)
+    for (unsigned y = 0; y < expected.height(); y++) {
+      const Color &c0 = expected.at(x, y), &c1 = bmp->at(x, y);
+      ASSERT_TRUE(c0.red() == c1.red() && c0.green() == c1.green() &&
+                  c0.blue() == c1.blue())
+          << "pixel " << x << ", " << y << "\n";
+    }
+
+  ASSERT_EQ(stats.tile_counts.size(), 3u);
+  unsigned tile_count = 0;
+  for (unsigned i = 0; i < 3; i++) {
+    tile_count += stats.tile_counts[i];
+    EXPECT_FALSE(stats.failed[i]);
+  }
+  EXPECT_EQ(tile_count, 12u);
+}
+
+TEST(DistributedTest, fails_without_workers) {
+  DistributedOptions options;
+  options.process_count = 2;
+  DistributedStats stats;
+  std::unique_ptr<Bitmap> bmp = render_distributed(
+      [](Scene &, double) -> Camera { _exit(1); }, options, &stats);
+  EXPECT_TRUE(bmp == nullptr);
+  ASSERT_EQ(stats.failed.size(), 2u);
+  EXPECT_TRUE(stats.failed[0]);
+  EXPECT_TRUE(stats.failed[1]);
+}
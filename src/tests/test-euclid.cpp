@@ -57,18 +57,21 @@ TEST_F(EuclidFixture, basic_vector_properties) {
 
   for (auto &v : _vectors)
     for (auto &r : _vectors)
-      if (Ruler::is_zero(v * r))
+      if (Ruler::is_zero(v * r)) {
         EXPECT_TRUE(Ruler::is_zero(v.dot_product(v.rotate(M_PI / 2, r))));
+      }
 
   for (auto &v : _vectors)
     for (auto &r : _vectors)
-      if (Ruler::is_zero(v * r))
+      if (Ruler::is_zero(v * r)) {
         EXPECT_TRUE(v.cross_product(v.rotate(M_PI, r)).is_zero()) << r << "\n";
+      }
 
   for (auto &v : _vectors)
     for (auto &r : _vectors)
-      if (Ruler::is_zero(v * r))
+      if (Ruler::is_zero(v * r)) {
         EXPECT_TRUE(v.cross_product(v.rotate(M_PI, r)).is_zero());
+      }
 
   for (auto &v : _vectors)
     for (auto &r : _vectors)
@@ -103,7 +106,7 @@ TEST_F(EuclidFixture, plane_intersection) {
 
   auto CheckIntersection = [&](const Plane &p, const Vector &from,
                                const Vector &to) {
-    Ruler::Real k;
+    Ruler::Real k = 0;
     Ray r = Ray::from_two_points(Vector::get_origin(), to);
     EXPECT_TRUE(p.intersect(r, k));
     EXPECT_TRUE(p.contains(r.at(k)));
@@ -130,7 +133,7 @@ TEST_F(EuclidFixture, plane_intersection) {
     Ray non_parallel_ray =
         Ray::from_offset_and_direction(init_point, non_parallel_dir);
 
-    Ruler::Real k;
+    Ruler::Real k = 0;
     EXPECT_TRUE(p.intersect(non_parallel_ray, k)) << p << " "
                                                   << non_parallel_ray << "\n";
     EXPECT_TRUE(p.contains(non_parallel_ray.at(k)));
@@ -156,17 +159,55 @@ TEST_F(EuclidFixture, rectangle_plane_segment_intersection) {
       Vector dir_perp = dir.cross_product(change_dir(dir)).normalize();
       Vector pt2 = pt1 + dir_perp;
 
-      RectanglePlaneSegment rps({{pt0, pt1, pt2}});
+      RectanglePlaneSegment rps(std::array<Vector, 3>{{pt0, pt1, pt2}});
+
+      // Rays cast from the origin can't cross a plane that contains it.
+      if (rps.container().contains(Vector::get_origin()))
+        continue;
 
       auto real_values = {0.001, 0.1, 0.3, 0.5, 0.7733, 0.8, 0.9999};
       for (Ruler::Real x : real_values)
         for (Ruler::Real y : real_values) {
           Ray r = Ray::from_two_points(Vector::get_origin(),
                                        pt1 + x * dir + y * dir_perp);
-          Ruler::Real k;
+          Ruler::Real k = 0;
           EXPECT_TRUE(rps.intersect(r, k)) << r << " " << rps << "\n";
           EXPECT_TRUE(rps.container().contains(r.at(k)));
         }
     }
   }
 }
+
+TEST_F(EuclidFixture, cube_intersection) {
+  Vector center(3.0, -2.0, 5.0);
+  Cube c(center, Vector(1, 1, 0), Vector(-1, 1, 1), 2.0);
+
+  for (unsigned face = 0; face < Cube::kFaceCount; face++) {
+    Vector n = c.normal(face);
+    Vector tangent_0 = c.normal((face + 2) % Cube::kFaceCount);
+    Vector tangent_1 = c.normal((face + 4) % Cube::kFaceCount);
+
+    for (Ruler::Real x : {-1.9, -0.5, 0.0, 0.3, 1.9})
+      for (Ruler::Real y : {-1.9, -0.7, 0.0, 1.2, 1.9}) {
+        Vector on_face = center + 2.0 * n + x * tangent_0 + y * tangent_1;
+        Vector outside = on_face + 10.0 * (n + 0.1 * x * tangent_1);
+
+        Ruler::Real k = 0;
+        unsigned face_idx;
+        Ray r = Ray::from_two_points(outside, on_face);
+        ASSERT_TRUE(c.intersect(r, k, face_idx)) << r << "\n";
+        EXPECT_EQ(face, face_idx) << r << "\n";
+        EXPECT_TRUE(r.at(k) == on_face) << r.at(k) << " " << on_face << "\n";
+
+        // Starting inside the cube, the entry point is behind the ray.
+        Ray inside = Ray::from_two_points(center, on_face);
+        ASSERT_TRUE(c.intersect(inside, k, face_idx));
+        EXPECT_LT(k, 0.0);
+
+        // Passing beside the face misses the cube.
+        Vector beside = on_face + (4.0 - x) * tangent_0;
+        Ray miss = Ray::from_two_points(beside + 10.0 * n, beside);
+        EXPECT_FALSE(c.intersect(miss, k, face_idx)) << miss << "\n";
+      }
+  }
+}
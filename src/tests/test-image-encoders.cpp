@@ -0,0 +1,472 @@
+#include "image-encoders.hpp"
+#include "bitops.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace ray;
+
+namespace {
+/// An image with flat areas, gradients and noise, so that the encoders get
+/// to use most of what they have.
+Bitmap make_test_image(unsigned height, unsigned width) {
+  Bitmap bmp(height, width, Color());
+  uint32_t noise = 12345;
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++) {
+      noise = noise * 1103515245 + 12345;
+      if (x < width / 4)
+        bmp.at(x, y) = Color(10, 20, 30);
+      else if (x < width / 2)
+        bmp.at(x, y) = Color(x, y, x + y);
+      else if (y % 7 < 3)
+        bmp.at(x, y) = Color(x / 3, 100 + (noise >> 30), 200);
+      else
+        bmp.at(x, y) = Color(noise >> 8, noise >> 16, noise >> 24);
+    }
+  return bmp;
+}
+
+/// The pixels of \p bmp in the order the formats store them in: from the top
+/// row down, each from right to left, as red, green and blue bytes.
+std::vector<uint8_t> get_pixels(const Bitmap &bmp) {
+  std::vector<uint8_t> pixels;
+  for (unsigned y = 0; y < bmp.height(); y++)
+    for (unsigned x = bmp.width(); x != 0; --x) {
+      const Color &c = bmp.at(x - 1, y);
+      pixels.push_back(c.red());
+      pixels.push_back(c.green());
+      pixels.push_back(c.blue());
+    }
+  return pixels;
+}
+
+uint32_t read_be(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint32_t crc32(const uint8_t *data, size_t size) {
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (unsigned k = 0; k < 8; k++)
+      crc = (crc & 1) ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+  }
+  return ~crc;
+}
+
+/// Decompresses the deflate blocks the encoders write: stored blocks, and
+/// blocks with the fixed Huffman codes.
+class Inflater {
+  const std::vector<uint8_t> &_in;
+  size_t _pos = 0;
+  unsigned _bit = 0;
+
+  unsigned get_bits(unsigned count) {
+    unsigned result = 0;
+    for (unsigned i = 0; i < count; i++) {
+      if (_pos >= _in.size())
+        return 0;
+      result |= ((_in[_pos] >> _bit) & 1) << i;
+      if (++_bit == 8) {
+        _bit = 0;
+        _pos++;
+      }
+    }
+    return result;
+  }
+
+  /// Read a Huffman code, which is stored most significant bit first.
+  unsigned get_code_bits(unsigned count) {
+    unsigned result = 0;
+    for (unsigned i = 0; i < count; i++)
+      result = (result << 1) | get_bits(1);
+    return result;
+  }
+
+  unsigned get_fixed_literal() {
+    unsigned code = get_code_bits(7);
+    if (code <= 0x17)
+      return 256 + code;
+    code = (code << 1) | get_bits(1);
+    if (code >= 0x30 && code <= 0xbf)
+      return code - 0x30;
+    if (code >= 0xc0 && code <= 0xc7)
+      return 280 + code - 0xc0;
+    code = (code << 1) | get_bits(1);
+    return 144 + code - 0x190;
+  }
+
+public:
+  explicit Inflater(const std::vector<uint8_t> &in, size_t pos)
+      : _in(in), _pos(pos) {}
+
+  /// Decompress into \p out, and return false if the data is malformed.
+  /// Leaves the position at the byte after the last block.
+  bool inflate(std::vector<uint8_t> &out) {
+    static const unsigned length_base[] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const unsigned length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                            1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                            4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const unsigned distance_base[] = {
+        1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+        33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+
+    for (bool is_final = false; !is_final;) {
+      if (_pos >= _in.size())
+        return false;
+      is_final = get_bits(1);
+      unsigned type = get_bits(2);
+      if (type == 0) {
+        if (_bit != 0) {
+          _bit = 0;
+          _pos++;
+        }
+        if (_pos + 4 > _in.size())
+          return false;
+        unsigned length = _in[_pos] | (_in[_pos + 1] << 8);
+        unsigned inverse = _in[_pos + 2] | (_in[_pos + 3] << 8);
+        _pos += 4;
+        if ((length ^ 0xffff) != inverse || _pos + length > _in.size())
+          return false;
+        out.insert(out.end(), &_in[_pos], &_in[_pos] + length);
+        _pos += length;
+      } else if (type == 1) {
+        for (;;) {
+          if (_pos >= _in.size())
+            return false;
+          unsigned symbol = get_fixed_literal();
+          if (symbol < 256) {
+            out.push_back(symbol);
+            continue;
+          }
+          if (symbol == 256)
+            break;
+          if (symbol > 285)
+            return false;
+          unsigned length = length_base[symbol - 257] +
+                            get_bits(length_extra[symbol - 257]);
+          unsigned distance_symbol = get_code_bits(5);
+          if (distance_symbol >= 30)
+            return false;
+          unsigned distance = distance_base[distance_symbol] +
+                              get_bits(distance_symbol < 4
+                                           ? 0
+                                           : distance_symbol / 2 - 1);
+          if (distance > out.size())
+            return false;
+          for (unsigned i = 0; i < length; i++)
+            out.push_back(out[out.size() - distance]);
+        }
+      } else {
+        return false;
+      }
+    }
+    if (_bit != 0)
+      _pos++;
+    return true;
+  }
+
+  size_t position() const { return _pos; }
+};
+
+/// Decode the PNG file \p file, checking every checksum.  Returns false if
+/// it is malformed.
+bool decode_png(const std::string &file_str, unsigned &width,
+                unsigned &height, std::vector<uint8_t> &pixels) {
+  std::vector<uint8_t> file(file_str.begin(), file_str.end());
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  if (file.size() < 8 || !std::equal(signature, signature + 8, file.begin()))
+    return false;
+
+  std::vector<uint8_t> zlib;
+  bool seen_end = false;
+  for (size_t pos = 8; pos < file.size();) {
+    if (seen_end || pos + 12 > file.size())
+      return false;
+    uint32_t size = read_be(&file[pos]);
+    if (pos + 12 + size > file.size())
+      return false;
+    std::string type(&file[pos + 4], &file[pos + 8]);
+    const uint8_t *data = &file[pos + 8];
+    if (crc32(&file[pos + 4], size + 4) != read_be(data + size))
+      return false;
+    if (type == "IHDR") {
+      if (size != 13 || data[8] != 8 || data[9] != 2 || data[12] != 0)
+        return false;
+      width = read_be(data);
+      height = read_be(data + 4);
+    } else if (type == "IDAT") {
+      zlib.insert(zlib.end(), data, data + size);
+    } else if (type == "IEND") {
+      seen_end = true;
+    }
+    pos += 12 + size;
+  }
+  if (!seen_end || zlib.size() < 6)
+    return false;
+
+  if ((zlib[0] & 0x0f) != 8 || ((zlib[0] << 8) | zlib[1]) % 31 != 0)
+    return false;
+  Inflater inflater(zlib, 2);
+  std::vector<uint8_t> filtered;
+  if (!inflater.inflate(filtered) || inflater.position() + 4 != zlib.size())
+    return false;
+  uint32_t a = 1, b = 0;
+  for (uint8_t byte : filtered) {
+    a = (a + byte) % 65521;
+    b = (b + a) % 65521;
+  }
+  if (((b << 16) | a) != read_be(&zlib[inflater.position()]))
+    return false;
+
+  unsigned row_size = width * 3;
+  if (filtered.size() != uint64_t(row_size + 1) * height)
+    return false;
+  pixels.assign(uint64_t(row_size) * height, 0);
+  for (unsigned y = 0; y < height; y++) {
+    const uint8_t *in = &filtered[y * uint64_t(row_size + 1)];
+    uint8_t *row = &pixels[y * uint64_t(row_size)];
+    const uint8_t *prior = y == 0 ? nullptr : row - row_size;
+    for (unsigned i = 0; i < row_size; i++) {
+      int a = i >= 3 ? row[i - 3] : 0, b = prior ? prior[i] : 0;
+      int c = i >= 3 && prior ? prior[i - 3] : 0;
+      int predicted;
+      switch (in[0]) {
+      case 0:
+        predicted = 0;
+        break;
+      case 1:
+        predicted = a;
+        break;
+      case 2:
+        predicted = b;
+        break;
+      case 3:
+        predicted = (a + b) / 2;
+        break;
+      case 4: {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        break;
+      }
+      default:
+        return false;
+      }
+      row[i] = in[1 + i] + predicted;
+    }
+  }
+  return true;
+}
+
+/// Decode the QOI file \p file.  Returns false if it is malformed.
+bool decode_qoi(const std::string &file_str, unsigned &width,
+                unsigned &height, std::vector<uint8_t> &pixels) {
+  std::vector<uint8_t> file(file_str.begin(), file_str.end());
+  if (file.size() < 22 || std::string(file.begin(), file.begin() + 4) != "qoif")
+    return false;
+  width = read_be(&file[4]);
+  height = read_be(&file[8]);
+  if (file[12] != 3)
+    return false;
+
+  uint8_t index[64][4] = {};
+  uint8_t r = 0, g = 0, b = 0, a = 255;
+  uint64_t pixel_count = uint64_t(width) * height;
+  size_t pos = 14, end = file.size() - 8;
+  pixels.clear();
+  while (pixels.size() < pixel_count * 3) {
+    if (pos >= end)
+      return false;
+    uint8_t op = file[pos++];
+    unsigned run = 1;
+    if (op == 0xfe) {
+      r = file[pos];
+      g = file[pos + 1];
+      b = file[pos + 2];
+      pos += 3;
+    } else if (op == 0xff) {
+      r = file[pos];
+      g = file[pos + 1];
+      b = file[pos + 2];
+      a = file[pos + 3];
+      pos += 4;
+    } else if ((op >> 6) == 0) {
+      r = index[op][0];
+      g = index[op][1];
+      b = index[op][2];
+      a = index[op][3];
+    } else if ((op >> 6) == 1) {
+      r += ((op >> 4) & 3) - 2;
+      g += ((op >> 2) & 3) - 2;
+      b += (op & 3) - 2;
+    } else if ((op >> 6) == 2) {
+      int dg = (op & 0x3f) - 32;
+      uint8_t next = file[pos++];
+      r += dg + (next >> 4) - 8;
+      g += dg;
+      b += dg + (next & 0xf) - 8;
+    } else {
+      run = (op & 0x3f) + 1;
+    }
+    unsigned h = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+    index[h][0] = r;
+    index[h][1] = g;
+    index[h][2] = b;
+    index[h][3] = a;
+    for (unsigned i = 0; i < run; i++) {
+      pixels.push_back(r);
+      pixels.push_back(g);
+      pixels.push_back(b);
+    }
+  }
+  const uint8_t end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  return pos == end && pixels.size() == pixel_count * 3 &&
+         std::equal(end_marker, end_marker + 8, file.begin() + end);
+}
+
+std::string encode(const Bitmap &bmp, ImageFormatTy format,
+                   ThreadPool &pool) {
+  std::ostringstream out;
+  EXPECT_TRUE(write_image(bmp, format, out, pool));
+  return out.str();
+}
+}
+
+TEST(ImageEncodersTest, bmp_matches_write) {
+  ThreadPool pool(2, false);
+  Bitmap bmp = make_test_image(9, 13);
+  std::ostringstream out;
+  bmp.write(out);
+  EXPECT_EQ(encode(bmp, ImageFormatTy::bmp, pool), out.str());
+}
+
+TEST(ImageEncodersTest, png_round_trip) {
+  ThreadPool pool(3, false);
+  // The larger images are compressed in more than one band.
+  for (unsigned width : {1u, 2u, 7u, 64u, 1000u}) {
+    Bitmap bmp = make_test_image(width == 1000 ? 800 : 37, width);
+    for (ImageFormatTy format :
+         {ImageFormatTy::png, ImageFormatTy::png_stored}) {
+      std::string file = encode(bmp, format, pool);
+      unsigned decoded_width = 0, decoded_height = 0;
+      std::vector<uint8_t> pixels;
+      ASSERT_TRUE(decode_png(file, decoded_width, decoded_height, pixels))
+          << width;
+      EXPECT_EQ(decoded_width, bmp.width());
+      EXPECT_EQ(decoded_height, bmp.height());
+      EXPECT_TRUE(pixels == get_pixels(bmp)) << width;
+    }
+  }
+}
+
+TEST(ImageEncodersTest, png_compresses) {
+  ThreadPool pool(2, false);
+  Bitmap bmp(300, 400, Color(50, 60, 70));
+  for (unsigned x = 0; x < 400; x++)
+    for (unsigned y = 100; y < 200; y++)
+      bmp.at(x, y) = Color(x, y, 0);
+
+  std::string stored = encode(bmp, ImageFormatTy::png_stored, pool);
+  std::string compressed = encode(bmp, ImageFormatTy::png, pool);
+  EXPECT_GT(stored.size(), 400u * 300 * 3);
+  EXPECT_LT(compressed.size() * 20, stored.size());
+}
+
+TEST(ImageEncodersTest, qoi_round_trip) {
+  ThreadPool pool(3, false);
+  for (unsigned width : {1u, 3u, 64u, 1000u}) {
+    Bitmap bmp = make_test_image(width == 1000 ? 2500 : 41, width);
+    std::string file = encode(bmp, ImageFormatTy::qoi, pool);
+    unsigned decoded_width = 0, decoded_height = 0;
+    std::vector<uint8_t> pixels;
+    ASSERT_TRUE(decode_qoi(file, decoded_width, decoded_height, pixels))
+        << width;
+    EXPECT_EQ(decoded_width, bmp.width());
+    EXPECT_EQ(decoded_height, bmp.height());
+    EXPECT_TRUE(pixels == get_pixels(bmp)) << width;
+    if (width == 1000) {
+      EXPECT_LT(file.size(), pixels.size());
+    }
+  }
+}
+
+TEST(ImageEncodersTest, empty_image) {
+  ThreadPool pool(2, false);
+  Bitmap bmp(0, 0, Color());
+  for (ImageFormatTy format : {ImageFormatTy::png, ImageFormatTy::png_stored,
+                               ImageFormatTy::qoi}) {
+    std::string file = encode(bmp, format, pool);
+    unsigned width = 1, height = 1;
+    std::vector<uint8_t> pixels;
+    EXPECT_TRUE(format == ImageFormatTy::qoi
+                    ? decode_qoi(file, width, height, pixels)
+                    : decode_png(file, width, height, pixels));
+    EXPECT_EQ(width, 0u);
+    EXPECT_EQ(height, 0u);
+  }
+}
+
+TEST(ImageEncodersTest, failed_stream_fails_write) {
+  ThreadPool pool(2, false);
+  Bitmap bmp = make_test_image(9, 13);
+  for (ImageFormatTy format : {ImageFormatTy::bmp, ImageFormatTy::png_stored,
+                               ImageFormatTy::png, ImageFormatTy::qoi}) {
+    std::ostringstream out;
+    out.setstate(std::ios::badbit);
+    EXPECT_FALSE(write_image(bmp, format, out, pool));
+  }
+}
+
+TEST(ImageEncodersTest, streamed_bands_decode_to_image) {
+  ThreadPool pool(3, false);
+  Bitmap bmp = make_test_image(700, 1000);
+
+  // Uneven bands, the middle one large enough to be split between threads.
+  for (ImageFormatTy format : {ImageFormatTy::png, ImageFormatTy::png_stored,
+                               ImageFormatTy::qoi, ImageFormatTy::bmp}) {
+    std::ostringstream out;
+    std::unique_ptr<ImageSink> writer = create_image_writer(format, out, pool);
+    ASSERT_TRUE(writer->begin(bmp.width(), bmp.height()));
+    unsigned first_row = 0;
+    for (unsigned band_height : {1u, 650u, 49u}) {
+      Bitmap band(band_height, bmp.width(), Color());
+      for (unsigned y = 0; y < band_height; y++)
+        for (unsigned x = 0; x < bmp.width(); x++)
+          band.at(x, y) = bmp.at(x, first_row + y);
+      ASSERT_TRUE(writer->write_rows(band, first_row));
+      first_row += band_height;
+    }
+    ASSERT_TRUE(writer->end());
+    std::string file = out.str();
+
+    unsigned width = 0, height = 0;
+    std::vector<uint8_t> pixels;
+    if (format == ImageFormatTy::bmp) {
+      // The rows go from the top down, which a negative height says.
+      ASSERT_EQ(file.size(), 54 + 3000u * 700);
+      width = Bitops::decode_le((const uint8_t *)&file[18]);
+      height = -int32_t(Bitops::decode_le((const uint8_t *)&file[22]));
+      for (unsigned i = 54; i < file.size(); i += 3) {
+        pixels.push_back(file[i + 2]);
+        pixels.push_back(file[i + 1]);
+        pixels.push_back(file[i]);
+      }
+    } else if (format == ImageFormatTy::qoi) {
+      ASSERT_TRUE(decode_qoi(file, width, height, pixels));
+    } else {
+      ASSERT_TRUE(decode_png(file, width, height, pixels));
+    }
+    EXPECT_EQ(width, bmp.width());
+    EXPECT_EQ(height, bmp.height());
+    EXPECT_TRUE(pixels == get_pixels(bmp));
+  }
+}
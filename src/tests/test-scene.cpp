@@ -0,0 +1,654 @@
+#include "image-encoders.hpp"
+#include "objects.hpp"
+#include "scene.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+using namespace ray;
+
+namespace {
+class SceneFixture : public ::testing::Test {
+protected:
+  std::mt19937 _rng;
+  std::vector<Ray> _rays;
+
+  Ruler::Real random(Ruler::Real begin, Ruler::Real end) {
+    return std::uniform_real_distribution<Ruler::Real>(begin, end)(_rng);
+  }
+
+  Vector random_vector(Ruler::Real begin, Ruler::Real end) {
+    return Vector(random(begin, end), random(begin, end), random(begin, end));
+  }
+
+  SceneFixture() : _rng(42) {
+    for (int i = 0; i < 500; i++)
+      _rays.push_back(Ray::from_two_points(random_vector(-150, 150),
+                                           random_vector(-50, 50)));
+  }
+
+  std::unique_ptr<Object> random_box(const Scene &s) {
+    Vector normal_a = random_vector(-1, 1);
+    Vector normal_b = normal_a.cross_product(random_vector(-1, 1));
+    return make_unique<BoxObj>(s, random_vector(-100, 100), normal_a, normal_b,
+                               random(0.5, 5));
+  }
+
+  static bool same_color(const Color &c0, const Color &c1) {
+    return c0.red() == c1.red() && c0.green() == c1.green() &&
+           c0.blue() == c1.blue();
+  }
+
+  static bool same_color(const HdrColor &c0, const HdrColor &c1) {
+    return c0.red() == c1.red() && c0.green() == c1.green() &&
+           c0.blue() == c1.blue();
+  }
+};
+}
+
+TEST_F(SceneFixture, matches_brute_force) {
+  Scene s;
+  std::vector<const Object *> objects;
+
+  auto add = [&](std::unique_ptr<Object> o) {
+    objects.push_back(o.get());
+    s.add_object(std::move(o));
+  };
+
+  for (int i = 0; i < 200; i++)
+    add(random_box(s));
+  for (int i = 0; i < 50; i++)
+    add(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                        random(0.5, 5)));
+  add(make_unique<RefractiveBoxObj>(s, Vector::get_origin(), Vector::get_i(),
+                                    Vector::get_j(), 10, 1.3));
+  Plane floor(Vector::get_k(), Vector::get_k() * -60);
+  add(make_unique<InfinitePlane>(s, floor, Vector::get_i(), 10));
+  add(make_unique<SkyObj>(s));
+
+  ThreadContext ctx(s.object_count(), false);
+  s.init_object_ids(ctx);
+
+  for (ObjectStorageTy storage :
+       {ObjectStorageTy::per_object, ObjectStorageTy::type_batched}) {
+    s.set_object_storage(storage);
+    s.build_bvh();
+
+    for (auto &r : _rays) {
+      double smallest_k = Ruler::infinity();
+      HdrColor expected;
+      for (const Object *o : objects) {
+        double k;
+        HdrColor c;
+        if (o->incident(ctx, r, smallest_k, k, c) && k < smallest_k &&
+            k >= 0.0) {
+          smallest_k = k;
+          expected = c;
+        }
+      }
+
+      EXPECT_TRUE(same_color(expected, s.render_pixel(r, ctx))) << r << "\n";
+    }
+  }
+}
+
+TEST_F(SceneFixture, miss_shader_is_order_independent) {
+  // The same boxes, with the sky added first in one scene and last in the
+  // other.
+  Scene sky_first, sky_last;
+  sky_first.add_object(make_unique<SkyObj>(sky_first, true));
+
+  std::mt19937 rng_copy = _rng;
+  for (int i = 0; i < 50; i++)
+    sky_first.add_object(random_box(sky_first));
+  _rng = rng_copy;
+  for (int i = 0; i < 50; i++)
+    sky_last.add_object(random_box(sky_last));
+  sky_last.add_object(make_unique<SkyObj>(sky_last, true));
+
+  ThreadContext ctx_first(sky_first.object_count(), false);
+  sky_first.init_object_ids(ctx_first);
+  sky_first.build_bvh();
+
+  ThreadContext ctx_last(sky_last.object_count(), false);
+  sky_last.init_object_ids(ctx_last);
+  sky_last.build_bvh();
+
+  unsigned sky_count = 0;
+  for (auto &r : _rays) {
+    HdrColor first = sky_first.render_pixel(r, ctx_first);
+    EXPECT_TRUE(same_color(first, sky_last.render_pixel(r, ctx_last))) << r;
+    sky_count += same_color(first, HdrColor::create_white());
+  }
+
+  // Both hits and misses should have been exercised.
+  EXPECT_GT(sky_count, 0u);
+  EXPECT_LT(sky_count, _rays.size());
+}
+
+TEST_F(SceneFixture, occlusion_matches_closest_hit) {
+  Scene s;
+  std::vector<const Object *> objects;
+
+  auto add = [&](std::unique_ptr<Object> o) {
+    objects.push_back(o.get());
+    s.add_object(std::move(o));
+  };
+
+  for (int i = 0; i < 100; i++)
+    add(random_box(s));
+  for (int i = 0; i < 100; i++)
+    add(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                        random(0.5, 5)));
+  Plane floor(Vector::get_k(), Vector::get_k() * -60);
+  add(make_unique<InfinitePlane>(s, floor, Vector::get_i(), 10));
+  s.add_object(make_unique<SkyObj>(s));
+
+  ThreadContext ctx(s.object_count(), false);
+  s.init_object_ids(ctx);
+
+  std::vector<double> closest_k;
+  s.set_object_storage(ObjectStorageTy::per_object);
+  s.build_bvh();
+  for (auto &r : _rays) {
+    closest_k.push_back(Ruler::infinity());
+    for (const Object *o : objects) {
+      double k;
+      HdrColor c;
+      if (o->incident(ctx, r, closest_k.back(), k, c) &&
+          k < closest_k.back() && k >= 0.0)
+        closest_k.back() = k;
+    }
+  }
+
+  for (ObjectStorageTy storage :
+       {ObjectStorageTy::per_object, ObjectStorageTy::type_batched}) {
+    s.set_object_storage(storage);
+    s.build_bvh();
+
+    std::mt19937 rng(7);
+    unsigned occluded_count = 0;
+    for (unsigned i = 0; i < _rays.size(); i++) {
+      double max_k = std::uniform_real_distribution<double>(0, 2)(rng);
+      bool expected = closest_k[i] < max_k;
+      EXPECT_EQ(expected, s.occluded(_rays[i], max_k, ctx)) << _rays[i];
+      EXPECT_FALSE(s.occluded(_rays[i], 0.0, ctx));
+      occluded_count += expected;
+    }
+
+    EXPECT_GT(occluded_count, 0u);
+    EXPECT_LT(occluded_count, _rays.size());
+  }
+}
+
+TEST_F(SceneFixture, packets_match_single_rays) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<RefractiveBoxObj>(s, Vector::get_origin(),
+                                             Vector::get_i(), Vector::get_j(),
+                                             10, 1.3));
+  Plane floor(Vector::get_k(), Vector::get_k() * -60);
+  s.add_object(make_unique<InfinitePlane>(s, floor, Vector::get_i(), 10));
+  s.add_object(make_unique<SkyObj>(s));
+
+  ThreadContext ctx(s.object_count(), false);
+  s.init_object_ids(ctx);
+
+  for (ObjectStorageTy storage :
+       {ObjectStorageTy::per_object, ObjectStorageTy::type_batched}) {
+    s.set_object_storage(storage);
+    s.build_bvh();
+
+    unsigned coherent_count = 0;
+    for (int packet_idx = 0; packet_idx < 200; packet_idx++) {
+      // Narrow bundles of rays, like the primary rays of a block of pixels,
+      // and the occasional bundle that straddles an axis.
+      Vector origin = random_vector(-150, 150);
+      Vector target = random_vector(-50, 50);
+      Ruler::Real spread = packet_idx % 10 ? 0.5 : 100.0;
+
+      RayPacket packet;
+      unsigned size = 1 + packet_idx % RayPacket::kMaxSize;
+      for (unsigned i = 0; i < size; i++)
+        packet.push_back(Ray::from_two_points(
+            origin, target + random_vector(-spread, spread)));
+      coherent_count += packet.is_coherent();
+
+      HdrColor out[RayPacket::kMaxSize];
+      s.render_packet(packet, ctx, out);
+      for (unsigned i = 0; i < size; i++)
+        EXPECT_TRUE(same_color(s.render_pixel(packet.ray(i), ctx), out[i]))
+            << packet.ray(i) << "\n";
+    }
+
+    EXPECT_GT(coherent_count, 100u);
+    EXPECT_LT(coherent_count, 200u);
+  }
+}
+
+TEST_F(SceneFixture, snap_is_independent_of_thread_count) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // Not a multiple of the tile size, to exercise the partial tiles.
+  const unsigned width = 150, height = 90;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  Bitmap expected = c.snap(s, 1);
+  EXPECT_EQ(c.render_stats().busy_seconds.size(), 1u);
+  EXPECT_EQ(c.render_stats().stolen_counts[0], 0u);
+
+  for (unsigned thread_count : {2u, 7u, 32u}) {
+    Bitmap bmp = c.snap(s, thread_count);
+    for (unsigned x = 0; x < width; x++)
+      for (unsigned y = 0; y < height; y++)
+        ASSERT_TRUE(same_color(expected.at(x, y), bmp.at(x, y)))
+            << thread_count << " threads, pixel " << x << ", " << y << "\n";
+
+    const RenderStats &stats = c.render_stats();
+    ASSERT_EQ(stats.busy_seconds.size(), thread_count);
+    unsigned tile_count = 0;
+    for (unsigned i = 0; i < thread_count; i++)
+      tile_count += stats.tile_counts[i];
+    EXPECT_EQ(tile_count, 15u);
+  }
+}
+
+TEST_F(SceneFixture, crop_is_part_of_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // An odd size, so that the last column and row are never rendered.
+  const unsigned width = 151, height = 91;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  Bitmap expected = c.snap(s, 2);
+
+  struct {
+    unsigned x, y, width, height;
+  } crops[] = {{0, 0, 151, 91}, {0, 0, 40, 40},  {37, 11, 50, 70},
+               {120, 60, 31, 31}, {150, 0, 1, 91}, {5, 90, 100, 1}};
+  for (const auto &crop : crops) {
+    c.set_crop(crop.x, crop.y, crop.width, crop.height);
+    Bitmap bmp = c.snap(s, 2);
+    ASSERT_EQ(bmp.width(), crop.width);
+    ASSERT_EQ(bmp.height(), crop.height);
+    for (unsigned x = 0; x < crop.width; x++)
+      for (unsigned y = 0; y < crop.height; y++)
+        ASSERT_TRUE(same_color(expected.at(crop.x + x, crop.y + y),
+                               bmp.at(x, y)))
+            << "crop at " << crop.x << ", " << crop.y << ", pixel " << x
+            << ", " << y << "\n";
+  }
+}
+
+TEST_F(SceneFixture, progressive_snap_refines_to_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  const unsigned width = 150, height = 90;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  Bitmap expected = c.snap(s, 3);
+
+  // Without a budget only the preview runs.  Each sample colors the 8x8
+  // block to its bottom right, with the blocks aligned to the tiles.
+  std::vector<unsigned> spacings;
+  auto on_pass = [&](const Bitmap &, unsigned spacing) {
+    spacings.push_back(spacing);
+  };
+  Bitmap preview = c.snap_progressive(s, 3, 0.0, on_pass);
+  EXPECT_EQ(spacings, std::vector<unsigned>({8}));
+  EXPECT_EQ(c.render_stats().sample_spacing, 8u);
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      ASSERT_TRUE(same_color(expected.at(x - x % 8, y - y % 8),
+                             preview.at(x, y)))
+          << "pixel " << x << ", " << y << "\n";
+
+  // With plenty of time the passes get down to one sample per pixel.
+  spacings.clear();
+  Bitmap full = c.snap_progressive(s, 3, 1000.0, on_pass);
+  EXPECT_EQ(spacings, std::vector<unsigned>({8, 4, 2, 1}));
+  EXPECT_EQ(c.render_stats().sample_spacing, 1u);
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      ASSERT_TRUE(same_color(expected.at(x, y), full.at(x, y)))
+          << "pixel " << x << ", " << y << "\n";
+}
+
+TEST_F(SceneFixture, supersampling_only_touches_edges) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s, true));
+
+  const unsigned width = 150, height = 90;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  Bitmap expected = c.snap(s, 3);
+  EXPECT_EQ(c.render_stats().samples_per_pixel, 1.0);
+
+  const unsigned threshold = 32;
+  auto differ = [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+    const Color &c0 = expected.at(x0, y0), &c1 = expected.at(x1, y1);
+    return std::abs(c0.red() - c1.red()) > threshold ||
+           std::abs(c0.green() - c1.green()) > threshold ||
+           std::abs(c0.blue() - c1.blue()) > threshold;
+  };
+
+  c.set_supersampling(4, threshold);
+  Bitmap bmp = c.snap(s, 3);
+  unsigned edge_count = 0;
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++) {
+      bool is_edge = (x > 0 && differ(x, y, x - 1, y)) ||
+                     (x + 1 < width && differ(x, y, x + 1, y)) ||
+                     (y > 0 && differ(x, y, x, y - 1)) ||
+                     (y + 1 < height && differ(x, y, x, y + 1));
+      edge_count += is_edge;
+      if (!is_edge) {
+        ASSERT_TRUE(same_color(expected.at(x, y), bmp.at(x, y)))
+            << "pixel " << x << ", " << y << "\n";
+      }
+    }
+
+  // The scene is mostly uniform sky, so most pixels keep their one sample.
+  ASSERT_GT(edge_count, 0u);
+  EXPECT_LT(edge_count, width * height / 2);
+  EXPECT_DOUBLE_EQ(c.render_stats().samples_per_pixel,
+                   1.0 + 4.0 * edge_count / (width * height));
+}
+
+TEST_F(SceneFixture, tile_order_does_not_change_image) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // Wide enough that the grid of tiles isn't square.
+  const unsigned width = 250, height = 70;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  c.set_tile_order(TileOrderTy::column_major);
+  c.set_supersampling(4);
+  Bitmap expected = c.snap(s, 3);
+
+  for (TileOrderTy order : {TileOrderTy::morton, TileOrderTy::hilbert}) {
+    c.set_tile_order(order);
+    Bitmap bmp = c.snap(s, 3);
+    for (unsigned x = 0; x < width; x++)
+      for (unsigned y = 0; y < height; y++)
+        ASSERT_TRUE(same_color(expected.at(x, y), bmp.at(x, y)))
+            << "pixel " << x << ", " << y << "\n";
+  }
+}
+
+TEST_F(SceneFixture, async_snap_matches_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  const unsigned width = 150, height = 90;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  ThreadPool pool(3);
+  Bitmap expected = c.snap(s, pool);
+
+  std::unique_ptr<RenderHandle> handle = c.snap_async(s, pool);
+  handle->wait();
+  EXPECT_TRUE(handle->is_stopped());
+  EXPECT_EQ(handle->progress(), 1.0);
+
+  RenderResult result = handle->take_result();
+  EXPECT_TRUE(result.is_complete);
+  EXPECT_GE(result.tile_columns * result.tile_size, width);
+  EXPECT_GE(result.tile_rows * result.tile_size, height);
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++) {
+      ASSERT_TRUE(result.is_pixel_done(x, y));
+      ASSERT_TRUE(same_color(expected.at(x, y), result.image.at(x, y)))
+          << "pixel " << x << ", " << y << "\n";
+    }
+}
+
+TEST_F(SceneFixture, cancelled_snap_keeps_finished_tiles) {
+  Scene s;
+  for (int i = 0; i < 200; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  const unsigned width = 640, height = 640;
+  Camera c(6.0, width, height, 80, Vector::get_origin());
+  ThreadPool pool(1);
+  Bitmap expected = c.snap(s, pool);
+
+  // Cancel once some of the tiles are done.
+  std::unique_ptr<RenderHandle> handle = c.snap_async(s, pool);
+  while (handle->progress() == 0.0 && !handle->wait_for(0.0001))
+    ;
+  handle->cancel();
+  EXPECT_TRUE(handle->wait_for(60.0));
+
+  RenderResult result = handle->take_result();
+  unsigned done_count = 0;
+  for (bool done : result.tile_done)
+    done_count += done;
+  EXPECT_GT(done_count, 0u);
+  EXPECT_EQ(result.is_complete, done_count == result.tile_done.size());
+
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      if (result.is_pixel_done(x, y)) {
+        ASSERT_TRUE(same_color(expected.at(x, y), result.image.at(x, y)))
+            << "pixel " << x << ", " << y << "\n";
+      }
+}
+
+TEST_F(SceneFixture, snap_cancelled_while_supersampling_keeps_finished_tiles) {
+  Scene s;
+  for (int i = 0; i < 200; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // With no threshold nearly every pixel is resampled, so that supersampling
+  // takes a while.
+  const unsigned width = 320, height = 320;
+  Camera c(6.0, width, height, 40, Vector::get_origin());
+  c.set_supersampling(16, 0);
+  ThreadPool pool(1);
+  Bitmap expected = c.snap(s, pool);
+
+  // Cancel once the main pass is done and some of the tiles are supersampled.
+  std::unique_ptr<RenderHandle> handle = c.snap_async(s, pool);
+  while (handle->progress() <= 0.5 && !handle->wait_for(0.0001))
+    ;
+  handle->cancel();
+  EXPECT_TRUE(handle->wait_for(60.0));
+
+  RenderResult result = handle->take_result();
+  unsigned done_count = 0;
+  for (bool done : result.tile_done)
+    done_count += done;
+  unsigned tile_count = result.tile_done.size();
+  EXPECT_GT(done_count, 0u);
+  EXPECT_LT(done_count, tile_count);
+  EXPECT_FALSE(result.is_complete);
+  EXPECT_DOUBLE_EQ(handle->progress(), double(tile_count + done_count) /
+                                           (2 * tile_count));
+
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      if (result.is_pixel_done(x, y)) {
+        ASSERT_TRUE(same_color(expected.at(x, y), result.image.at(x, y)))
+            << "pixel " << x << ", " << y << "\n";
+      }
+}
+
+TEST_F(SceneFixture, dropping_handle_cancels_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  Camera c(6.0, 640, 640, 80, Vector::get_origin());
+  ThreadPool pool(2);
+  c.snap_async(s, pool);
+
+  // The pool is free again once the handle is gone.
+  Bitmap bmp = c.snap(s, pool);
+  EXPECT_EQ(bmp.width(), 640u);
+}
+
+TEST_F(SceneFixture, snap_into_mapped_file_matches_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // An odd size, so that the last column and row are never rendered.
+  const unsigned width = 151, height = 91;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  Bitmap expected = c.snap(s, 2);
+
+  std::string path =
+      "/tmp/ray-test-snap-" + std::to_string(getpid()) + ".bmp";
+  std::unique_ptr<Bitmap> mapped =
+      Bitmap::create_mapped_file(path.c_str(), height, width);
+  ASSERT_TRUE(mapped != nullptr);
+  c.snap_into(s, *mapped, 2);
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      ASSERT_TRUE(same_color(expected.at(x, y), mapped->at(x, y)))
+          << "pixel " << x << ", " << y << "\n";
+  mapped.reset();
+  unlink(path.c_str());
+}
+
+TEST_F(SceneFixture, hdr_snap_tone_maps_to_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 100; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  const unsigned width = 151, height = 91;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  c.set_supersampling(4);
+  ThreadPool pool(2, false);
+  Bitmap expected = c.snap(s, pool);
+  HdrBitmap hdr = c.snap_hdr(s, pool);
+  ASSERT_EQ(hdr.width(), width);
+  ASSERT_EQ(hdr.height(), height);
+
+  // Supersampled pixels are averages, so some of them fall between the 8 bit
+  // levels.
+  unsigned between_levels_count = 0;
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++) {
+      ASSERT_TRUE(same_color(expected.at(x, y), hdr.at(x, y).to_color()))
+          << "pixel " << x << ", " << y << "\n";
+      float red = hdr.at(x, y).red() * 255.0f;
+      between_levels_count += std::fabs(red - std::round(red)) > 0.01f;
+    }
+  EXPECT_GT(between_levels_count, 0u);
+}
+
+namespace {
+/// An ImageSink that fails once it has been given \c row_limit rows.
+class FailingSink : public ImageSink {
+public:
+  unsigned row_limit;
+  unsigned row_count = 0;
+  bool is_ended = false;
+
+  explicit FailingSink(unsigned row_limit) : row_limit(row_limit) {}
+
+  bool begin(unsigned, unsigned) override { return true; }
+  bool write_rows(const Bitmap &band, unsigned first_row) override {
+    EXPECT_EQ(first_row, row_count);
+    row_count += band.height();
+    return row_count < row_limit;
+  }
+  bool end() override {
+    is_ended = true;
+    return true;
+  }
+};
+}
+
+TEST_F(SceneFixture, streaming_snap_matches_snap) {
+  Scene s;
+  for (int i = 0; i < 100; i++)
+    s.add_object(random_box(s));
+  for (int i = 0; i < 50; i++)
+    s.add_object(make_unique<SphericalMirrorObj>(s, random_vector(-100, 100),
+                                                 random(0.5, 5)));
+  s.add_object(make_unique<SkyObj>(s));
+
+  // Tall enough for several bands, and odd so that the last row is never
+  // rendered.
+  const unsigned width = 70, height = 301;
+  Camera c(6.0, width, height, 20, Vector::get_origin());
+  ThreadPool pool(2, false);
+  for (unsigned samples : {1u, 4u}) {
+    c.set_supersampling(samples);
+    Bitmap expected = c.snap(s, pool);
+
+    Bitmap bmp(height, width, Color());
+    BitmapSink sink(bmp);
+    ASSERT_TRUE(c.snap_streaming(s, pool, sink));
+    for (unsigned x = 0; x < width; x++)
+      for (unsigned y = 0; y < height; y++)
+        ASSERT_TRUE(same_color(expected.at(x, y), bmp.at(x, y)))
+            << samples << " samples, pixel " << x << ", " << y << "\n";
+    EXPECT_GE(c.render_stats().samples_per_pixel, 1.0);
+  }
+
+  // A writer with a pool of its own writes each band while the next one
+  // renders, and writes the same file as when given the whole image.
+  c.set_supersampling(1);
+  ThreadPool encode_pool(2, false);
+  std::ostringstream streamed, whole;
+  std::unique_ptr<ImageSink> writer =
+      create_image_writer(ImageFormatTy::bmp, streamed, encode_pool);
+  ASSERT_TRUE(c.snap_streaming(s, pool, *writer));
+  Bitmap expected = c.snap(s, pool);
+  writer = create_image_writer(ImageFormatTy::bmp, whole, encode_pool);
+  ASSERT_TRUE(writer->begin(width, height));
+  ASSERT_TRUE(writer->write_rows(expected, 0));
+  ASSERT_TRUE(writer->end());
+  EXPECT_TRUE(streamed.str() == whole.str());
+
+  // A sink that fails stops the render.
+  FailingSink failing(1);
+  EXPECT_FALSE(c.snap_streaming(s, pool, failing));
+  EXPECT_LT(failing.row_count, height);
+  EXPECT_FALSE(failing.is_ended);
+
+  // The crop is left as it was.
+  Bitmap after = c.snap(s, pool);
+  EXPECT_EQ(after.height(), height);
+}
@@ -0,0 +1,88 @@
+#include "sphere-array.hpp"
+
+#include "gtest/gtest.h"
+
+#include <random>
+
+using namespace ray;
+
+namespace {
+/// Both precisions are tested regardless of which one Ruler::Real is, since
+/// the two kernels are separate code.
+template <typename RealTy> class SphereArrayFixture : public ::testing::Test {
+protected:
+  typedef RealTy Real;
+  typedef RulerT<Real> Ruler;
+  typedef VectorT<Real> Vector;
+  typedef RayT<Real> Ray;
+  typedef SphereT<Real> Sphere;
+  typedef SphereArrayT<Real> SphereArray;
+
+  std::mt19937 _rng;
+
+  Real random(Real begin, Real end) {
+    return std::uniform_real_distribution<Real>(begin, end)(_rng);
+  }
+
+  Vector random_vector(Real begin, Real end) {
+    return Vector(random(begin, end), random(begin, end), random(begin, end));
+  }
+
+  SphereArrayFixture() : _rng(42) {}
+};
+
+typedef ::testing::Types<float, double> RealTypes;
+TYPED_TEST_CASE(SphereArrayFixture, RealTypes);
+}
+
+TYPED_TEST(SphereArrayFixture, matches_scalar_intersect) {
+  typedef typename TestFixture::Real Real;
+  typedef typename TestFixture::Ruler Ruler;
+  typedef typename TestFixture::Ray Ray;
+  typedef typename TestFixture::Sphere Sphere;
+  typedef typename TestFixture::SphereArray SphereArray;
+
+  // Not a multiple of the width, to exercise the padding.
+  std::vector<Sphere> spheres;
+  SphereArray array;
+  for (int i = 0; i < 103; i++) {
+    spheres.emplace_back(this->random_vector(-20, 20), this->random(0.5, 8));
+    array.push_back(spheres.back());
+  }
+  ASSERT_EQ(array.size(), spheres.size());
+
+  unsigned hit_count = 0;
+  for (int ray_idx = 0; ray_idx < 200; ray_idx++) {
+    Ray r = Ray::from_two_points(this->random_vector(-30, 30),
+                                 this->random_vector(-5, 5));
+    typename SphereArray::RayConstants rc(r);
+    Real max_k = this->random(0, 60);
+
+    for (unsigned first = 0; first < spheres.size();
+         first += SphereArray::kWidth) {
+      unsigned count = spheres.size() - first;
+      if (count > SphereArray::kWidth)
+        count = SphereArray::kWidth;
+      Real ks[SphereArray::kWidth];
+      unsigned hits = array.intersect(rc, first, count, max_k, ks);
+
+      for (unsigned lane = 0; lane < SphereArray::kWidth; lane++) {
+        Real k;
+        bool expected = lane < count &&
+                        spheres[first + lane].intersect(r, k) &&
+                        !Ruler::is_negative(k) && k < max_k;
+        ASSERT_EQ(expected, bool(hits & (1u << lane)))
+            << r << " sphere " << first + lane << "\n";
+        if (expected) {
+          // The kernel does the same operations as the scalar code, but the
+          // compiler is free to contract the latter into fused multiply-adds.
+          EXPECT_NEAR(k, ks[lane], Ruler::epsilon());
+          hit_count++;
+        }
+      }
+    }
+  }
+
+  // Make sure the test is actually testing something.
+  EXPECT_GT(hit_count, 100u);
+}
@@ -0,0 +1,45 @@
+#include "thread-pool.hpp"
+
+#include "gtest/gtest.h"
+
+#include <atomic>
+
+using namespace ray;
+
+TEST(ThreadPoolTest, runs_job_once_per_worker) {
+  const unsigned thread_count = 5;
+  ThreadPool pool(thread_count);
+  ASSERT_EQ(pool.thread_count(), thread_count);
+
+  for (int job_idx = 0; job_idx < 100; job_idx++) {
+    std::atomic<unsigned> calls(0);
+    std::vector<unsigned> worker_calls(thread_count, 0);
+    pool.run([&](unsigned worker_idx, ThreadContext &ctx) {
+      ASSERT_LT(worker_idx, thread_count);
+      EXPECT_EQ(&ctx, &pool.context(worker_idx));
+      worker_calls[worker_idx]++;
+      calls++;
+    });
+
+    // run only returns once every worker is done.
+    EXPECT_EQ(calls.load(), thread_count);
+    for (unsigned c : worker_calls)
+      EXPECT_EQ(c, 1u);
+  }
+}
+
+TEST(ThreadPoolTest, workers_and_contexts_outlive_jobs) {
+  ThreadPool pool(3);
+  std::vector<std::thread::id> first_ids(3);
+  std::vector<ThreadContext *> first_contexts(3);
+  pool.run([&](unsigned worker_idx, ThreadContext &ctx) {
+    first_ids[worker_idx] = std::this_thread::get_id();
+    first_contexts[worker_idx] = &ctx;
+  });
+
+  for (int job_idx = 0; job_idx < 10; job_idx++)
+    pool.run([&](unsigned worker_idx, ThreadContext &ctx) {
+      EXPECT_EQ(first_ids[worker_idx], std::this_thread::get_id());
+      EXPECT_EQ(first_contexts[worker_idx], &ctx);
+    });
+}
@@ -0,0 +1,116 @@
+#include "tiled-image.hpp"
+
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+using namespace ray;
+
+namespace {
+std::string temp_path(const char *name) {
+  return "/tmp/ray-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+Bitmap make_test_image(unsigned height, unsigned width) {
+  Bitmap bmp(height, width, Color());
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++)
+      bmp.at(x, y) = Color(x, y, x * 7 + y);
+  return bmp;
+}
+}
+
+TEST(TiledImageTest, stitch_matches_rows_written) {
+  std::string path = temp_path("stitch.tiles");
+  // Neither side is a multiple of the tile size, and the bands don't line
+  // up with the rows of tiles.
+  const unsigned width = 70, height = 45;
+  Bitmap bmp = make_test_image(height, width);
+  {
+    std::unique_ptr<TiledImageFile> file =
+        TiledImageFile::create(path.c_str(), height, width, 16);
+    ASSERT_TRUE(file != nullptr);
+    EXPECT_EQ(file->columns(), 5u);
+    EXPECT_EQ(file->rows(), 3u);
+    EXPECT_FALSE(file->begin(width, height + 1));
+    ASSERT_TRUE(file->begin(width, height));
+    unsigned first_row = 0;
+    for (unsigned band_height : {7u, 30u, 8u}) {
+      Bitmap band(band_height, width, Color());
+      for (unsigned y = 0; y < band_height; y++)
+        for (unsigned x = 0; x < width; x++)
+          band.at(x, y) = bmp.at(x, first_row + y);
+      ASSERT_TRUE(file->write_rows(band, first_row));
+      first_row += band_height;
+    }
+    EXPECT_TRUE(file->end());
+  }
+
+  std::unique_ptr<TiledImageFile> file = TiledImageFile::open(path.c_str());
+  ASSERT_TRUE(file != nullptr);
+  EXPECT_EQ(file->width(), width);
+  EXPECT_EQ(file->height(), height);
+  EXPECT_EQ(file->tile_size(), 16u);
+
+  Bitmap stitched(height, width, Color());
+  BitmapSink sink(stitched);
+  ASSERT_TRUE(file->stitch(sink));
+  for (unsigned x = 0; x < width; x++)
+    for (unsigned y = 0; y < height; y++) {
+      ASSERT_EQ(stitched.at(x, y).red(), bmp.at(x, y).red());
+      ASSERT_EQ(stitched.at(x, y).green(), bmp.at(x, y).green());
+      ASSERT_EQ(stitched.at(x, y).blue(), bmp.at(x, y).blue());
+    }
+
+  // The corner tile is cut to the image.
+  Bitmap corner(file->tile_height(2), file->tile_width(4), Color());
+  EXPECT_EQ(corner.width(), 6u);
+  EXPECT_EQ(corner.height(), 13u);
+  ASSERT_TRUE(file->read_tile(4, 2, corner));
+  EXPECT_EQ(corner.at(5, 12).green(), bmp.at(69, 44).green());
+  EXPECT_EQ(corner.at(5, 12).blue(), bmp.at(69, 44).blue());
+  unlink(path.c_str());
+}
+
+TEST(TiledImageTest, tiles_are_independent) {
+  std::string path = temp_path("independent.tiles");
+  std::unique_ptr<TiledImageFile> file =
+      TiledImageFile::create(path.c_str(), 20, 20, 8);
+  ASSERT_TRUE(file != nullptr);
+
+  Bitmap tile(8, 4, Color::create_white());
+  ASSERT_TRUE(file->write_tile(2, 1, tile));
+
+  // Tiles that were never written are black.
+  Bitmap stitched(20, 20, Color::create_blue());
+  BitmapSink sink(stitched);
+  ASSERT_TRUE(file->stitch(sink));
+  for (unsigned x = 0; x < 20; x++)
+    for (unsigned y = 0; y < 20; y++)
+      ASSERT_EQ(stitched.at(x, y).red(), x >= 16 && y >= 8 && y < 16 ? 255 : 0)
+          << x << ", " << y;
+  unlink(path.c_str());
+}
+
+TEST(TiledImageTest, bad_files_fail_cleanly) {
+  EXPECT_TRUE(TiledImageFile::create("/nonexistent/dir/out.tiles", 4, 4) ==
+              nullptr);
+  EXPECT_TRUE(TiledImageFile::open("/nonexistent/dir/out.tiles") == nullptr);
+
+  std::string path = temp_path("bad.tiles");
+  {
+    std::ofstream out(path, std::ofstream::binary);
+    out << "BM not a tiled image";
+  }
+  EXPECT_TRUE(TiledImageFile::open(path.c_str()) == nullptr);
+
+  // A valid header on a file that was cut short.
+  ASSERT_TRUE(TiledImageFile::create(path.c_str(), 40, 40, 16) != nullptr);
+  EXPECT_TRUE(TiledImageFile::open(path.c_str()) != nullptr);
+  ASSERT_EQ(truncate(path.c_str(), 1000), 0);
+  EXPECT_TRUE(TiledImageFile::open(path.c_str()) == nullptr);
+  unlink(path.c_str());
+}
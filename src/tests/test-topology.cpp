@@ -0,0 +1,71 @@
+#include "thread-pool.hpp"
+#include "topology.hpp"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+
+using namespace ray;
+
+TEST(TopologyTest, parse_cpu_list) {
+  std::vector<unsigned> ids;
+  ASSERT_TRUE(parse_cpu_list("0", ids));
+  EXPECT_EQ(ids, std::vector<unsigned>({0}));
+  ASSERT_TRUE(parse_cpu_list("0-3,8,10-11\n", ids));
+  EXPECT_EQ(ids, std::vector<unsigned>({0, 1, 2, 3, 8, 10, 11}));
+  ASSERT_TRUE(parse_cpu_list("", ids));
+  EXPECT_TRUE(ids.empty());
+
+  EXPECT_FALSE(parse_cpu_list("a", ids));
+  EXPECT_FALSE(parse_cpu_list("3-1", ids));
+  EXPECT_FALSE(parse_cpu_list("1;2", ids));
+}
+
+TEST(TopologyTest, placement_spreads_over_cores_and_nodes) {
+  // Two nodes with two cores of two hardware threads each, numbered like
+  // Linux numbers them: the second hardware threads of all cores come after
+  // the first ones.
+  std::vector<LogicalCpu> cpus;
+  for (unsigned id = 0; id < 8; id++) {
+    LogicalCpu c;
+    c.id = id;
+    c.node = c.package = (id / 2) % 2;
+    c.core = id % 2;
+    cpus.push_back(c);
+  }
+  CpuTopology topology(cpus);
+  EXPECT_EQ(topology.physical_core_count(), 4u);
+  EXPECT_EQ(topology.node_count(), 2u);
+
+  // First one thread per core, alternating between the nodes, then the
+  // second hardware threads, and then around again.
+  EXPECT_EQ(topology.placement(10),
+            std::vector<unsigned>({0, 2, 1, 3, 4, 6, 5, 7, 0, 2}));
+
+  // A process allowed only both hardware threads of one core, and one of
+  // another core on the other node, gets two cores.
+  CpuTopology restricted = topology.restricted_to({0, 4, 6});
+  EXPECT_EQ(restricted.physical_core_count(), 2u);
+  EXPECT_EQ(restricted.node_count(), 2u);
+  EXPECT_EQ(restricted.placement(4), std::vector<unsigned>({0, 6, 4, 0}));
+}
+
+TEST(TopologyTest, this_machine) {
+  const CpuTopology &topology = CpuTopology::get();
+  ASSERT_FALSE(topology.cpus().empty());
+  EXPECT_GE(topology.physical_core_count(), 1u);
+  EXPECT_LE(topology.physical_core_count(), topology.cpus().size());
+  EXPECT_EQ(default_thread_count(), topology.physical_core_count());
+  EXPECT_EQ(topology.placement(3).size(), 3u);
+
+  // Threads are only placed on CPUs the process may run on, so pinning them
+  // works.
+  std::vector<unsigned> allowed;
+  if (read_process_affinity(allowed)) {
+    for (auto &c : topology.cpus())
+      EXPECT_NE(std::find(allowed.begin(), allowed.end(), c.id),
+                allowed.end());
+  }
+  ThreadPool pool(default_thread_count() + 1);
+  EXPECT_EQ(pool.unpinned_count(), 0u);
+}
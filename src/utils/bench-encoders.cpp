@@ -0,0 +1,141 @@
+#include "bitmap.hpp"
+#include "image-encoders.hpp"
+#include "scene-generators.hpp"
+#include "support.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <streambuf>
+#include <string>
+
+using namespace ray;
+using namespace std;
+
+namespace {
+/// A stream buffer that counts and throws away everything written to it, to
+/// time the encoding without the I/O.
+class NullBuffer : public std::streambuf {
+public:
+  uint64_t byte_count = 0;
+
+protected:
+  int overflow(int c) override {
+    byte_count++;
+    return c;
+  }
+  std::streamsize xsputn(const char *, std::streamsize n) override {
+    byte_count += n;
+    return n;
+  }
+};
+}
+
+static void print_usage() {
+  printf_cr("usage: ./bench-encoders [ --threads thread-count ]"
+            " [ --scene scene-name | width height ] [ frame-count ]");
+  printf_cr("  encodes frame-count (default 10) frames of width x height"
+            " (default 4000 x 3000) pixels, or the image of scene-name, in"
+            " every format, to memory and to /tmp/bench.ext, and prints the"
+            " throughput of each in megabytes of pixels per second");
+}
+
+/// Write \p bmp as \p format to a stream from \p make_stream \p frame_count
+/// times, and print the throughput.
+template <typename MakeStreamTy>
+static void bench(const char *what, const Bitmap &bmp, ImageFormatTy format,
+                  ThreadPool &pool, unsigned frame_count,
+                  MakeStreamTy make_stream) {
+  double seconds = 0.0;
+  for (unsigned i = 0; i < frame_count; i++) {
+    auto start = std::chrono::steady_clock::now();
+    auto out = make_stream();
+    write_image(bmp, format, *out, pool);
+    out.reset();
+    seconds += std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  }
+
+  uint64_t bytes = frame_count * (uint64_t(bmp.width()) * bmp.height() * 3);
+  printf_cr("  %s: %u frames in %.1fms: %.1f MB/s", what, frame_count,
+            seconds * 1000.0, bytes / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  unsigned width = 4000, height = 3000, frame_count = 10;
+  unsigned thread_count = default_thread_count();
+  const char *scene_name = nullptr;
+
+  argc--;
+  argv++;
+  if (argc >= 2 && !strcmp(argv[0], "--threads")) {
+    thread_count = strtoul(argv[1], nullptr, 10);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc >= 2 && !strcmp(argv[0], "--scene")) {
+    scene_name = argv[1];
+    argc -= 2;
+    argv += 2;
+  } else if (argc >= 2) {
+    width = strtoul(argv[0], nullptr, 10);
+    height = strtoul(argv[1], nullptr, 10);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc == 1)
+    frame_count = strtoul(argv[0], nullptr, 10);
+  if (argc > 1 || width == 0 || height == 0 || frame_count == 0 ||
+      thread_count == 0) {
+    print_usage();
+    return 1;
+  }
+
+  ThreadPool pool(thread_count);
+  std::unique_ptr<Bitmap> bmp;
+  if (scene_name) {
+    SceneGeneratorTy scene_gen = get_scene_generator_by_name(scene_name);
+    if (!scene_gen) {
+      printf_cr("unknown scene: \"%s\"", scene_name);
+      return 1;
+    }
+    Scene s;
+    Camera c = scene_gen(s, 0.0);
+    s.build_bvh();
+    bmp = make_unique<Bitmap>(c.snap(s, pool));
+  } else {
+    bmp = make_unique<Bitmap>(height, width, Color::create_blue());
+    for (unsigned y = 0; y < height; y++)
+      for (unsigned x = 0; x < width; x++)
+        bmp->at(x, y) = Color(x, y, x ^ y);
+  }
+
+  printf_cr("%ux%u pixels, %u threads", bmp->width(), bmp->height(),
+            pool.thread_count());
+  const struct {
+    const char *name;
+    ImageFormatTy format;
+  } formats[] = {{"bmp", ImageFormatTy::bmp},
+                 {"png-stored", ImageFormatTy::png_stored},
+                 {"png", ImageFormatTy::png},
+                 {"qoi", ImageFormatTy::qoi}};
+  for (const auto &f : formats) {
+    printf_cr("%s:", f.name);
+    NullBuffer null_buffer;
+    bench("memory", *bmp, f.format, pool, frame_count,
+          [&]() { return make_unique<std::ostream>(&null_buffer); });
+    printf_cr("  size: %.1f%% of the pixels'",
+              100.0 * null_buffer.byte_count / frame_count /
+                  (uint64_t(bmp->width()) * bmp->height() * 3));
+
+    std::string path =
+        std::string("/tmp/bench.") + image_format_extension(f.format);
+    bench(path.c_str(), *bmp, f.format, pool, frame_count, [&]() {
+      return make_unique<std::ofstream>(path, std::ofstream::binary);
+    });
+  }
+  return 0;
+}
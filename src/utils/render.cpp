@@ -1,35 +1,329 @@
+#include "animation.hpp"
+#include "distributed.hpp"
+#include "image-encoders.hpp"
 #include "scene.hpp"
 #include "scene-generators.hpp"
+#include "tiled-image.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <unistd.h>
 
 using namespace ray;
 using namespace std;
 
+struct Arguments {
+  std::string scene_name;
+  std::string exec_name;
+  std::string logfile;
+  unsigned thread_count = default_thread_count();
+  BVHSplitTy bvh_split = BVHSplitTy::sah;
+  ObjectStorageTy object_storage = ObjectStorageTy::type_batched;
+  unsigned packet_size = 16;
+  double budget_seconds = -1.0;
+  unsigned samples_per_pixel = 1;
+  TileOrderTy tile_order = TileOrderTy::hilbert;
+  unsigned process_count = 0;
+  unsigned frame_count = 0;
+  double frames_per_second = 24.0;
+  bool map_output = false;
+  ImageFormatTy output_format = ImageFormatTy::bmp;
+  bool write_pfm = false;
+  bool stream_output = false;
+  bool tiled_output = false;
+};
+
 static void print_usage() {
-  printf_cr("usage: ./render [ --threads thread-count ]" LOGGING_ONLY(
-      " [ --log logfile ]") " scene-name");
-  printf_cr("  thread-count has to be a positive integer in [1, 1024)");
+  printf_cr("usage: ./render [ --threads thread-count ] [ --bvh split ]"
+            " [ --storage storage ] [ --packet packet-size ]"
+            " [ --budget seconds ] [ --samples samples ] [ --order order ]"
+            " [ --processes process-count ] [ --frames frame-count ]"
+            " [ --fps frames-per-second ] [ --mmap ] [ --format format ]"
+            " [ --pfm ] [ --stream ] [ --tiled ]"
+            LOGGING_ONLY(" [ --log logfile ]") " scene-name");
+  printf_cr("  thread-count has to be a positive integer in [1, 1024), and"
+            " defaults to the number of physical cores");
+  printf_cr("  process-count has to be a positive integer in [1, 1024); each"
+            " process renders tiles with thread-count threads, which defaults"
+            " to the physical cores divided among the processes, and there is"
+            " no budget or log");
+  printf_cr("  --mmap renders straight into /tmp/out.bmp mapped into memory,"
+            " with no budget, log or format");
+  printf_cr("  frame-count frames of an animation are written to"
+            " /tmp/out-NNNN.ext, at frames-per-second (default 24); there is"
+            " no budget, log, process-count or mmap");
+  printf_cr("  format is the format of the image, /tmp/out.ext, one of \"bmp\""
+            " (default), \"png\", \"png-stored\" or \"qoi\"");
+  printf_cr("  --stream writes the image to stdout in format, a band of rows"
+            " at a time as soon as each is rendered, with no budget, mmap,"
+            " pfm, log, process-count or frame-count");
+  printf_cr("  --tiled renders the image into tiles in /tmp/out.ext.tiles,"
+            " and then stitches them into the image and removes the tiles,"
+            " without the whole image in memory, with no budget, mmap, pfm,"
+            " stream, log, process-count or frame-count");
+  printf_cr("  --pfm also writes the image before tone mapping to"
+            " /tmp/out.pfm, with no budget, mmap, process-count or"
+            " frame-count");
+  printf_cr("  split is one of \"sah\" (default) or \"median\"");
+  printf_cr("  storage is one of \"type-batched\" (default) or \"per-object\"");
+  printf_cr("  packet-size is one of 1, 4, 8 or 16 (default)");
+  printf_cr("  seconds is the time budget of a progressive render");
+  printf_cr("  samples is the number of samples for pixels on edges, one of 1"
+            " (default), 4, 9 or 16");
+  printf_cr("  order is one of \"hilbert\" (default), \"morton\" or"
+            " \"column-major\"");
   printf_cr("scene names:");
   for_each_scene_generator([&](const char *sg_name, SceneGeneratorTy) {
     printf_cr("  %s", sg_name);
   });
 }
 
-static void do_scene(std::function<Camera(Scene &s)> scene_gen,
-                     unsigned thread_count, std::string logfile) {
+/// Build the scene of \p scene_gen at \p time into \p s, and set up the
+/// scene and the camera as \p args says.
+static Camera setup_scene(const SceneGeneratorTy &scene_gen, Scene &s,
+                          double time, const Arguments &args) {
+  Camera c = scene_gen(s, time);
+
+  BVHBuildOptions bvh_options;
+  bvh_options.split = args.bvh_split;
+  bvh_options.thread_count = args.thread_count;
+  s.set_object_storage(args.object_storage);
+  s.build_bvh(bvh_options);
+
+  c.set_packet_size(args.packet_size);
+  c.set_supersampling(args.samples_per_pixel);
+  c.set_tile_order(args.tile_order);
+  return c;
+}
+
+/// Print \p stats, the statistics of a render, to \p out along with the
+/// precision it was rendered with.
+template <typename StatsTy>
+static void print_render_stats(FILE *out, const StatsTy &stats) {
+  std::ostringstream description;
+  description << stats;
+  fprintf(out, "Rendered with %s precision: %s\n",
+          sizeof(Ruler::Real) == sizeof(float) ? "float" : "double",
+          description.str().c_str());
+}
+
+/// Write \p bmp to \p path in args.output_format, encoding on the threads of
+/// \p pool, and print how long it took.  Returns false if writing failed.
+static bool write_output(const Bitmap &bmp, const std::string &path,
+                         const Arguments &args, ThreadPool &pool) {
+  auto start = std::chrono::steady_clock::now();
+  bool succeeded;
+  {
+    ofstream out(path, std::ofstream::binary);
+    succeeded = write_image(bmp, args.output_format, out, pool);
+  }
+  if (!succeeded) {
+    printf_cr("could not write %s", path.c_str());
+    return false;
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  printf_cr("Wrote %s in %.1fms", path.c_str(), seconds * 1000.0);
+  return true;
+}
+
+static std::string output_path(const Arguments &args) {
+  return std::string("/tmp/out.") + image_format_extension(args.output_format);
+}
+
+/// Render the scene with args.process_count worker processes.  Returns false
+/// if they or writing the image failed.
+static bool do_distributed_scene(const SceneGeneratorTy &scene_gen,
+                                 const Arguments &args) {
+  DistributedOptions options;
+  options.process_count = args.process_count;
+  options.threads_per_process = args.thread_count;
+  DistributedStats stats;
+  std::unique_ptr<Bitmap> bmp = render_distributed(
+      [&](Scene &s, double time) {
+        return setup_scene(scene_gen, s, time, args);
+      },
+      options, &stats);
+  print_render_stats(stdout, stats);
+  if (!bmp) {
+    printf_cr("Every worker process failed");
+    return false;
+  }
+
+  ThreadPool pool(args.thread_count);
+  return write_output(*bmp, output_path(args), args, pool);
+}
+
+/// Render the scene of \p scene_gen to stdout, a band of rows at a time.
+/// Everything else goes to stderr.  Returns false if writing failed.
+static bool do_streaming_scene(const SceneGeneratorTy &scene_gen,
+                               const Arguments &args) {
+  Scene s;
+  Camera c = setup_scene(scene_gen, s, 0.0, args);
+  std::cerr << "Built BVH: " << s.bvh_stats() << std::endl;
+
+  // Each band is encoded while the next one renders, so the encoder gets a
+  // pool of its own.
+  ThreadPool pool(args.thread_count), encode_pool(args.thread_count, false);
+  std::unique_ptr<ImageSink> writer =
+      create_image_writer(args.output_format, std::cout, encode_pool);
+  bool succeeded = c.snap_streaming(s, pool, *writer);
+  std::cout.flush();
+  print_render_stats(stderr, c.render_stats());
+  if (!succeeded)
+    std::cerr << "Could not write the image to stdout" << std::endl;
+  return succeeded;
+}
+
+/// Render the scene of \p scene_gen into a tiles file next to the image, a
+/// band of rows at a time, and then stitch the tiles into the image and
+/// remove the tiles file.  Returns false if writing either file failed.
+static bool do_tiled_scene(const SceneGeneratorTy &scene_gen,
+                           const Arguments &args) {
   Scene s;
-  Camera c = scene_gen(s);
+  Camera c = setup_scene(scene_gen, s, 0.0, args);
+  std::ostringstream bvh_description;
+  bvh_description << s.bvh_stats();
+  printf_cr("Built BVH: %s", bvh_description.str().c_str());
+
+  std::string path = output_path(args);
+  std::string tiles_path = path + ".tiles";
+  std::unique_ptr<TiledImageFile> tiles = TiledImageFile::create(
+      tiles_path.c_str(), c.screen_height_px(), c.screen_width_px());
+  if (!tiles) {
+    printf_cr("could not create %s", tiles_path.c_str());
+    return false;
+  }
+  ThreadPool pool(args.thread_count);
+  bool succeeded = c.snap_streaming(s, pool, *tiles);
+  print_render_stats(stdout, c.render_stats());
+  if (!succeeded) {
+    printf_cr("could not write %s", tiles_path.c_str());
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    ofstream out(path, std::ofstream::binary);
+    std::unique_ptr<ImageSink> writer =
+        create_image_writer(args.output_format, out, pool);
+    succeeded = tiles->stitch(*writer) && out.good();
+  }
+  if (!succeeded) {
+    printf_cr("could not stitch %s", path.c_str());
+    return false;
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  printf_cr("Stitched %s in %.1fms", path.c_str(), seconds * 1000.0);
+
+  tiles.reset();
+  if (unlink(tiles_path.c_str()) != 0)
+    printf_cr("could not remove %s", tiles_path.c_str());
+  return true;
+}
+
+/// Render args.frame_count frames of the animation of \p scene_gen.  Returns
+/// false if writing any of the frames failed.
+static bool do_animation(const SceneGeneratorTy &scene_gen,
+                         const Arguments &args) {
+  // Frames are written while the next one renders, so they get a pool of
+  // their own.
+  ThreadPool pool(args.thread_count), encode_pool(args.thread_count, false);
+  AnimationStats stats;
+  // Only written by the frame writer, which writes one frame at a time.
+  bool succeeded = true;
+  render_animation(
+      [&](Scene &s, double time) {
+        return setup_scene(scene_gen, s, time, args);
+      },
+      args.frame_count, args.frames_per_second, pool,
+      [&](unsigned frame_idx, const Bitmap &bmp) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/out-%04u.%s", frame_idx,
+                 image_format_extension(args.output_format));
+        ofstream out(path, std::ofstream::binary);
+        if (!write_image(bmp, args.output_format, out, encode_pool)) {
+          printf_cr("could not write %s", path);
+          succeeded = false;
+        }
+      },
+      &stats);
+  print_render_stats(stdout, stats);
+  return succeeded;
+}
+
+/// Render the scene of \p scene_gen as \p args ask.  Returns false if the
+/// render or writing the image failed.
+static bool do_scene(const SceneGeneratorTy &scene_gen,
+                     const Arguments &args) {
+  if (args.stream_output)
+    return do_streaming_scene(scene_gen, args);
+
+  if (args.tiled_output) {
+    if (!do_tiled_scene(scene_gen, args))
+      return false;
+    printf_cr("Finished rendering, opening image");
+    system(("open " + output_path(args)).c_str());
+    return true;
+  }
+
+  if (args.frame_count != 0)
+    return do_animation(scene_gen, args);
+
+  if (args.process_count != 0) {
+    if (!do_distributed_scene(scene_gen, args))
+      return false;
+    printf_cr("Finished rendering, opening image");
+    system(("open " + output_path(args)).c_str());
+    return true;
+  }
+
+  Scene s;
+  Camera c = setup_scene(scene_gen, s, 0.0, args);
+  std::cout << "Built BVH: " << s.bvh_stats() << std::endl;
   std::vector<std::string> logs;
+  const std::string &logfile = args.logfile;
 
-  Bitmap bmp = c.snap(s, thread_count, logfile.empty() ? nullptr : &logs);
-  ofstream out("/tmp/out.bmp", std::ofstream::binary);
-  bmp.write(out);
+  if (args.map_output) {
+    // The render threads write straight into the file.
+    std::unique_ptr<Bitmap> bmp = Bitmap::create_mapped_file(
+        "/tmp/out.bmp", c.screen_height_px(), c.screen_width_px());
+    if (!bmp) {
+      printf_cr("could not map /tmp/out.bmp");
+      return false;
+    }
+    c.snap_into(s, *bmp, args.thread_count);
+  } else {
+    // The same threads render the image and then encode it.
+    ThreadPool pool(args.thread_count);
+    std::vector<std::string> *logs_ptr = logfile.empty() ? nullptr : &logs;
+    if (args.write_pfm) {
+      HdrBitmap hdr = c.snap_hdr(s, pool, logs_ptr);
+      {
+        ofstream out("/tmp/out.pfm", std::ofstream::binary);
+        hdr.write_pfm(out);
+      }
+      if (!write_output(hdr.tone_map(), output_path(args), args, pool))
+        return false;
+    } else {
+      Bitmap bmp = args.budget_seconds < 0.0
+                       ? c.snap(s, pool, logs_ptr)
+                       : c.snap_progressive(s, pool, args.budget_seconds);
+      if (!write_output(bmp, output_path(args), args, pool))
+        return false;
+    }
+  }
+  print_render_stats(stdout, c.render_stats());
 
   if (!logfile.empty()) {
     printf_cr("Finished rendering, writing logs");
@@ -45,32 +339,26 @@ static void do_scene(std::function<Camera(Scene &s)> scene_gen,
   }
 
   printf_cr("Finished rendering, opening image");
-  system("open /tmp/out.bmp");
+  system(("open " + output_path(args)).c_str());
+  return true;
 }
 
-static void do_scene(const char *scene_name, unsigned thread_count,
-                     const std::string &logfile) {
-  if (auto sg = get_scene_generator_by_name(scene_name)) {
-    do_scene(sg, thread_count, logfile);
-    return;
-  }
+static bool do_scene(const Arguments &args) {
+  const char *scene_name = args.scene_name.c_str();
+  if (auto sg = get_scene_generator_by_name(scene_name))
+    return do_scene(sg, args);
 
   printf_cr("unknown scene: \"%s\"", scene_name);
   print_usage();
+  return false;
 }
 
-struct Arguments {
-  std::string scene_name;
-  std::string exec_name;
-  std::string logfile;
-  unsigned thread_count = 12;
-};
-
 static bool parse_args(Arguments &args, int argc, char **argv) {
   args.exec_name = argv[0];
   argc--;
   argv++;
   bool found_non_pos_arg = false;
+  bool found_thread_count = false;
 
   while (argc != 0) {
     char *current = argv[0];
@@ -92,6 +380,167 @@ static bool parse_args(Arguments &args, int argc, char **argv) {
             val >= 1024)
           return false;
         args.thread_count = val;
+        found_thread_count = true;
+      } else if (!strcmp(current, "--processes")) {
+        if (argc == 0)
+          return false;
+
+        char *process_count_str = argv[0];
+        argc--;
+        argv++;
+
+        char *endptr;
+        long val = strtol(process_count_str, &endptr, 10);
+        if (endptr != &process_count_str[strlen(process_count_str)] ||
+            val < 1 || val >= 1024)
+          return false;
+        args.process_count = val;
+      } else if (!strcmp(current, "--frames")) {
+        if (argc == 0)
+          return false;
+
+        char *frame_count_str = argv[0];
+        argc--;
+        argv++;
+
+        char *endptr;
+        long val = strtol(frame_count_str, &endptr, 10);
+        if (endptr != &frame_count_str[strlen(frame_count_str)] || val < 1 ||
+            val >= 10000)
+          return false;
+        args.frame_count = val;
+      } else if (!strcmp(current, "--fps")) {
+        if (argc == 0)
+          return false;
+
+        char *fps_str = argv[0];
+        argc--;
+        argv++;
+
+        char *endptr;
+        double val = strtod(fps_str, &endptr);
+        if (endptr != &fps_str[strlen(fps_str)] || !(val > 0.0))
+          return false;
+        args.frames_per_second = val;
+      } else if (!strcmp(current, "--mmap")) {
+        args.map_output = true;
+      } else if (!strcmp(current, "--stream")) {
+        args.stream_output = true;
+      } else if (!strcmp(current, "--tiled")) {
+        args.tiled_output = true;
+      } else if (!strcmp(current, "--pfm")) {
+        args.write_pfm = true;
+      } else if (!strcmp(current, "--format")) {
+        if (argc == 0)
+          return false;
+
+        char *format = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(format, "bmp"))
+          args.output_format = ImageFormatTy::bmp;
+        else if (!strcmp(format, "png"))
+          args.output_format = ImageFormatTy::png;
+        else if (!strcmp(format, "png-stored"))
+          args.output_format = ImageFormatTy::png_stored;
+        else if (!strcmp(format, "qoi"))
+          args.output_format = ImageFormatTy::qoi;
+        else
+          return false;
+      } else if (!strcmp(current, "--bvh")) {
+        if (argc == 0)
+          return false;
+
+        char *split = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(split, "sah"))
+          args.bvh_split = BVHSplitTy::sah;
+        else if (!strcmp(split, "median"))
+          args.bvh_split = BVHSplitTy::median;
+        else
+          return false;
+      } else if (!strcmp(current, "--storage")) {
+        if (argc == 0)
+          return false;
+
+        char *storage = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(storage, "type-batched"))
+          args.object_storage = ObjectStorageTy::type_batched;
+        else if (!strcmp(storage, "per-object"))
+          args.object_storage = ObjectStorageTy::per_object;
+        else
+          return false;
+      } else if (!strcmp(current, "--packet")) {
+        if (argc == 0)
+          return false;
+
+        char *packet_size = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(packet_size, "1"))
+          args.packet_size = 1;
+        else if (!strcmp(packet_size, "4"))
+          args.packet_size = 4;
+        else if (!strcmp(packet_size, "8"))
+          args.packet_size = 8;
+        else if (!strcmp(packet_size, "16"))
+          args.packet_size = 16;
+        else
+          return false;
+      } else if (!strcmp(current, "--samples")) {
+        if (argc == 0)
+          return false;
+
+        char *samples = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(samples, "1"))
+          args.samples_per_pixel = 1;
+        else if (!strcmp(samples, "4"))
+          args.samples_per_pixel = 4;
+        else if (!strcmp(samples, "9"))
+          args.samples_per_pixel = 9;
+        else if (!strcmp(samples, "16"))
+          args.samples_per_pixel = 16;
+        else
+          return false;
+      } else if (!strcmp(current, "--order")) {
+        if (argc == 0)
+          return false;
+
+        char *order = argv[0];
+        argc--;
+        argv++;
+
+        if (!strcmp(order, "hilbert"))
+          args.tile_order = TileOrderTy::hilbert;
+        else if (!strcmp(order, "morton"))
+          args.tile_order = TileOrderTy::morton;
+        else if (!strcmp(order, "column-major"))
+          args.tile_order = TileOrderTy::column_major;
+        else
+          return false;
+      } else if (!strcmp(current, "--budget")) {
+        if (argc == 0)
+          return false;
+
+        char *budget_str = argv[0];
+        argc--;
+        argv++;
+
+        char *endptr;
+        double val = strtod(budget_str, &endptr);
+        if (endptr != &budget_str[strlen(budget_str)] || !(val >= 0.0))
+          return false;
+        args.budget_seconds = val;
       } else if (NO_LOGGING(false && ) !strcmp(current, "--log")) {
         if (argc == 0)
           return false;
@@ -112,6 +561,36 @@ static bool parse_args(Arguments &args, int argc, char **argv) {
     }
   }
 
+  // Worker processes share the cores, instead of each taking all of them.
+  if (args.process_count != 0 && !found_thread_count)
+    args.thread_count = std::max(args.thread_count / args.process_count, 1u);
+
+  if (args.process_count != 0 &&
+      (args.budget_seconds >= 0.0 || !args.logfile.empty()))
+    return false;
+  // A mapped file is always a BMP file, rendered with no budget or log.
+  if (args.map_output &&
+      (args.output_format != ImageFormatTy::bmp ||
+       args.budget_seconds >= 0.0 || !args.logfile.empty()))
+    return false;
+  if (args.frame_count != 0 &&
+      (args.budget_seconds >= 0.0 || !args.logfile.empty() ||
+       args.process_count != 0 || args.map_output))
+    return false;
+  if (args.write_pfm && (args.budget_seconds >= 0.0 || args.map_output ||
+                         args.process_count != 0 || args.frame_count != 0))
+    return false;
+  if (args.stream_output &&
+      (args.budget_seconds >= 0.0 || args.map_output || args.write_pfm ||
+       !args.logfile.empty() || args.process_count != 0 ||
+       args.frame_count != 0))
+    return false;
+  if (args.tiled_output &&
+      (args.budget_seconds >= 0.0 || args.map_output || args.write_pfm ||
+       args.stream_output || !args.logfile.empty() ||
+       args.process_count != 0 || args.frame_count != 0))
+    return false;
+
   return true;
 }
 
@@ -122,6 +601,5 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  do_scene(args.scene_name.c_str(), args.thread_count, args.logfile);
-  return 0;
+  return do_scene(args) ? 0 : 1;
 }